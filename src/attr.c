@@ -0,0 +1,94 @@
+// clang-format off
+#define _GNU_SOURCE
+#include "attr.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "compress.h"
+#include "config.h"
+#include "dedup.h"
+#include "durable.h"
+#include "meta.h"
+#include "pack.h"
+
+int64_t attr_mtime_ns(const struct stat *st)
+{
+    return (int64_t)st->st_mtim.tv_sec * NSEC_PER_SEC + st->st_mtim.tv_nsec;
+}
+
+// headers and pack index written before nanoseconds held whole seconds,
+// no real nanosecond time is that small so they are told apart by size
+int64_t attr_stored_ns(int64_t stored)
+{
+    if (stored > -ATTR_LEGACY_LIMIT && stored < ATTR_LEGACY_LIMIT)
+        return stored * NSEC_PER_SEC;
+    return stored;
+}
+
+int attr_same_mtime(const struct stat *a, const struct stat *b)
+{
+    return a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+// settin both times with full precision, symlinks get their own times not the target's
+void attr_copy_times(const char *path, const struct stat *st)
+{
+    struct timespec times[2] = {st->st_atim, st->st_mtim};
+    utimensat(AT_FDCWD, path, times, AT_SYMLINK_NOFOLLOW);
+}
+
+// for files restored from a header, access time is set to the same
+void attr_set_mtime_ns(const char *path, int64_t mtime_ns)
+{
+    struct timespec t = {mtime_ns / NSEC_PER_SEC, mtime_ns % NSEC_PER_SEC};
+    if (t.tv_nsec < 0)
+    {
+        t.tv_sec--;
+        t.tv_nsec += NSEC_PER_SEC;
+    }
+    struct timespec times[2] = {t, t};
+    utimensat(AT_FDCWD, path, times, 0);
+}
+
+// ownership only sticks when we run as root or keep our own uid, other cases are left as they are
+void attr_copy_owner(const char *path, const struct stat *st)
+{
+    if (lchown(path, st->st_uid, st->st_gid) == -1 && errno != EPERM)
+        perror("lchown");
+}
+
+// applyin mode, owner and times of source to its backup without touchin the data,
+// dedup and compressed targets keep mode and time in their header, packed ones in the index
+int attr_sync(const char *source_path, const char *dest_path)
+{
+    struct stat src, dst;
+    if (lstat(source_path, &src) == -1)
+        return errno == ENOENT ? 0 : -1;
+    target_format_t format = meta_get_root() ? config_current()->format : FORMAT_PLAIN;
+    if (format == FORMAT_PACKED && pack_contains(dest_path))
+        return pack_update_attrs(dest_path, &src);
+    if (lstat(dest_path, &dst) == -1)
+        return errno == ENOENT ? 0 : -1;
+
+    if (S_ISREG(src.st_mode) && format == FORMAT_DEDUP)
+    {
+        if (dedup_update_attrs(dest_path, &src) == -1)
+            return -1;
+    }
+    else if (S_ISREG(src.st_mode) && format == FORMAT_COMPRESSED)
+    {
+        if (compress_update_attrs(dest_path, &src) == -1)
+            return -1;
+    }
+    else if (!S_ISLNK(src.st_mode) && (dst.st_mode & 0777) != (src.st_mode & 0777) &&
+             chmod(dest_path, src.st_mode & 0777) == -1)
+    {
+        return -1;
+    }
+
+    if (src.st_uid != dst.st_uid || src.st_gid != dst.st_gid)
+        attr_copy_owner(dest_path, &src);
+    attr_copy_times(dest_path, &src);
+    return 0;
+}
@@ -0,0 +1,19 @@
+// clang-format off
+#ifndef ATTR_H
+#define ATTR_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+#define NSEC_PER_SEC 1000000000LL
+#define ATTR_LEGACY_LIMIT (NSEC_PER_SEC * 1000)
+
+int64_t attr_mtime_ns(const struct stat *st);
+int64_t attr_stored_ns(int64_t stored);
+int attr_same_mtime(const struct stat *a, const struct stat *b);
+void attr_copy_times(const char *path, const struct stat *st);
+void attr_set_mtime_ns(const char *path, int64_t mtime_ns);
+void attr_copy_owner(const char *path, const struct stat *st);
+int attr_sync(const char *source_path, const char *dest_path);
+
+#endif
@@ -1,7 +1,6 @@
 // clang-format off
 #define _GNU_SOURCE
 #include "backup.h"
-#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
@@ -12,6 +11,21 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include "attr.h"
+#include "compress.h"
+#include "config.h"
+#include "dedup.h"
+#include "delta.h"
+#include "durable.h"
+#include "epoch.h"
+#include "filter.h"
+#include "hardlink.h"
+#include "iosched.h"
+#include "large_copy.h"
+#include "meta.h"
+#include "pack.h"
+#include "signals.h"
+#include "walk.h"
 
 #define ERR(source) (perror(source), fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), exit(EXIT_FAILURE))
 
@@ -53,6 +67,14 @@ ssize_t bulk_write(int fd, char* buf, size_t count)
     return len;
 }
 
+// settin owner and file times to match original, times to the nanosecond
+static void set_file_times(const char* dest_path, const struct stat* source_stat)
+{
+    if (source_stat->st_uid != geteuid() || source_stat->st_gid != getegid())
+        attr_copy_owner(dest_path, source_stat);
+    attr_copy_times(dest_path, source_stat);
+}
+
 // copyin file from src to dst, also preservs the time
 int copy_file(const char* source_path, const char* dest_path)
 {
@@ -66,6 +88,54 @@ int copy_file(const char* source_path, const char* dest_path)
         ERR("Failed to get source file info");
     }
 
+    // dedup targets keep only a manifest, the data goes to the chunk store
+    if (config_current()->format == FORMAT_DEDUP && meta_get_root())
+    {
+        if (dedup_store_file(source_path, dest_path, &source_stat) == -1)
+        {
+            if (errno == ENOENT)
+            {
+                return -1;
+            }
+            ERR("Failed to store file in chunk store");
+        }
+        set_file_times(dest_path, &source_stat);
+        return EXIT_SUCCESS;
+    }
+
+    // compressed targets store lz blocks, original size and time go in the header
+    if (config_current()->format == FORMAT_COMPRESSED && meta_get_root())
+    {
+        if (compress_store_file(source_path, dest_path, &source_stat) == -1)
+        {
+            if (errno == ENOENT)
+            {
+                return -1;
+            }
+            ERR("Failed to write compressed file");
+        }
+        set_file_times(dest_path, &source_stat);
+        return EXIT_SUCCESS;
+    }
+
+    // packed targets append small files to pack files, big ones stay regular files
+    if (config_current()->format == FORMAT_PACKED && meta_get_root())
+    {
+        if (source_stat.st_size < PACK_MAX_FILE)
+        {
+            if (pack_store_file(source_path, dest_path, &source_stat) == -1)
+            {
+                if (errno == ENOENT)
+                {
+                    return -1;
+                }
+                ERR("Failed to append file to pack");
+            }
+            return EXIT_SUCCESS;
+        }
+        pack_forget(dest_path);
+    }
+
     const int source_fd = open(source_path, O_RDONLY);
     if (source_fd == -1)
     {
@@ -76,41 +146,101 @@ int copy_file(const char* source_path, const char* dest_path)
         ERR("Failed to open source file");
     }
 
-    const int dest_fd = open(dest_path, O_WRONLY | O_CREAT | O_TRUNC, source_stat.st_mode & 0777);
+    // files that only grew get just the new tail, big files already in the backup
+    // get only their changed blocks rewritten
+    int ret = copy_file_append(source_fd, &source_stat, dest_path);
+    if (ret == -1)
+    {
+        close(source_fd);
+        ERR("Failed to append to destination file");
+    }
+    if (ret == 0)
+    {
+        close(source_fd);
+        durable_written_path(dest_path);
+        set_file_times(dest_path, &source_stat);
+        return EXIT_SUCCESS;
+    }
+    if (source_stat.st_size >= DELTA_THRESHOLD)
+    {
+        ret = copy_file_delta(source_fd, &source_stat, dest_path);
+        if (ret == -1)
+        {
+            close(source_fd);
+            ERR("Failed to update destination file in place");
+        }
+        if (ret == 0)
+        {
+            close(source_fd);
+            durable_written_path(dest_path);
+            set_file_times(dest_path, &source_stat);
+            save_append_state(&source_stat, dest_path);
+            return EXIT_SUCCESS;
+        }
+    }
+
+    // writin into temp file and renamin it over, nobody reads a half copied file
+    char tmp_path[PATH_MAX];
+    const int dest_fd = staged_open(dest_path, source_stat.st_mode, tmp_path);
     if (dest_fd == -1)
     {
         close(source_fd);
         ERR("Failed to create destination file");
     }
 
-    char buffer[FILE_BUF_LEN];
-    for (;;)
+    // huge files get split between threads, big images go through the O_DIRECT path,
+    // everything else the usual buffered loop
+    if (source_stat.st_size >= PARALLEL_COPY_THRESHOLD)
     {
-        const ssize_t bytes_read = bulk_read(source_fd, buffer, FILE_BUF_LEN);
-        if (bytes_read == -1)
+        if (copy_file_parallel(source_fd, dest_fd, source_stat.st_size) == -1)
         {
             close(source_fd);
-            close(dest_fd);
-            ERR("Failed to read from source file");
+            staged_abort(dest_fd, tmp_path);
+            ERR("Failed to copy huge file");
         }
-        if (bytes_read == 0)
+    }
+    else if (source_stat.st_size >= LARGE_FILE_THRESHOLD)
+    {
+        if (copy_file_large(source_path, source_fd, dest_fd, source_stat.st_size) == -1)
         {
-            break;
+            close(source_fd);
+            staged_abort(dest_fd, tmp_path);
+            ERR("Failed to copy large file");
         }
-        if (bulk_write(dest_fd, buffer, bytes_read) == -1)
+    }
+    else
+    {
+        char buffer[FILE_BUF_LEN];
+        for (;;)
         {
-            close(source_fd);
-            close(dest_fd);
-            ERR("Failed to write to destination file");
+            const ssize_t bytes_read = bulk_read(source_fd, buffer, FILE_BUF_LEN);
+            if (bytes_read == -1)
+            {
+                close(source_fd);
+                staged_abort(dest_fd, tmp_path);
+                ERR("Failed to read from source file");
+            }
+            if (bytes_read == 0)
+            {
+                break;
+            }
+            iosched_charge(bytes_read);
+            if (bulk_write(dest_fd, buffer, bytes_read) == -1)
+            {
+                close(source_fd);
+                staged_abort(dest_fd, tmp_path);
+                ERR("Failed to write to destination file");
+            }
         }
     }
 
     close(source_fd);
-    close(dest_fd);
-
-    // settin file times to match original
-    struct timeval times[2] = {{source_stat.st_atime, 0}, {source_stat.st_mtime, 0}};
-    utimes(dest_path, times);
+    set_file_times(tmp_path, &source_stat);
+    if (staged_commit(dest_fd, tmp_path, dest_path) == -1)
+    {
+        ERR("Failed to move destination file in place");
+    }
+    save_append_state(&source_stat, dest_path);
 
     return EXIT_SUCCESS;
 }
@@ -130,15 +260,14 @@ int copy_symlink(const char* path_src, const char* path_dst, const char* source_
     // if link points to file in source, redirect to target
     if (link_buf[0] == '/')
     {
-        char* real_src = realpath(source_base, NULL);
-        char* real_tgt = realpath(target_base, NULL);
+        // bases are resolved once per process, not for every link
+        const char* real_src = walk_realpath(source_base);
+        const char* real_tgt = walk_realpath(target_base);
 
         if (real_src && real_tgt && strncmp(link_buf, real_src, strlen(real_src)) == 0)
         {
             char new_path[PATH_MAX];
             snprintf(new_path, PATH_MAX, "%s%s", real_tgt, link_buf + strlen(real_src));
-            free(real_src);
-            free(real_tgt);
             if (symlink(new_path, path_dst) == -1)
             {
                 perror("symlink");
@@ -146,8 +275,6 @@ int copy_symlink(const char* path_src, const char* path_dst, const char* source_
             }
             return EXIT_SUCCESS;
         }
-        free(real_src);
-        free(real_tgt);
     }
 
     if (symlink(link_buf, path_dst) == -1)
@@ -158,28 +285,66 @@ int copy_symlink(const char* path_src, const char* path_dst, const char* source_
     return EXIT_SUCCESS;
 }
 
-// checcs file type and calls correct copy function
-int copy_tree(const char* source_path, const char* dest_path, const char* source_base, const char* target_base)
+static int copy_dir_at(int parent_fd, const char* name, const char* source_path, const char* dest_path,
+                       const struct stat* src_stat, const char* source_base, const char* target_base);
+
+// copyin one entry whose stat we already have, dir_fd and name open it without full path lookup
+static int copy_entry(int dir_fd, const char* name, const char* source_path, const char* dest_path,
+                      const struct stat* st, const char* source_base, const char* target_base)
 {
-    struct stat st;
-    if (lstat(source_path, &st) == -1)
+    // left out by the --exclude rules of this backup
+    if (filter_excluded(source_path, S_ISDIR(st->st_mode)))
+        return EXIT_SUCCESS;
+
+    int64_t started = epoch_now();
+    // another name of a file copied before becomes a link to that copy
+    if (S_ISREG(st->st_mode))
     {
-        ERR("lstat");
+        if (hardlink_link(st, dest_path) == 0)
+        {
+            epoch_copied(source_path, st, started);
+            return EXIT_SUCCESS;
+        }
+        int ret = copy_file(source_path, dest_path);
+        if (ret == EXIT_SUCCESS)
+        {
+            hardlink_remember(st, dest_path);
+            epoch_copied(source_path, st, started);
+        }
+        return ret;
     }
 
-    if (S_ISREG(st.st_mode))
-        return copy_file(source_path, dest_path);
+    if (S_ISDIR(st->st_mode))
+        return copy_dir_at(dir_fd, name, source_path, dest_path, st, source_base, target_base);
 
-    if (S_ISDIR(st.st_mode))
-        return copy_dir(source_path, dest_path, source_base, target_base);
-
-    if (S_ISLNK(st.st_mode))
-        return copy_symlink(source_path, dest_path, source_base, target_base);
+    if (S_ISLNK(st->st_mode))
+    {
+        int ret = copy_symlink(source_path, dest_path, source_base, target_base);
+        if (ret == EXIT_SUCCESS)
+            epoch_copied(source_path, st, started);
+        return ret;
+    }
 
     // skipin special files like fifos and sockets
     return EXIT_SUCCESS;
 }
 
+// checcs file type and calls correct copy function
+int copy_tree(const char* source_path, const char* dest_path, const char* source_base, const char* target_base)
+{
+    struct stat st;
+    if (lstat(source_path, &st) == -1)
+    {
+        // events can race with deletes, gone is not fatal
+        if (errno == ENOENT)
+        {
+            return -1;
+        }
+        ERR("lstat");
+    }
+    return copy_entry(AT_FDCWD, source_path, source_path, dest_path, &st, source_base, target_base);
+}
+
 // copyin whole directory recursivly
 int copy_dir(const char* source_path, const char* dest_path, const char* source_base, const char* target_base)
 {
@@ -188,35 +353,62 @@ int copy_dir(const char* source_path, const char* dest_path, const char* source_
     {
         ERR("lstat");
     }
+    return copy_dir_at(AT_FDCWD, source_path, source_path, dest_path, &src_stat, source_base, target_base);
+}
 
+static void make_dir(const char* dest_path, const struct stat* src_stat)
+{
     mode_t old_umask = umask(0);
-    int ret = mkdir(dest_path, src_stat.st_mode & 0777);
+    int ret = mkdir(dest_path, src_stat->st_mode & 0777);
     umask(old_umask);
 
     if (ret == -1 && errno != EEXIST)
     {
         ERR("mkdir");
     }
+}
+
+// walkin the subtree with an explicit stack instead of recursion, entries are stat'ed
+// relative to their dir fd, full paths are still built for the copy itself
+static int copy_dir_at(int parent_fd, const char* name, const char* source_path, const char* dest_path,
+                       const struct stat* src_stat, const char* source_base, const char* target_base)
+{
+    make_dir(dest_path, src_stat);
 
-    DIR* dir = opendir(source_path);
-    if (!dir)
+    walk_tree_t tree;
+    if (walk_tree_open(&tree, parent_fd, name, source_path, dest_path) == -1)
     {
         ERR("opendir");
     }
 
-    struct dirent* entry;
-    char child_src[PATH_MAX], child_dst[PATH_MAX];
-
-    while ((entry = readdir(dir)) != NULL)
+    int step;
+    while (!should_exit && (step = walk_tree_next(&tree)) > 0)
     {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        if (step == WALK_LEAVE)
+        {
+            epoch_copied(tree.path, tree.st, 0);
             continue;
-
-        snprintf(child_src, PATH_MAX, "%s/%s", source_path, entry->d_name);
-        snprintf(child_dst, PATH_MAX, "%s/%s", dest_path, entry->d_name);
-        copy_tree(child_src, child_dst, source_base, target_base);
+        }
+        struct stat st;
+        if (walk_stat(tree.dir_fd, tree.name, &st) == -1)
+            continue;
+        if (!S_ISDIR(st.st_mode))
+        {
+            copy_entry(tree.dir_fd, tree.name, tree.path, tree.mirror, &st, source_base, target_base);
+            continue;
+        }
+        if (filter_excluded(tree.path, 1))
+            continue;
+        make_dir(tree.mirror, &st);
+        if (walk_tree_enter(&tree) == -1)
+        {
+            ERR("opendir");
+        }
     }
 
-    closedir(dir);
+    walk_tree_close(&tree);
+    // stopped by signal, the initial backup is not complete and the next add resumes it
+    if (should_exit)
+        return EXIT_FAILURE;
     return EXIT_SUCCESS;
 }
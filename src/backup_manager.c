@@ -2,14 +2,19 @@
 #define _GNU_SOURCE
 #include "backup_manager.h"
 #include <errno.h>
+#include <limits.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/inotify.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#include "iosched.h"
 #include "monitor.h"
+#include "signals.h"
 
 #define ERR(source) (perror(source), fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), exit(EXIT_FAILURE))
 
@@ -26,6 +31,16 @@ backup_manager_t *create_backup_manager()
         free(mgr);
         return NULL;
     }
+    if (strmap_init(&mgr->index) == -1)
+    {
+        close(mgr->inotify_fd);
+        free(mgr);
+        return NULL;
+    }
+
+    // without the shared table backups just write unscheduled
+    if (iosched_init() == -1)
+        perror("Failed to set up I/O scheduler");
 
     mgr->head = NULL;
     return mgr;
@@ -41,6 +56,8 @@ void destroy_backup_manager(backup_manager_t *mgr)
     while (cur)
     {
         backup_entry_t *next = cur->next;
+        if (cur->pidfd != -1)
+            close(cur->pidfd);
         free(cur->source_path);
         free(cur->target_path);
         free(cur);
@@ -50,24 +67,117 @@ void destroy_backup_manager(backup_manager_t *mgr)
     if (mgr->inotify_fd != -1)
         close(mgr->inotify_fd);
 
+    strmap_free(&mgr->index, NULL);
     free(mgr);
 }
 
-// checcs if backup alredy exists in linked list
-static int backup_exists(backup_manager_t *mgr, const char *source, const char *target)
+// registry key of a pair, newline cannot come from the command parser
+static int entry_key(char *key, const char *source, const char *target)
 {
-    for (backup_entry_t *c = mgr->head; c; c = c->next)
+    return snprintf(key, 2 * PATH_MAX, "%s\n%s", source, target) < 2 * PATH_MAX ? 0 : -1;
+}
+
+static backup_entry_t *find_entry(backup_manager_t *mgr, const char *source, const char *target)
+{
+    char key[2 * PATH_MAX];
+    if (entry_key(key, source, target) == -1)
+        return NULL;
+    return strmap_get(&mgr->index, key);
+}
+
+// checcs if backup alredy exists, one hash lookup instead of walkin the list
+int backup_exists(backup_manager_t *mgr, const char *source, const char *target)
+{
+    return find_entry(mgr, source, target) != NULL;
+}
+
+static time_t now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+// forkin worker of entry, a restarted one first catches up with what it missed
+static int spawn_worker(backup_entry_t *entry, int restarted)
+{
+    pid_t pid = fork();
+    if (pid == 0)
     {
-        if (strcmp(c->source_path, source) == 0 && strcmp(c->target_path, target) == 0)
-            return 1;
+        iosched_attach(entry->io_slot);
+        start_backup_worker(entry->source_path, entry->target_path, &entry->config, restarted);
+        exit(EXIT_SUCCESS);
     }
+    if (pid == -1)
+        return -1;
+    entry->worker_pid = pid;
+    // old kernels have no pidfd, the periodic poll timeout still finds the worker dead
+    entry->pidfd = syscall(SYS_pidfd_open, pid, 0);
+    entry->health = WORKER_RUNNING;
+    entry->started = now_sec();
     return 0;
 }
 
-// addin new backup and startin worker proces with fork
-int add_backup(backup_manager_t *mgr, const char *source, const char *target)
+// killin worker of entry and waitin for it, signals blocked so the wait is not cut short
+static void stop_worker(backup_entry_t *entry)
 {
-    if (!mgr || !source || !target)
+    if (entry->worker_pid > 0)
+    {
+        sigset_t set, oldset;
+        sigemptyset(&set);
+        sigaddset(&set, SIGTERM);
+        sigaddset(&set, SIGINT);
+        sigprocmask(SIG_BLOCK, &set, &oldset);
+
+        kill(entry->worker_pid, SIGTERM);
+        waitpid(entry->worker_pid, NULL, 0);
+
+        sigprocmask(SIG_SETMASK, &oldset, NULL);
+        entry->worker_pid = -1;
+    }
+    if (entry->pidfd != -1)
+    {
+        close(entry->pidfd);
+        entry->pidfd = -1;
+    }
+    entry->health = WORKER_STOPPED;
+}
+
+// whole add of one pair, initial copy first and then the worker, a pair that is already
+// there is refused before anythin gets copied, why an add failed goes to err
+int start_backup(backup_manager_t *mgr, const char *source, const char *target, backup_config_t *config, FILE *err)
+{
+    if (backup_exists(mgr, source, target))
+    {
+        fprintf(err, "Backup already exists: %s -> %s\n", source, target);
+        return -1;
+    }
+
+    // initial copy already competes with runnin workers, so it goes through the scheduler too
+    int io_slot = iosched_register(config);
+    iosched_attach(io_slot);
+    int ret = create_initial_backup(source, target, config, err);
+    iosched_attach(-1);
+    if (ret != 0)
+    {
+        fprintf(err, "Failed to create backup for %s -> %s\n", source, target);
+        iosched_release(io_slot);
+        return -1;
+    }
+    if (add_backup(mgr, source, target, config, io_slot) == -1)
+    {
+        fprintf(err, "Failed to register backup %s -> %s\n", source, target);
+        iosched_release(io_slot);
+        return -1;
+    }
+    return 0;
+}
+
+// addin new backup and startin worker proces with fork, the worker writes under io_slot
+int add_backup(backup_manager_t *mgr, const char *source, const char *target, const backup_config_t *config,
+               int io_slot)
+{
+    if (!mgr || !source || !target || !config)
         return -1;
 
     if (backup_exists(mgr, source, target))
@@ -83,97 +193,206 @@ int add_backup(backup_manager_t *mgr, const char *source, const char *target)
     entry->source_path = strdup(source);
     entry->target_path = strdup(target);
     entry->worker_pid = -1;
+    entry->pidfd = -1;
     entry->inotify_wd = -1;
+    entry->io_slot = io_slot;
+    entry->config = *config;
 
+    char key[2 * PATH_MAX];
+    if (!entry->source_path || !entry->target_path || entry_key(key, source, target) == -1 ||
+        strmap_put(&mgr->index, key, entry) == -1)
+    {
+        free(entry->source_path);
+        free(entry->target_path);
+        free(entry);
+        return -1;
+    }
     entry->next = mgr->head;
+    if (mgr->head)
+        mgr->head->prev = entry;
     mgr->head = entry;
+    mgr->count++;
 
-    pid_t pid = fork();
-    if (pid == 0)
-    {
-        start_backup_worker(source, target);
-        exit(EXIT_SUCCESS);
-    }
-    else if (pid > 0)
-    {
-        entry->worker_pid = pid;
-        return 0;
-    }
-    else
+    if (spawn_worker(entry, 0) == -1)
     {
         ERR("fork - backup_manager.c");
         return -1;
     }
+    return 0;
 }
 
-// killin worker and removin from list
-int remove_backup(backup_manager_t *mgr, const char *source, const char *target)
+// killin worker and removin from list, found through the index and unlinked in place
+int remove_backup(backup_manager_t *mgr, const char *source, const char *target, FILE *err)
 {
     if (!mgr || !source || !target)
         return -1;
 
-    backup_entry_t *prev = NULL;
-    backup_entry_t *cur = mgr->head;
-
-    while (cur)
+    char key[2 * PATH_MAX];
+    backup_entry_t *cur = entry_key(key, source, target) == 0 ? strmap_remove(&mgr->index, key) : NULL;
+    if (!cur)
     {
-        if (strcmp(cur->source_path, source) == 0 && strcmp(cur->target_path, target) == 0)
-        {
-            if (cur->worker_pid > 0)
-            {
-                sigset_t set, oldset;
-                sigemptyset(&set);
-                sigaddset(&set, SIGTERM);
-                sigaddset(&set, SIGINT);
-                sigprocmask(SIG_BLOCK, &set, &oldset);
+        fprintf(err, "Backup not found: %s -> %s\n", source, target);
+        return -1;
+    }
 
-                kill(cur->worker_pid, SIGTERM);
-                waitpid(cur->worker_pid, NULL, 0);
+    stop_worker(cur);
 
-                sigprocmask(SIG_SETMASK, &oldset, NULL);
-                cur->worker_pid = -1;
-            }
+    if (cur->inotify_wd != -1 && mgr->inotify_fd != -1)
+        inotify_rm_watch(mgr->inotify_fd, cur->inotify_wd);
+    iosched_release(cur->io_slot);
 
-            if (cur->inotify_wd != -1 && mgr->inotify_fd != -1)
-                inotify_rm_watch(mgr->inotify_fd, cur->inotify_wd);
+    if (cur->prev)
+        cur->prev->next = cur->next;
+    else
+        mgr->head = cur->next;
+    if (cur->next)
+        cur->next->prev = cur->prev;
+    mgr->count--;
 
-            if (prev)
-                prev->next = cur->next;
-            else
-                mgr->head = cur->next;
+    free(cur->source_path);
+    free(cur->target_path);
+    free(cur);
+    return 0;
+}
+
+static void describe_status(int status, char *buf, size_t len)
+{
+    if (WIFSIGNALED(status))
+        snprintf(buf, len, "signal %d", WTERMSIG(status));
+    else
+        snprintf(buf, len, "exit %d", WEXITSTATUS(status));
+}
+
+// reapin workers that died and restartin them later, a worker that dies soon after
+// its start waits twice as long as the last time, a clean exit is not restarted
+void supervise_workers(backup_manager_t *mgr)
+{
+    if (!mgr)
+        return;
+    time_t now = now_sec();
+    for (backup_entry_t *c = mgr->head; c; c = c->next)
+    {
+        if (c->health == WORKER_RUNNING && c->worker_pid > 0)
+        {
+            int status;
+            if (waitpid(c->worker_pid, &status, WNOHANG) != c->worker_pid)
+                continue;
+            if (c->pidfd != -1)
+                close(c->pidfd);
+            c->pidfd = -1;
+            c->worker_pid = -1;
+            c->last_status = status;
 
-            free(cur->source_path);
-            free(cur->target_path);
-            free(cur);
-            return 0;
+            char why[32];
+            describe_status(status, why, sizeof(why));
+            if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS)
+            {
+                c->health = WORKER_STOPPED;
+                fprintf(stderr, "Worker stopped: %s -> %s\n", c->source_path, c->target_path);
+                continue;
+            }
+            if (c->backoff == 0 || now - c->started >= SUPERVISE_STABLE_SECONDS)
+                c->backoff = SUPERVISE_BACKOFF_MIN;
+            else if (c->backoff * 2 <= SUPERVISE_BACKOFF_MAX)
+                c->backoff *= 2;
+            else
+                c->backoff = SUPERVISE_BACKOFF_MAX;
+            c->restart_at = now + c->backoff;
+            c->health = WORKER_BACKOFF;
+            fprintf(stderr, "Worker for %s -> %s died (%s), restarting in %d s\n", c->source_path, c->target_path,
+                    why, c->backoff);
+        }
+        else if (c->health == WORKER_BACKOFF && now >= c->restart_at)
+        {
+            if (spawn_worker(c, 1) == -1)
+            {
+                perror("fork - restart worker");
+                c->restart_at = now + c->backoff;
+                continue;
+            }
+            c->restarts++;
+            fprintf(stderr, "Worker restarted: %s -> %s (PID: %d)\n", c->source_path, c->target_path,
+                    c->worker_pid);
         }
-        prev = cur;
-        cur = cur->next;
     }
+}
 
-    fprintf(stderr, "Backup not found: %s -> %s\n", source, target);
-    return -1;
+// fillin pidfds of runnin workers for the main poll and shortenin timeout to the next
+// restart that is due, returns how many fds were filled
+int supervise_fds(backup_manager_t *mgr, struct pollfd *fds, int max, int *timeout)
+{
+    int n = 0;
+    time_t now = now_sec();
+    for (backup_entry_t *c = mgr ? mgr->head : NULL; c; c = c->next)
+    {
+        if (c->health == WORKER_RUNNING && c->pidfd != -1 && n < max)
+            fds[n++] = (struct pollfd){c->pidfd, POLLIN, 0};
+        if (c->health == WORKER_BACKOFF && (c->restart_at - now) * 1000 < *timeout)
+            *timeout = c->restart_at > now ? (c->restart_at - now) * 1000 : 0;
+    }
+    return n;
 }
 
 // printin all backups
-void list_backups(backup_manager_t *mgr)
+void list_backups(backup_manager_t *mgr, FILE *out)
 {
     if (!mgr)
         return;
 
     if (!mgr->head)
     {
-        printf("No active backups.\n");
+        fprintf(out, "No active backups.\n");
         return;
     }
 
+    supervise_workers(mgr);
     int idx = 1;
     for (backup_entry_t *c = mgr->head; c; c = c->next)
     {
-        printf("%d. %s -> %s (PID: %d)\n", idx++, c->source_path, c->target_path, c->worker_pid);
+        fprintf(out, "%d. %s -> %s (PID: %d, format: %s, io: %s/%d", idx++, c->source_path, c->target_path,
+                c->worker_pid, format_name(c->config.format), io_class_name(c->config.io_class),
+                c->config.io_weight ? c->config.io_weight : IOSCHED_DEFAULT_WEIGHT);
+        if (c->config.io_rate)
+            fprintf(out, ", %d MiB/s", c->config.io_rate);
+        if (c->config.io_iops)
+            fprintf(out, ", %d iops", c->config.io_iops);
+        fprintf(out, "%s)\n", c->io_slot == -1 ? ", unscheduled" : "");
+
+        char why[32];
+        describe_status(c->last_status, why, sizeof(why));
+        if (c->health == WORKER_RUNNING && c->restarts)
+            fprintf(out, "   health: running, restarted %d times, last %s\n", c->restarts, why);
+        else if (c->health == WORKER_RUNNING)
+            fprintf(out, "   health: running\n");
+        else if (c->health == WORKER_BACKOFF)
+            fprintf(out, "   health: worker died (%s), restart %d in %ld s\n", why, c->restarts + 1,
+                    (long)(c->restart_at > now_sec() ? c->restart_at - now_sec() : 0));
+        else
+            fprintf(out, "   health: stopped (%s)\n", why);
     }
 }
 
+// countin backups by health and format, one line for scripts
+void backup_stats(backup_manager_t *mgr, FILE *out)
+{
+    if (!mgr)
+        return;
+    supervise_workers(mgr);
+    size_t health[3] = {0}, formats[4] = {0};
+    long restarts = 0;
+    for (backup_entry_t *c = mgr->head; c; c = c->next)
+    {
+        health[c->health]++;
+        formats[c->config.format]++;
+        restarts += c->restarts;
+    }
+    fprintf(out, "backups=%zu running=%zu restarting=%zu stopped=%zu restarts=%ld", mgr->count,
+            health[WORKER_RUNNING], health[WORKER_BACKOFF], health[WORKER_STOPPED], restarts);
+    for (int f = FORMAT_PLAIN; f <= FORMAT_PACKED; f++)
+        fprintf(out, " %s=%zu", format_name(f), formats[f]);
+    fprintf(out, "\n");
+}
+
 // killin all workers when exitin program
 void kill_all_workers(backup_manager_t *mgr)
 {
@@ -182,13 +401,10 @@ void kill_all_workers(backup_manager_t *mgr)
 
     for (backup_entry_t *c = mgr->head; c; c = c->next)
     {
-        if (c->worker_pid > 0)
-        {
-            kill(c->worker_pid, SIGTERM);
-            waitpid(c->worker_pid, NULL, 0);
-            c->worker_pid = -1;
-        }
+        stop_worker(c);
         if (c->inotify_wd != -1 && mgr->inotify_fd != -1)
             inotify_rm_watch(mgr->inotify_fd, c->inotify_wd);
+        iosched_release(c->io_slot);
+        c->io_slot = -1;
     }
 }
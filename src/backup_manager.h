@@ -2,29 +2,64 @@
 #ifndef BACKUP_MANAGER_H
 #define BACKUP_MANAGER_H
 
+#include <poll.h>
+#include <stdio.h>
 #include <sys/types.h>
+#include <time.h>
+#include "config.h"
+#include "strmap.h"
+
+#define SUPERVISE_POLL_MS 1000
+#define SUPERVISE_BACKOFF_MIN 1
+#define SUPERVISE_BACKOFF_MAX 300
+#define SUPERVISE_STABLE_SECONDS 60
+
+typedef enum
+{
+    WORKER_RUNNING,
+    WORKER_BACKOFF,
+    WORKER_STOPPED
+} worker_health_t;
 
 typedef struct backup_entry
 {
     char *source_path;
     char *target_path;
     pid_t worker_pid;
+    int pidfd;
+    worker_health_t health;
+    int restarts;
+    int last_status;
+    int backoff;
+    time_t started;
+    time_t restart_at;
     int inotify_wd;
+    int io_slot;
+    backup_config_t config;
+    struct backup_entry *prev;
     struct backup_entry *next;
 } backup_entry_t;
 
 typedef struct
 {
     backup_entry_t *head;
+    strmap_t index;
+    size_t count;
     int inotify_fd;
 } backup_manager_t;
 
 backup_manager_t *create_backup_manager();
 void destroy_backup_manager(backup_manager_t *mgr);
 
-int add_backup(backup_manager_t *mgr, const char *source, const char *target);
-int remove_backup(backup_manager_t *mgr, const char *source, const char *target);
-void list_backups(backup_manager_t *mgr);
+int start_backup(backup_manager_t *mgr, const char *source, const char *target, backup_config_t *config, FILE *err);
+int add_backup(backup_manager_t *mgr, const char *source, const char *target, const backup_config_t *config,
+               int io_slot);
+int remove_backup(backup_manager_t *mgr, const char *source, const char *target, FILE *err);
+int backup_exists(backup_manager_t *mgr, const char *source, const char *target);
+void list_backups(backup_manager_t *mgr, FILE *out);
+void backup_stats(backup_manager_t *mgr, FILE *out);
 void kill_all_workers(backup_manager_t *mgr);
+void supervise_workers(backup_manager_t *mgr);
+int supervise_fds(backup_manager_t *mgr, struct pollfd *fds, int max, int *timeout);
 
 #endif
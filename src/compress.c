@@ -0,0 +1,351 @@
+// clang-format off
+#define _GNU_SOURCE
+#include "compress.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "attr.h"
+#include "backup.h"
+#include "durable.h"
+#include "iosched.h"
+#include "lz.h"
+
+#define COMPRESSED_MAGIC "SOPLZ001"
+
+// header in front of every block, comp_len equal to raw_len means stored as is
+typedef struct
+{
+    uint32_t raw_len;
+    uint32_t comp_len;
+} frame_header_t;
+
+// one block handed to a compress thread
+typedef struct
+{
+    char *in;
+    size_t in_len;
+    char *out;
+    size_t out_len;
+} block_job_t;
+
+static void compress_block(block_job_t *job, uint32_t *table)
+{
+    job->out_len = lz_compress(job->in, job->in_len, job->out, LZ_BOUND(job->in_len), table);
+    if (job->out_len == 0 || job->out_len >= job->in_len)
+    {
+        // does not compress, keep raw bytes
+        memcpy(job->out, job->in, job->in_len);
+        job->out_len = job->in_len;
+    }
+}
+
+// pool of helper threads, started on first use and kept till compress_stop, the caller
+// takes blocks of its batch too, so a pool that could not start only makes it slower,
+// every thread has its own hash table, slot 0 is the caller's
+static uint32_t pool_tables[COMPRESS_WORKERS][LZ_TABLE_LEN];
+static pthread_t pool_tids[COMPRESS_WORKERS];
+static int pool_count;
+static int pool_started;
+static int pool_stopping;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static block_job_t *batch;
+static int batch_count;
+static int batch_next;
+static int batch_finished;
+
+static void *pool_thread(void *arg)
+{
+    uint32_t *table = pool_tables[(intptr_t)arg];
+    pthread_mutex_lock(&pool_lock);
+    for (;;)
+    {
+        while ((!batch || batch_next == batch_count) && !pool_stopping)
+            pthread_cond_wait(&pool_work, &pool_lock);
+        if (pool_stopping)
+            break;
+        block_job_t *job = &batch[batch_next++];
+        pthread_mutex_unlock(&pool_lock);
+        compress_block(job, table);
+        pthread_mutex_lock(&pool_lock);
+        if (++batch_finished == batch_count)
+            pthread_cond_broadcast(&pool_done);
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return NULL;
+}
+
+static void pool_start(void)
+{
+    pool_started = 1;
+    for (intptr_t i = 1; i < COMPRESS_WORKERS; i++)
+    {
+        if (pthread_create(&pool_tids[pool_count], NULL, pool_thread, (void *)i) == 0)
+            pool_count++;
+    }
+}
+
+// stoppin the helpers, the manager does it before forkin workers so they start single threaded
+void compress_stop(void)
+{
+    pthread_mutex_lock(&pool_lock);
+    if (!pool_started)
+    {
+        pthread_mutex_unlock(&pool_lock);
+        return;
+    }
+    pool_stopping = 1;
+    pthread_cond_broadcast(&pool_work);
+    pthread_mutex_unlock(&pool_lock);
+    for (int i = 0; i < pool_count; i++)
+        pthread_join(pool_tids[i], NULL);
+    pool_count = 0;
+    pool_started = 0;
+    pool_stopping = 0;
+}
+
+// compressin blocks of one batch on the pool, returns when all of them are done
+static void run_batch(block_job_t *jobs, int count)
+{
+    pthread_mutex_lock(&pool_lock);
+    if (!pool_started)
+        pool_start();
+    while (batch)
+        pthread_cond_wait(&pool_done, &pool_lock);
+    batch = jobs;
+    batch_count = count;
+    batch_next = 0;
+    batch_finished = 0;
+    pthread_cond_broadcast(&pool_work);
+    while (batch_next < batch_count)
+    {
+        block_job_t *job = &batch[batch_next++];
+        pthread_mutex_unlock(&pool_lock);
+        compress_block(job, pool_tables[0]);
+        pthread_mutex_lock(&pool_lock);
+        batch_finished++;
+    }
+    while (batch_finished < batch_count)
+        pthread_cond_wait(&pool_done, &pool_lock);
+    batch = NULL;
+    pthread_cond_broadcast(&pool_done);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+// compressin file block by block, few blocks at once on the pool threads
+int compress_store_file(const char *source_path, const char *dest_path, const struct stat *source_stat)
+{
+    int source_fd = open(source_path, O_RDONLY);
+    if (source_fd == -1)
+        return -1;
+    posix_fadvise(source_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    char tmp_path[PATH_MAX];
+    int dest_fd = staged_open(dest_path, source_stat->st_mode, tmp_path);
+    if (dest_fd == -1)
+    {
+        close(source_fd);
+        return -1;
+    }
+
+    // small files dont need the whole pool and full sized buffers
+    size_t block_len = source_stat->st_size < COMPRESS_BLOCK_LEN ? source_stat->st_size + 1 : COMPRESS_BLOCK_LEN;
+    size_t blocks = (source_stat->st_size + block_len - 1) / block_len;
+    int workers = blocks < COMPRESS_WORKERS ? (blocks ? blocks : 1) : COMPRESS_WORKERS;
+
+    block_job_t jobs[COMPRESS_WORKERS];
+    memset(jobs, 0, sizeof(jobs));
+    int ret = 0;
+    for (int i = 0; i < workers; i++)
+    {
+        jobs[i].in = malloc(block_len);
+        jobs[i].out = malloc(LZ_BOUND(block_len));
+        if (!jobs[i].in || !jobs[i].out)
+        {
+            errno = ENOMEM;
+            ret = -1;
+        }
+    }
+
+    compressed_header_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, COMPRESSED_MAGIC, sizeof(hdr.magic));
+    hdr.mtime_ns = attr_mtime_ns(source_stat);
+    hdr.mode = source_stat->st_mode & 0777;
+    hdr.block_len = block_len;
+    if (ret == 0 && bulk_write(dest_fd, (char *)&hdr, sizeof(hdr)) == -1)
+        ret = -1;
+
+    uint64_t total = 0;
+    int eof = 0;
+    while (ret == 0 && !eof)
+    {
+        int filled = 0;
+        for (; filled < workers; filled++)
+        {
+            ssize_t got = bulk_read(source_fd, jobs[filled].in, block_len);
+            if (got < 0)
+            {
+                ret = -1;
+                break;
+            }
+            if (got == 0)
+            {
+                eof = 1;
+                break;
+            }
+            jobs[filled].in_len = got;
+        }
+        if (ret == -1 || filled == 0)
+            break;
+
+        run_batch(jobs, filled);
+
+        // writin blocks in order so the stream can be read back sequentialy
+        for (int i = 0; i < filled && ret == 0; i++)
+        {
+            frame_header_t frame = {jobs[i].in_len, jobs[i].out_len};
+            iosched_charge(sizeof(frame) + jobs[i].out_len);
+            if (bulk_write(dest_fd, (char *)&frame, sizeof(frame)) == -1 ||
+                bulk_write(dest_fd, jobs[i].out, jobs[i].out_len) == -1)
+                ret = -1;
+            total += jobs[i].in_len;
+        }
+    }
+
+    if (ret == 0)
+    {
+        frame_header_t end = {0, 0};
+        hdr.size = total;
+        if (bulk_write(dest_fd, (char *)&end, sizeof(end)) == -1 || pwrite(dest_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+            ret = -1;
+    }
+
+    for (int i = 0; i < workers; i++)
+    {
+        free(jobs[i].in);
+        free(jobs[i].out);
+    }
+    int saved_errno = errno;
+    close(source_fd);
+    errno = saved_errno;
+    if (ret == -1)
+    {
+        staged_abort(dest_fd, tmp_path);
+        return -1;
+    }
+    return staged_commit(dest_fd, tmp_path, dest_path);
+}
+
+// checcs if file is compressed backup and reads its header
+int compress_read_header(const char *path, compressed_header_t *hdr)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return -1;
+    ssize_t got = bulk_read(fd, (char *)hdr, sizeof(*hdr));
+    close(fd);
+    if (got != sizeof(*hdr) || memcmp(hdr->magic, COMPRESSED_MAGIC, sizeof(hdr->magic)) != 0)
+        return -1;
+    hdr->mtime_ns = attr_stored_ns(hdr->mtime_ns);
+    return 0;
+}
+
+// chmod or touch of the source only changes the header, the blocks stay
+int compress_update_attrs(const char *path, const struct stat *source_stat)
+{
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    compressed_header_t hdr;
+    int ret = -1;
+    if (pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) && memcmp(hdr.magic, COMPRESSED_MAGIC, sizeof(hdr.magic)) == 0)
+    {
+        hdr.mtime_ns = attr_mtime_ns(source_stat);
+        hdr.mode = source_stat->st_mode & 0777;
+        if (pwrite(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr))
+        {
+            durable_written(fd);
+            ret = 0;
+        }
+    }
+    close(fd);
+    return ret;
+}
+
+// decompressin backup file back to its original bytes
+int compress_restore_file(const char *path, const char *dest_path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return -1;
+
+    compressed_header_t hdr;
+    if (bulk_read(fd, (char *)&hdr, sizeof(hdr)) != sizeof(hdr) ||
+        memcmp(hdr.magic, COMPRESSED_MAGIC, sizeof(hdr.magic)) != 0 || hdr.block_len > COMPRESS_BLOCK_LEN + 1)
+    {
+        close(fd);
+        return -1;
+    }
+
+    char tmp_path[PATH_MAX];
+    int out = staged_open(dest_path, hdr.mode, tmp_path);
+    char *in = malloc(LZ_BOUND(hdr.block_len));
+    char *raw = malloc(hdr.block_len);
+    int ret = (out == -1 || !in || !raw) ? -1 : 0;
+
+    uint64_t total = 0;
+    while (ret == 0)
+    {
+        frame_header_t frame;
+        if (bulk_read(fd, (char *)&frame, sizeof(frame)) != sizeof(frame) || frame.raw_len > hdr.block_len ||
+            frame.comp_len > LZ_BOUND(hdr.block_len))
+        {
+            ret = -1;
+            break;
+        }
+        if (frame.raw_len == 0)
+            break;
+        if (bulk_read(fd, in, frame.comp_len) != frame.comp_len)
+        {
+            ret = -1;
+            break;
+        }
+        const char *data = in;
+        if (frame.comp_len != frame.raw_len)
+        {
+            if (lz_decompress(in, frame.comp_len, raw, hdr.block_len) != frame.raw_len)
+            {
+                ret = -1;
+                break;
+            }
+            data = raw;
+        }
+        if (bulk_write(out, (char *)data, frame.raw_len) == -1)
+            ret = -1;
+        total += frame.raw_len;
+    }
+    if (ret == 0 && total != hdr.size)
+        ret = -1;
+    if (ret == -1)
+        fprintf(stderr, "Corrupted compressed file: %s\n", path);
+
+    free(in);
+    free(raw);
+    close(fd);
+    if (out != -1 && ret == -1)
+        staged_abort(out, tmp_path);
+    if (ret == 0)
+    {
+        attr_set_mtime_ns(tmp_path, attr_stored_ns(hdr.mtime_ns));
+        ret = staged_commit(out, tmp_path, dest_path);
+    }
+    return ret;
+}
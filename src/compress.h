@@ -0,0 +1,26 @@
+// clang-format off
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+#define COMPRESS_BLOCK_LEN (1024 * 1024)
+#define COMPRESS_WORKERS 4
+
+typedef struct
+{
+    char magic[8];
+    uint64_t size;
+    int64_t mtime_ns;
+    uint32_t mode;
+    uint32_t block_len;
+} compressed_header_t;
+
+int compress_store_file(const char *source_path, const char *dest_path, const struct stat *source_stat);
+int compress_read_header(const char *path, compressed_header_t *hdr);
+int compress_restore_file(const char *path, const char *dest_path);
+int compress_update_attrs(const char *path, const struct stat *source_stat);
+void compress_stop(void);
+
+#endif
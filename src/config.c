@@ -0,0 +1,446 @@
+// clang-format off
+#define _GNU_SOURCE
+#include "config.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "iosched.h"
+#include "meta.h"
+#include "walk.h"
+
+// options of the backup this process works on
+static backup_config_t current_config;
+
+void config_init(backup_config_t *cfg)
+{
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->format = FORMAT_PLAIN;
+    cfg->keep_hourly = -1;
+    cfg->keep_daily = -1;
+    cfg->keep_weekly = -1;
+    cfg->durability = DURABILITY_BATCH;
+    cfg->io_class = IO_CLASS_NORMAL;
+    cfg->ioprio = -1;
+}
+
+const char *format_name(target_format_t format)
+{
+    switch (format)
+    {
+        case FORMAT_DEDUP:
+            return "dedup";
+        case FORMAT_COMPRESSED:
+            return "compressed";
+        case FORMAT_PACKED:
+            return "packed";
+        default:
+            return "plain";
+    }
+}
+
+const char *durability_name(durability_t durability)
+{
+    switch (durability)
+    {
+        case DURABILITY_NONE:
+            return "none";
+        case DURABILITY_FULL:
+            return "full";
+        default:
+            return "batch";
+    }
+}
+
+const char *io_class_name(io_class_t io_class)
+{
+    switch (io_class)
+    {
+        case IO_CLASS_HIGH:
+            return "high";
+        case IO_CLASS_IDLE:
+            return "idle";
+        default:
+            return "normal";
+    }
+}
+
+static int parse_io_class(const char *value, io_class_t *io_class)
+{
+    if (strcmp(value, "high") == 0)
+        *io_class = IO_CLASS_HIGH;
+    else if (strcmp(value, "normal") == 0)
+        *io_class = IO_CLASS_NORMAL;
+    else if (strcmp(value, "idle") == 0)
+        *io_class = IO_CLASS_IDLE;
+    else
+        return -1;
+    return 0;
+}
+
+// parsin a whole number option between min and max
+static int parse_number(const char *value, long min, long max, int *out)
+{
+    char *end;
+    long n = strtol(value, &end, 10);
+    if (!*value || *end || n < min || n > max)
+        return -1;
+    *out = n;
+    return 0;
+}
+
+static int parse_durability(const char *value, durability_t *durability)
+{
+    if (strcmp(value, "none") == 0)
+        *durability = DURABILITY_NONE;
+    else if (strcmp(value, "batch") == 0)
+        *durability = DURABILITY_BATCH;
+    else if (strcmp(value, "full") == 0)
+        *durability = DURABILITY_FULL;
+    else
+        return -1;
+    return 0;
+}
+
+static int parse_format(const char *value, target_format_t *format)
+{
+    if (strcmp(value, "plain") == 0)
+        *format = FORMAT_PLAIN;
+    else if (strcmp(value, "dedup") == 0)
+        *format = FORMAT_DEDUP;
+    else if (strcmp(value, "compressed") == 0)
+        *format = FORMAT_COMPRESSED;
+    else if (strcmp(value, "packed") == 0)
+        *format = FORMAT_PACKED;
+    else
+        return -1;
+    return 0;
+}
+
+// parsin retention like hourly=24,daily=7,weekly=4
+static int parse_keep(backup_config_t *cfg, const char *value, FILE *err)
+{
+    char *copy = strdup(value);
+    if (!copy)
+        return -1;
+    int ret = 0;
+    char *save = NULL;
+    for (char *part = strtok_r(copy, ",", &save); part && ret == 0; part = strtok_r(NULL, ",", &save))
+    {
+        char *eq = strchr(part, '=');
+        char *end = NULL;
+        long n = eq ? strtol(eq + 1, &end, 10) : -1;
+        if (!eq || *end || n < 0 || n > INT_MAX)
+        {
+            ret = -1;
+            break;
+        }
+        *eq = '\0';
+        if (strcmp(part, "hourly") == 0)
+            cfg->keep_hourly = n;
+        else if (strcmp(part, "daily") == 0)
+            cfg->keep_daily = n;
+        else if (strcmp(part, "weekly") == 0)
+            cfg->keep_weekly = n;
+        else
+            ret = -1;
+    }
+    free(copy);
+    if (ret == -1)
+        fprintf(err, "Error: retention must look like hourly=24,daily=7,weekly=4\n");
+    return ret;
+}
+
+// settin one --name value option from the command line, what is wrong with it goes to err
+int config_set_option(backup_config_t *cfg, const char *name, const char *value, FILE *err)
+{
+    if (strcmp(name, "format") == 0)
+    {
+        if (parse_format(value, &cfg->format) == -1)
+        {
+            fprintf(err, "Error: unknown format '%s'\n", value);
+            return -1;
+        }
+        cfg->format_set = 1;
+        return 0;
+    }
+    if (strcmp(name, "store") == 0)
+    {
+        // store is shared between backups, so keep it absolute
+        if (mkdir(value, 0700) == -1 && errno != EEXIST)
+        {
+            fprintf(err, "Error: cannot create store '%s': %s\n", value, strerror(errno));
+            return -1;
+        }
+        char *real = realpath(value, NULL);
+        if (!real)
+        {
+            fprintf(err, "Error: cannot resolve store '%s': %s\n", value, strerror(errno));
+            return -1;
+        }
+        strncpy(cfg->store_path, real, PATH_MAX - 1);
+        cfg->store_path[PATH_MAX - 1] = '\0';
+        free(real);
+        return 0;
+    }
+    if (strcmp(name, "snapshots") == 0)
+    {
+        char *end;
+        long interval = strtol(value, &end, 10);
+        if (*end || interval < 0 || interval > INT_MAX)
+        {
+            fprintf(err, "Error: snapshot interval must be a number of seconds\n");
+            return -1;
+        }
+        cfg->snapshot_interval = interval;
+        return 0;
+    }
+    if (strcmp(name, "keep") == 0)
+        return parse_keep(cfg, value, err);
+    if (strcmp(name, "scrub") == 0)
+    {
+        char *end;
+        long rate = strtol(value, &end, 10);
+        if (*end || rate < 0 || rate > INT_MAX)
+        {
+            fprintf(err, "Error: scrub rate must be a number of MiB per second\n");
+            return -1;
+        }
+        cfg->scrub_rate = rate;
+        return 0;
+    }
+    if (strcmp(name, "exclude") == 0 || strcmp(name, "include") == 0)
+    {
+        // kept in order as "-pattern" or "+pattern" lines, last matchin rule wins
+        size_t used = strlen(cfg->filters);
+        if (!*value || strchr(value, '\n') ||
+            snprintf(cfg->filters + used, FILTER_RULES_MAX - used, "%c%s\n", name[0] == 'e' ? '-' : '+', value) >=
+                (int)(FILTER_RULES_MAX - used))
+        {
+            cfg->filters[used] = '\0';
+            fprintf(err, "Error: bad or too many filter rules\n");
+            return -1;
+        }
+        return 0;
+    }
+    if (strcmp(name, "priority") == 0)
+    {
+        if (parse_io_class(value, &cfg->io_class) == -1)
+        {
+            fprintf(err, "Error: priority must be high, normal or idle\n");
+            return -1;
+        }
+        cfg->io_class_set = 1;
+        return 0;
+    }
+    if (strcmp(name, "weight") == 0)
+    {
+        if (parse_number(value, 1, IOSCHED_MAX_WEIGHT, &cfg->io_weight) == -1)
+        {
+            fprintf(err, "Error: weight must be a number from 1 to %d\n", IOSCHED_MAX_WEIGHT);
+            return -1;
+        }
+        return 0;
+    }
+    if (strcmp(name, "bwlimit") == 0)
+    {
+        if (parse_number(value, 0, IO_RATE_MAX, &cfg->io_rate) == -1)
+        {
+            fprintf(err, "Error: bandwidth limit must be a number of MiB per second\n");
+            return -1;
+        }
+        return 0;
+    }
+    if (strcmp(name, "iops") == 0)
+    {
+        if (parse_number(value, 0, INT_MAX, &cfg->io_iops) == -1)
+        {
+            fprintf(err, "Error: iops limit must be a number of writes per second\n");
+            return -1;
+        }
+        return 0;
+    }
+    if (strcmp(name, "ioprio") == 0)
+    {
+        if (strcmp(value, "on") != 0 && strcmp(value, "off") != 0)
+        {
+            fprintf(err, "Error: ioprio must be on or off\n");
+            return -1;
+        }
+        cfg->ioprio = strcmp(value, "on") == 0;
+        return 0;
+    }
+    if (strcmp(name, "walk-fds") == 0)
+    {
+        if (parse_number(value, 0, WALK_FDS_MAX, &cfg->walk_fds) == -1)
+        {
+            fprintf(err, "Error: walk fds must be a number from 0 to %d\n", WALK_FDS_MAX);
+            return -1;
+        }
+        return 0;
+    }
+    if (strcmp(name, "walk-mem") == 0)
+    {
+        if (parse_number(value, 0, WALK_MEM_MAX, &cfg->walk_mem) == -1)
+        {
+            fprintf(err, "Error: walk memory must be a number of MiB up to %d\n", WALK_MEM_MAX);
+            return -1;
+        }
+        return 0;
+    }
+    if (strcmp(name, "durability") == 0)
+    {
+        if (parse_durability(value, &cfg->durability) == -1)
+        {
+            fprintf(err, "Error: durability must be none, batch or full\n");
+            return -1;
+        }
+        cfg->durability_set = 1;
+        return 0;
+    }
+    fprintf(err, "Error: unknown option '--%s'\n", name);
+    return -1;
+}
+
+// readin config saved in target metadata dir, -1 if there is none
+int config_load(backup_config_t *cfg, const char *target_root)
+{
+    char path[PATH_MAX];
+    if (snprintf(path, PATH_MAX, "%s/%s/config", target_root, META_DIR_NAME) >= PATH_MAX)
+        return -1;
+
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return -1;
+
+    config_init(cfg);
+    char line[PATH_MAX + 64];
+    while (fgets(line, sizeof(line), f))
+    {
+        line[strcspn(line, "\n")] = '\0';
+        char *eq = strchr(line, '=');
+        if (!eq)
+            continue;
+        *eq = '\0';
+        const char *value = eq + 1;
+        if (strcmp(line, "format") == 0)
+            parse_format(value, &cfg->format);
+        else if (strcmp(line, "store") == 0)
+        {
+            strncpy(cfg->store_path, value, PATH_MAX - 1);
+            cfg->store_path[PATH_MAX - 1] = '\0';
+        }
+        else
+            config_set_option(cfg, line, value, stderr);
+    }
+    fclose(f);
+    cfg->format_set = 1;
+    return 0;
+}
+
+// savin config so restore and later adds know how the target is laid out
+int config_save(const backup_config_t *cfg, const char *target_root)
+{
+    char path[PATH_MAX];
+    if (snprintf(path, PATH_MAX, "%s/%s", target_root, META_DIR_NAME) >= PATH_MAX)
+        return -1;
+    if (mkdir(path, 0700) == -1 && errno != EEXIST)
+        return -1;
+    if (snprintf(path, PATH_MAX, "%s/%s/config", target_root, META_DIR_NAME) >= PATH_MAX)
+        return -1;
+
+    FILE *f = fopen(path, "w");
+    if (!f)
+        return -1;
+    fprintf(f, "format=%s\n", format_name(cfg->format));
+    if (cfg->store_path[0])
+        fprintf(f, "store=%s\n", cfg->store_path);
+    if (cfg->snapshot_interval)
+        fprintf(f, "snapshots=%d\n", cfg->snapshot_interval);
+    if (cfg->keep_hourly >= 0 || cfg->keep_daily >= 0 || cfg->keep_weekly >= 0)
+        fprintf(f, "keep=hourly=%d,daily=%d,weekly=%d\n",
+                cfg->keep_hourly >= 0 ? cfg->keep_hourly : DEFAULT_KEEP_HOURLY,
+                cfg->keep_daily >= 0 ? cfg->keep_daily : DEFAULT_KEEP_DAILY,
+                cfg->keep_weekly >= 0 ? cfg->keep_weekly : DEFAULT_KEEP_WEEKLY);
+    if (cfg->scrub_rate)
+        fprintf(f, "scrub=%d\n", cfg->scrub_rate);
+    for (const char *rule = cfg->filters; *rule;)
+    {
+        const char *end = strchr(rule, '\n');
+        fprintf(f, "%s=%.*s\n", rule[0] == '-' ? "exclude" : "include", (int)(end - rule - 1), rule + 1);
+        rule = end + 1;
+    }
+    if (cfg->io_class_set)
+        fprintf(f, "priority=%s\n", io_class_name(cfg->io_class));
+    if (cfg->io_weight)
+        fprintf(f, "weight=%d\n", cfg->io_weight);
+    if (cfg->io_rate)
+        fprintf(f, "bwlimit=%d\n", cfg->io_rate);
+    if (cfg->io_iops)
+        fprintf(f, "iops=%d\n", cfg->io_iops);
+    if (cfg->ioprio >= 0)
+        fprintf(f, "ioprio=%s\n", cfg->ioprio ? "on" : "off");
+    if (cfg->walk_fds)
+        fprintf(f, "walk-fds=%d\n", cfg->walk_fds);
+    if (cfg->walk_mem)
+        fprintf(f, "walk-mem=%d\n", cfg->walk_mem);
+    fprintf(f, "durability=%s\n", durability_name(cfg->durability));
+    if (fclose(f) == EOF)
+        return -1;
+    return 0;
+}
+
+// fillin options not given on command line from the config saved in target
+void config_merge_saved(backup_config_t *cfg, const backup_config_t *saved)
+{
+    if (!cfg->store_path[0])
+        strcpy(cfg->store_path, saved->store_path);
+    if (!cfg->snapshot_interval)
+        cfg->snapshot_interval = saved->snapshot_interval;
+    if (cfg->keep_hourly < 0)
+        cfg->keep_hourly = saved->keep_hourly;
+    if (cfg->keep_daily < 0)
+        cfg->keep_daily = saved->keep_daily;
+    if (cfg->keep_weekly < 0)
+        cfg->keep_weekly = saved->keep_weekly;
+    if (!cfg->scrub_rate)
+        cfg->scrub_rate = saved->scrub_rate;
+    if (!cfg->filters[0])
+        strcpy(cfg->filters, saved->filters);
+    if (!cfg->io_class_set)
+    {
+        cfg->io_class = saved->io_class;
+        cfg->io_class_set = saved->io_class_set;
+    }
+    if (!cfg->io_weight)
+        cfg->io_weight = saved->io_weight;
+    if (!cfg->io_rate)
+        cfg->io_rate = saved->io_rate;
+    if (!cfg->io_iops)
+        cfg->io_iops = saved->io_iops;
+    if (cfg->ioprio < 0)
+        cfg->ioprio = saved->ioprio;
+    if (!cfg->walk_fds)
+        cfg->walk_fds = saved->walk_fds;
+    if (!cfg->walk_mem)
+        cfg->walk_mem = saved->walk_mem;
+    if (!cfg->durability_set)
+        cfg->durability = saved->durability;
+    cfg->format = saved->format;
+}
+
+void config_set_current(const backup_config_t *cfg)
+{
+    if (cfg)
+        current_config = *cfg;
+    else
+        config_init(&current_config);
+    // tree walks of this backup keep to its fd and memory limits
+    walk_set_limits(current_config.walk_fds, current_config.walk_mem);
+}
+
+const backup_config_t *config_current(void)
+{
+    return &current_config;
+}
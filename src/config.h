@@ -0,0 +1,72 @@
+// clang-format off
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <limits.h>
+#include <stdio.h>
+
+#define DEFAULT_KEEP_HOURLY 24
+#define DEFAULT_KEEP_DAILY 7
+#define DEFAULT_KEEP_WEEKLY 4
+#define FILTER_RULES_MAX 4096
+#define IO_RATE_MAX (1024 * 1024)
+#define WALK_FDS_MAX 4096
+#define WALK_MEM_MAX 4096
+
+typedef enum
+{
+    FORMAT_PLAIN,
+    FORMAT_DEDUP,
+    FORMAT_COMPRESSED,
+    FORMAT_PACKED
+} target_format_t;
+
+typedef enum
+{
+    DURABILITY_NONE,
+    DURABILITY_BATCH,
+    DURABILITY_FULL
+} durability_t;
+
+typedef enum
+{
+    IO_CLASS_HIGH,
+    IO_CLASS_NORMAL,
+    IO_CLASS_IDLE
+} io_class_t;
+
+typedef struct
+{
+    target_format_t format;
+    int format_set;
+    char store_path[PATH_MAX];
+    int snapshot_interval;
+    int keep_hourly;
+    int keep_daily;
+    int keep_weekly;
+    durability_t durability;
+    int durability_set;
+    int scrub_rate;
+    char filters[FILTER_RULES_MAX];
+    io_class_t io_class;
+    int io_class_set;
+    int io_weight;
+    int io_rate;
+    int io_iops;
+    int ioprio;
+    int walk_fds;
+    int walk_mem;
+} backup_config_t;
+
+void config_init(backup_config_t *cfg);
+int config_set_option(backup_config_t *cfg, const char *name, const char *value, FILE *err);
+int config_load(backup_config_t *cfg, const char *target_root);
+int config_save(const backup_config_t *cfg, const char *target_root);
+void config_set_current(const backup_config_t *cfg);
+const backup_config_t *config_current(void);
+const char *format_name(target_format_t format);
+const char *durability_name(durability_t durability);
+const char *io_class_name(io_class_t io_class);
+void config_merge_saved(backup_config_t *cfg, const backup_config_t *saved);
+
+#endif
@@ -0,0 +1,335 @@
+// clang-format off
+#define _GNU_SOURCE
+#include "control.h"
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "config.h"
+
+// one connected client, requests are lines, replies are queued in request order
+typedef struct
+{
+    int fd;
+    char *in;
+    size_t in_len;
+    char *out;
+    size_t out_len;
+    size_t out_cap;
+    int closing;
+} client_t;
+
+static int listen_fd = -1;
+static char socket_path[PATH_MAX];
+static client_t clients[CONTROL_MAX_CLIENTS];
+static int client_count;
+static int atfork_set;
+
+// turnin --options of add command into backup config
+static int build_config(const command_t *cmd, backup_config_t *config, FILE *err)
+{
+    config_init(config);
+    for (int i = 0; i < cmd->option_count; i++)
+    {
+        if (config_set_option(config, cmd->options[i].name, cmd->options[i].value, err) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+// runnin add, end, list or stats for the terminal or a control client, messages go to out
+// and reasons for failures to err, a control client gets both in its reply
+int command_execute(backup_manager_t *mgr, const command_t *cmd, FILE *out, FILE *err)
+{
+    if (cmd->option_count > 0 && cmd->type != CMD_ADD)
+    {
+        fprintf(err, "Error: this command takes no options\n");
+        return -1;
+    }
+
+    int failed = 0;
+    switch (cmd->type)
+    {
+        case CMD_ADD:
+        {
+            backup_config_t config;
+            if (build_config(cmd, &config, err) == -1)
+                return -1;
+
+            fprintf(out, "Adding backup: %s\n", cmd->source_path);
+            for (int i = 0; i < cmd->target_count; i++)
+            {
+                fprintf(out, "  Target: %s\n", cmd->target_paths[i]);
+                if (backup_exists(mgr, cmd->source_path, cmd->target_paths[i]))
+                {
+                    fprintf(err, "Backup already exists: %s -> %s\n", cmd->source_path, cmd->target_paths[i]);
+                    failed++;
+                    continue;
+                }
+                backup_config_t target_config = config;
+                if (start_backup(mgr, cmd->source_path, cmd->target_paths[i], &target_config, err) == 0)
+                    fprintf(out, "Backup added successfully: %s -> %s\n", cmd->source_path, cmd->target_paths[i]);
+                else
+                    failed++;
+            }
+            break;
+        }
+        case CMD_END:
+            fprintf(out, "Ending backup: %s\n", cmd->source_path);
+            for (int i = 0; i < cmd->target_count; i++)
+            {
+                if (remove_backup(mgr, cmd->source_path, cmd->target_paths[i], err) == 0)
+                    fprintf(out, "Backup ended: %s -> %s\n", cmd->source_path, cmd->target_paths[i]);
+                else
+                    failed++;
+            }
+            break;
+        case CMD_LIST:
+            list_backups(mgr, out);
+            break;
+        case CMD_STATS:
+            backup_stats(mgr, out);
+            break;
+        default:
+            fprintf(err, "Error: command not available on control socket\n");
+            return -1;
+    }
+    return failed ? -1 : 0;
+}
+
+static void close_client(int i)
+{
+    close(clients[i].fd);
+    free(clients[i].in);
+    free(clients[i].out);
+    clients[i] = clients[--client_count];
+}
+
+// workers forked later must not keep the socket or clients open
+static void close_in_child(void)
+{
+    for (int i = 0; i < client_count; i++)
+        close(clients[i].fd);
+    client_count = 0;
+    if (listen_fd != -1)
+        close(listen_fd);
+    listen_fd = -1;
+}
+
+// listenin on a unix socket, a stale one left by a killed manager is replaced
+int control_open(const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return -1;
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    {
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (probe != -1 && connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == -1 && errno == ECONNREFUSED)
+            unlink(path);
+        if (probe != -1)
+            close(probe);
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || chmod(path, 0600) == -1 ||
+        listen(fd, CONTROL_BACKLOG) == -1)
+    {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+
+    if (!atfork_set && pthread_atfork(NULL, NULL, close_in_child) == 0)
+        atfork_set = 1;
+    listen_fd = fd;
+    strcpy(socket_path, path);
+    return 0;
+}
+
+void control_close(void)
+{
+    if (listen_fd == -1)
+        return;
+    while (client_count)
+        close_client(client_count - 1);
+    close(listen_fd);
+    listen_fd = -1;
+    unlink(socket_path);
+}
+
+// fillin the socket and clients for the main poll, returns how many fds were filled
+int control_fds(struct pollfd *fds, int max)
+{
+    int n = 0;
+    if (listen_fd != -1 && client_count < CONTROL_MAX_CLIENTS && n < max)
+        fds[n++] = (struct pollfd){listen_fd, POLLIN, 0};
+    for (int i = 0; i < client_count && n < max; i++)
+    {
+        short events = clients[i].closing ? 0 : POLLIN;
+        if (clients[i].out_len)
+            events |= POLLOUT;
+        fds[n++] = (struct pollfd){clients[i].fd, events, 0};
+    }
+    return n;
+}
+
+// queuein reply as "ok <len>" or "err <len>" line followed by what the command printed
+static void queue_reply(client_t *c, int ok, const char *text, size_t len)
+{
+    char head[32];
+    int head_len = snprintf(head, sizeof(head), "%s %zu\n", ok ? "ok" : "err", len);
+    if (c->out_len + head_len + len > c->out_cap)
+    {
+        size_t cap = c->out_cap ? c->out_cap : CONTROL_READ_LEN;
+        while (cap < c->out_len + head_len + len)
+            cap *= 2;
+        char *tmp = realloc(c->out, cap);
+        if (!tmp)
+        {
+            c->closing = 1;
+            return;
+        }
+        c->out = tmp;
+        c->out_cap = cap;
+    }
+    memcpy(c->out + c->out_len, head, head_len);
+    memcpy(c->out + c->out_len + head_len, text, len);
+    c->out_len += head_len + len;
+}
+
+static void run_line(backup_manager_t *mgr, client_t *c, const char *line)
+{
+    char *text = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&text, &len);
+    if (!out)
+    {
+        queue_reply(c, 0, "Error: out of memory\n", 21);
+        return;
+    }
+    // parse errors go to the client like the ones of the command itself
+    int ok = 0;
+    command_t *cmd = parse_command(line, out);
+    if (cmd && cmd->type != CMD_UNKNOWN)
+        ok = command_execute(mgr, cmd, out, out) == 0;
+    else if (!cmd && fflush(out) == 0 && len == 0)
+        fprintf(out, "Error: cannot parse '%s'\n", line);
+    free_command(cmd);
+    fclose(out);
+    queue_reply(c, ok, text, len);
+    free(text);
+}
+
+// readin what the client sent and runnin every complete line, a pipelined batch
+// is handled in one go and its replies leave in one write
+static void client_read(backup_manager_t *mgr, client_t *c)
+{
+    char buf[CONTROL_READ_LEN];
+    ssize_t got = read(c->fd, buf, sizeof(buf));
+    if (got == -1 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (got <= 0)
+    {
+        c->closing = 1;
+        return;
+    }
+
+    char *tmp = realloc(c->in, c->in_len + got + 1);
+    if (!tmp)
+    {
+        c->closing = 1;
+        return;
+    }
+    c->in = tmp;
+    memcpy(c->in + c->in_len, buf, got);
+    c->in_len += got;
+
+    size_t start = 0;
+    char *nl;
+    while ((nl = memchr(c->in + start, '\n', c->in_len - start)))
+    {
+        *nl = '\0';
+        if (nl > c->in + start && nl[-1] == '\r')
+            nl[-1] = '\0';
+        if (c->in[start])
+            run_line(mgr, c, c->in + start);
+        start = nl - c->in + 1;
+    }
+    memmove(c->in, c->in + start, c->in_len - start);
+    c->in_len -= start;
+    if (c->in_len > CONTROL_LINE_MAX)
+    {
+        queue_reply(c, 0, "Error: request too long\n", 24);
+        c->in_len = 0;
+        c->closing = 1;
+    }
+}
+
+static int client_flush(client_t *c)
+{
+    while (c->out_len)
+    {
+        ssize_t written = write(c->fd, c->out, c->out_len);
+        if (written == -1)
+            return errno == EAGAIN || errno == EINTR ? 0 : -1;
+        memmove(c->out, c->out + written, c->out_len - written);
+        c->out_len -= written;
+    }
+    return 0;
+}
+
+// handlin whatever poll reported on the fds control_fds filled
+void control_handle(backup_manager_t *mgr, const struct pollfd *fds, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (!fds[i].revents)
+            continue;
+        if (fds[i].fd == listen_fd)
+        {
+            while (client_count < CONTROL_MAX_CLIENTS)
+            {
+                int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (fd == -1)
+                    break;
+                memset(&clients[client_count], 0, sizeof(client_t));
+                clients[client_count++].fd = fd;
+            }
+            continue;
+        }
+        for (int j = 0; j < client_count; j++)
+        {
+            if (clients[j].fd != fds[i].fd)
+                continue;
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+                client_read(mgr, &clients[j]);
+            if (client_flush(&clients[j]) == -1)
+            {
+                clients[j].closing = 1;
+                clients[j].out_len = 0;
+            }
+            break;
+        }
+    }
+    for (int j = client_count - 1; j >= 0; j--)
+    {
+        if (clients[j].closing && !clients[j].out_len)
+            close_client(j);
+    }
+}
@@ -0,0 +1,21 @@
+// clang-format off
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <poll.h>
+#include <stdio.h>
+#include "backup_manager.h"
+#include "parser.h"
+
+#define CONTROL_MAX_CLIENTS 64
+#define CONTROL_BACKLOG 64
+#define CONTROL_LINE_MAX 16384
+#define CONTROL_READ_LEN 65536
+
+int command_execute(backup_manager_t *mgr, const command_t *cmd, FILE *out, FILE *err);
+int control_open(const char *path);
+void control_close(void);
+int control_fds(struct pollfd *fds, int max);
+void control_handle(backup_manager_t *mgr, const struct pollfd *fds, int count);
+
+#endif
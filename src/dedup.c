@@ -0,0 +1,578 @@
+// clang-format off
+#define _GNU_SOURCE
+#include "dedup.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+#include "attr.h"
+#include "backup.h"
+#include "config.h"
+#include "durable.h"
+#include "hash.h"
+#include "iosched.h"
+#include "meta.h"
+#include "snapshot.h"
+#include "walk.h"
+
+#define MANIFEST_MAGIC "SOPDDUP1"
+#define CHUNK_SEED2 0x9e3779b97f4a7c15ULL
+#define GC_GRACE_SECONDS 3600
+
+typedef struct
+{
+    uint64_t h[2];
+} chunk_id_t;
+
+// one line of manifest, which chunk and how long it is
+typedef struct
+{
+    chunk_id_t id;
+    uint32_t len;
+    uint32_t pad;
+} manifest_entry_t;
+
+// random table for gear rolling hash, same on every run so chunk bounds are stable
+static uint64_t gear[256];
+static int gear_ready = 0;
+
+static void init_gear()
+{
+    if (gear_ready)
+        return;
+    uint64_t x = 0x5350504f4b434148ULL;
+    for (int i = 0; i < 256; i++)
+    {
+        x += 0x9e3779b97f4a7c15ULL;
+        uint64_t z = x;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+    gear_ready = 1;
+}
+
+// findin where the next chunk ends, content defined so inserts dont shift every chunk
+static size_t find_cut(const unsigned char *p, size_t n)
+{
+    if (n <= CHUNK_MIN_LEN)
+        return n;
+    size_t end = n < CHUNK_MAX_LEN ? n : CHUNK_MAX_LEN;
+    uint64_t h = 0;
+    for (size_t i = CHUNK_MIN_LEN; i < end; i++)
+    {
+        h = (h << 1) + gear[p[i]];
+        if (!(h & CHUNK_AVG_MASK))
+            return i + 1;
+    }
+    return end;
+}
+
+static chunk_id_t chunk_hash(const void *data, size_t len)
+{
+    chunk_id_t id = {{hash64(data, len, 0), hash64(data, len, CHUNK_SEED2)}};
+    return id;
+}
+
+static int chunk_path(char *out, const char *store_dir, chunk_id_t id)
+{
+    int n = snprintf(out, PATH_MAX, "%s/%02x/%016" PRIx64 "%016" PRIx64, store_dir, (unsigned)(id.h[0] >> 56),
+                     id.h[0], id.h[1]);
+    return (n < 0 || n >= PATH_MAX) ? -1 : 0;
+}
+
+// where chunks of this backup go, shared store or one inside the target
+int dedup_store_dir(char *out, const char *store_path, const char *target_root)
+{
+    int n;
+    if (store_path && store_path[0])
+        n = snprintf(out, PATH_MAX, "%s", store_path);
+    else
+    {
+        n = snprintf(out, PATH_MAX, "%s/%s", target_root, META_DIR_NAME);
+        if (n < 0 || n >= PATH_MAX)
+            return -1;
+        if (mkdir(out, 0700) == -1 && errno != EEXIST)
+            return -1;
+        n = snprintf(out, PATH_MAX, "%s/%s/chunks", target_root, META_DIR_NAME);
+    }
+    if (n < 0 || n >= PATH_MAX)
+        return -1;
+    if (mkdir(out, 0700) == -1 && errno != EEXIST)
+        return -1;
+    return 0;
+}
+
+// writin chunk only if the store doesnt have it yet
+static int store_chunk(const char *store_dir, chunk_id_t id, const char *data, size_t len)
+{
+    char path[PATH_MAX];
+    if (chunk_path(path, store_dir, id) == -1)
+        return -1;
+    // already there, just touch it so a runnin gc treats it as fresh
+    if (utimes(path, NULL) == 0)
+        return 0;
+
+    char dir[PATH_MAX];
+    snprintf(dir, PATH_MAX, "%s/%02x", store_dir, (unsigned)(id.h[0] >> 56));
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST)
+        return -1;
+
+    // tmp name + rename so other backups sharing the store never see half a chunk
+    static unsigned long counter = 0;
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, PATH_MAX, "%s/.tmp.%d.%lu", dir, getpid(), counter++) >= PATH_MAX)
+        return -1;
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1)
+        return -1;
+    iosched_charge(len);
+    if (bulk_write(fd, (char *)data, len) == -1)
+    {
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    durable_written(fd);
+    close(fd);
+    if (rename(tmp, path) == -1)
+    {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+// choppin file into chunks, storin new ones and writin manifest in place of the file
+int dedup_store_file(const char *source_path, const char *dest_path, const struct stat *source_stat)
+{
+    const char *root = meta_get_root();
+    char store_dir[PATH_MAX];
+    if (!root || dedup_store_dir(store_dir, config_current()->store_path, root) == -1)
+        return -1;
+
+    int fd = open(source_path, O_RDONLY);
+    if (fd == -1)
+        return -1;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    init_gear();
+    unsigned char *buf = malloc(2 * CHUNK_MAX_LEN);
+    size_t cap = 64, count = 0;
+    manifest_entry_t *entries = malloc(cap * sizeof(*entries));
+    if (!buf || !entries)
+    {
+        free(buf);
+        free(entries);
+        close(fd);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    int ret = 0, eof = 0;
+    size_t pos = 0, avail = 0;
+    uint64_t total = 0;
+    for (;;)
+    {
+        // keepin at least one max chunk in buffer so cut points are the same every time
+        if (!eof && avail - pos < CHUNK_MAX_LEN)
+        {
+            memmove(buf, buf + pos, avail - pos);
+            avail -= pos;
+            pos = 0;
+            ssize_t got = bulk_read(fd, (char *)buf + avail, 2 * CHUNK_MAX_LEN - avail);
+            if (got < 0)
+            {
+                ret = -1;
+                break;
+            }
+            if (got == 0)
+                eof = 1;
+            avail += got;
+        }
+        if (pos == avail)
+            break;
+
+        size_t cut = find_cut(buf + pos, avail - pos);
+        if (count == cap)
+        {
+            cap *= 2;
+            manifest_entry_t *tmp = realloc(entries, cap * sizeof(*entries));
+            if (!tmp)
+            {
+                ret = -1;
+                break;
+            }
+            entries = tmp;
+        }
+        entries[count].id = chunk_hash(buf + pos, cut);
+        entries[count].len = cut;
+        entries[count].pad = 0;
+        if (store_chunk(store_dir, entries[count].id, (char *)buf + pos, cut) == -1)
+        {
+            ret = -1;
+            break;
+        }
+        count++;
+        pos += cut;
+        total += cut;
+    }
+    close(fd);
+    free(buf);
+
+    if (ret == 0)
+    {
+        manifest_header_t hdr;
+        memcpy(hdr.magic, MANIFEST_MAGIC, sizeof(hdr.magic));
+        hdr.size = total;
+        hdr.mtime_ns = attr_mtime_ns(source_stat);
+        hdr.mode = source_stat->st_mode & 0777;
+        hdr.count = count;
+
+        char tmp_path[PATH_MAX];
+        int out = staged_open(dest_path, source_stat->st_mode, tmp_path);
+        if (out == -1 || bulk_write(out, (char *)&hdr, sizeof(hdr)) == -1 ||
+            bulk_write(out, (char *)entries, count * sizeof(*entries)) == -1)
+        {
+            if (out != -1)
+                staged_abort(out, tmp_path);
+            ret = -1;
+        }
+        else
+            ret = staged_commit(out, tmp_path, dest_path);
+    }
+    free(entries);
+    return ret;
+}
+
+// checcs if file is a manifest and reads its header
+int dedup_read_header(const char *manifest_path, manifest_header_t *hdr)
+{
+    int fd = open(manifest_path, O_RDONLY);
+    if (fd == -1)
+        return -1;
+    ssize_t got = bulk_read(fd, (char *)hdr, sizeof(*hdr));
+    close(fd);
+    if (got != sizeof(*hdr) || memcmp(hdr->magic, MANIFEST_MAGIC, sizeof(hdr->magic)) != 0)
+        return -1;
+    hdr->mtime_ns = attr_stored_ns(hdr->mtime_ns);
+    return 0;
+}
+
+// chmod or touch of the source only changes the manifest header, chunks stay as they are
+int dedup_update_attrs(const char *manifest_path, const struct stat *source_stat)
+{
+    int fd = open(manifest_path, O_RDWR | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    manifest_header_t hdr;
+    int ret = -1;
+    if (pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) && memcmp(hdr.magic, MANIFEST_MAGIC, sizeof(hdr.magic)) == 0)
+    {
+        hdr.mtime_ns = attr_mtime_ns(source_stat);
+        hdr.mode = source_stat->st_mode & 0777;
+        if (pwrite(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr))
+        {
+            durable_written(fd);
+            ret = 0;
+        }
+    }
+    close(fd);
+    return ret;
+}
+
+// readin manifest entries after the header
+static manifest_entry_t *read_manifest(const char *manifest_path, manifest_header_t *hdr)
+{
+    int fd = open(manifest_path, O_RDONLY);
+    if (fd == -1)
+        return NULL;
+    manifest_entry_t *entries = NULL;
+    if (bulk_read(fd, (char *)hdr, sizeof(*hdr)) == sizeof(*hdr) &&
+        memcmp(hdr->magic, MANIFEST_MAGIC, sizeof(hdr->magic)) == 0)
+    {
+        size_t bytes = (size_t)hdr->count * sizeof(*entries);
+        entries = malloc(bytes + 1);
+        if (entries && bulk_read(fd, (char *)entries, bytes) != (ssize_t)bytes)
+        {
+            free(entries);
+            entries = NULL;
+        }
+    }
+    close(fd);
+    return entries;
+}
+
+// rebuildin original file from its chunks
+int dedup_restore_file(const char *manifest_path, const char *dest_path, const char *store_dir)
+{
+    manifest_header_t hdr;
+    manifest_entry_t *entries = read_manifest(manifest_path, &hdr);
+    if (!entries)
+        return -1;
+
+    char tmp_path[PATH_MAX];
+    int out = staged_open(dest_path, hdr.mode, tmp_path);
+    char *buf = malloc(CHUNK_MAX_LEN);
+    if (out == -1 || !buf)
+    {
+        if (out != -1)
+            staged_abort(out, tmp_path);
+        free(buf);
+        free(entries);
+        return -1;
+    }
+
+    int ret = 0;
+    for (uint32_t i = 0; i < hdr.count && ret == 0; i++)
+    {
+        char path[PATH_MAX];
+        int fd = -1;
+        if (entries[i].len > CHUNK_MAX_LEN || chunk_path(path, store_dir, entries[i].id) == -1 ||
+            (fd = open(path, O_RDONLY)) == -1)
+        {
+            fprintf(stderr, "Missing chunk for %s\n", manifest_path);
+            ret = -1;
+            break;
+        }
+        if (bulk_read(fd, buf, entries[i].len) != entries[i].len || bulk_write(out, buf, entries[i].len) == -1)
+            ret = -1;
+        close(fd);
+    }
+    free(buf);
+    free(entries);
+    if (ret == -1)
+    {
+        staged_abort(out, tmp_path);
+        return -1;
+    }
+
+    attr_set_mtime_ns(tmp_path, attr_stored_ns(hdr.mtime_ns));
+    return staged_commit(out, tmp_path, dest_path);
+}
+
+// rememberin which targets use the store, gc has to look at all of them
+int dedup_register_root(const char *store_dir, const char *target_root)
+{
+    char *real = realpath(target_root, NULL);
+    if (!real)
+        return -1;
+
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s/roots", store_dir);
+    FILE *f = fopen(path, "a+");
+    if (!f)
+    {
+        free(real);
+        return -1;
+    }
+    rewind(f);
+    char line[PATH_MAX];
+    int found = 0;
+    while (fgets(line, sizeof(line), f))
+    {
+        line[strcspn(line, "\n")] = '\0';
+        if (strcmp(line, real) == 0)
+            found = 1;
+    }
+    if (!found)
+        fprintf(f, "%s\n", real);
+    fclose(f);
+    free(real);
+    return 0;
+}
+
+// simple open addressin set of chunk ids for gc mark phase
+typedef struct
+{
+    chunk_id_t *ids;
+    unsigned char *used;
+    size_t cap;
+    size_t count;
+} chunk_set_t;
+
+static int set_insert(chunk_set_t *set, chunk_id_t id);
+
+static int set_grow(chunk_set_t *set)
+{
+    chunk_set_t bigger = {0};
+    bigger.cap = set->cap ? set->cap * 2 : 1024;
+    bigger.ids = malloc(bigger.cap * sizeof(chunk_id_t));
+    bigger.used = calloc(bigger.cap, 1);
+    if (!bigger.ids || !bigger.used)
+    {
+        free(bigger.ids);
+        free(bigger.used);
+        return -1;
+    }
+    for (size_t i = 0; i < set->cap; i++)
+    {
+        if (set->used[i])
+            set_insert(&bigger, set->ids[i]);
+    }
+    free(set->ids);
+    free(set->used);
+    *set = bigger;
+    return 0;
+}
+
+static int set_insert(chunk_set_t *set, chunk_id_t id)
+{
+    if ((set->count + 1) * 2 > set->cap && set_grow(set) == -1)
+        return -1;
+    size_t i = id.h[0] & (set->cap - 1);
+    while (set->used[i])
+    {
+        if (set->ids[i].h[0] == id.h[0] && set->ids[i].h[1] == id.h[1])
+            return 0;
+        i = (i + 1) & (set->cap - 1);
+    }
+    set->used[i] = 1;
+    set->ids[i] = id;
+    set->count++;
+    return 0;
+}
+
+static int set_contains(const chunk_set_t *set, chunk_id_t id)
+{
+    if (!set->cap)
+        return 0;
+    size_t i = id.h[0] & (set->cap - 1);
+    while (set->used[i])
+    {
+        if (set->ids[i].h[0] == id.h[0] && set->ids[i].h[1] == id.h[1])
+            return 1;
+        i = (i + 1) & (set->cap - 1);
+    }
+    return 0;
+}
+
+// markin every chunk referenced from manifests under this dir
+static int mark_tree(chunk_set_t *set, const char *path)
+{
+    walk_tree_t tree;
+    if (walk_tree_open(&tree, AT_FDCWD, path, path, NULL) == -1)
+        return errno == ENOENT ? 0 : -1;
+
+    int ret = 0;
+    int step;
+    while (ret == 0 && (step = walk_tree_next(&tree)) > 0)
+    {
+        if (step == WALK_LEAVE || (tree.depth == 1 && is_meta_name(tree.name)))
+            continue;
+
+        struct stat st;
+        if (walk_stat(tree.dir_fd, tree.name, &st) == -1)
+            continue;
+        if (S_ISDIR(st.st_mode))
+        {
+            if (walk_tree_enter(&tree) == -1 && errno != ENOENT)
+                ret = -1;
+        }
+        else if (S_ISREG(st.st_mode))
+        {
+            manifest_header_t hdr;
+            manifest_entry_t *entries = read_manifest(tree.path, &hdr);
+            if (!entries)
+                continue;
+            for (uint32_t i = 0; i < hdr.count && ret == 0; i++)
+                ret = set_insert(set, entries[i].id);
+            free(entries);
+        }
+    }
+    walk_tree_close(&tree);
+    return ret;
+}
+
+// removin chunks no manifest points to anymore
+int dedup_gc(const char *store_dir)
+{
+    time_t started = time(NULL);
+    chunk_set_t set = {0};
+
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s/roots", store_dir);
+    FILE *f = fopen(path, "r");
+    if (!f)
+    {
+        fprintf(stderr, "No backups registered in store %s\n", store_dir);
+        return -1;
+    }
+    char line[PATH_MAX];
+    while (fgets(line, sizeof(line), f))
+    {
+        line[strcspn(line, "\n")] = '\0';
+        // snapshots keep their own manifests, chunks they use must stay too
+        char snaps[PATH_MAX];
+        if (line[0] && snprintf(snaps, PATH_MAX, "%s/%s/%s", line, META_DIR_NAME, SNAPSHOT_DIR_NAME) >= PATH_MAX)
+            snaps[0] = '\0';
+        if (line[0] && (mark_tree(&set, line) == -1 || (snaps[0] && mark_tree(&set, snaps) == -1)))
+        {
+            fprintf(stderr, "Failed to scan manifests in %s, not collecting\n", line);
+            fclose(f);
+            free(set.ids);
+            free(set.used);
+            return -1;
+        }
+    }
+    fclose(f);
+
+    DIR *top = opendir(store_dir);
+    if (!top)
+    {
+        free(set.ids);
+        free(set.used);
+        return -1;
+    }
+    unsigned long removed = 0;
+    unsigned long long freed = 0;
+    struct dirent *sub;
+    while ((sub = readdir(top)) != NULL)
+    {
+        if (strlen(sub->d_name) != 2)
+            continue;
+        char sub_path[PATH_MAX];
+        snprintf(sub_path, PATH_MAX, "%s/%s", store_dir, sub->d_name);
+        DIR *dir = opendir(sub_path);
+        if (!dir)
+            continue;
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL)
+        {
+            if (entry->d_name[0] == '.' && strncmp(entry->d_name, ".tmp.", 5) != 0)
+                continue;
+            char chunk[PATH_MAX];
+            if (snprintf(chunk, PATH_MAX, "%s/%s", sub_path, entry->d_name) >= PATH_MAX)
+                continue;
+            struct stat st;
+            // recently touched chunks may belong to a manifest bein written right now
+            if (lstat(chunk, &st) == -1 || st.st_mtime >= started - GC_GRACE_SECONDS)
+                continue;
+
+            chunk_id_t id;
+            int is_tmp = entry->d_name[0] == '.';
+            if (!is_tmp && (strlen(entry->d_name) != 32 ||
+                            sscanf(entry->d_name, "%16" SCNx64 "%16" SCNx64, &id.h[0], &id.h[1]) != 2))
+                continue;
+            if ((is_tmp || !set_contains(&set, id)) && unlink(chunk) == 0)
+            {
+                removed++;
+                freed += st.st_size;
+            }
+        }
+        closedir(dir);
+    }
+    closedir(top);
+    free(set.ids);
+    free(set.used);
+
+    fprintf(stdout, "Removed %lu unreferenced chunks (%llu bytes)\n", removed, freed);
+    return 0;
+}
@@ -0,0 +1,29 @@
+// clang-format off
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+#define CHUNK_MIN_LEN (16 * 1024)
+#define CHUNK_MAX_LEN (256 * 1024)
+#define CHUNK_AVG_MASK 0xffffULL
+
+typedef struct
+{
+    char magic[8];
+    uint64_t size;
+    int64_t mtime_ns;
+    uint32_t mode;
+    uint32_t count;
+} manifest_header_t;
+
+int dedup_store_file(const char *source_path, const char *dest_path, const struct stat *source_stat);
+int dedup_read_header(const char *manifest_path, manifest_header_t *hdr);
+int dedup_restore_file(const char *manifest_path, const char *dest_path, const char *store_dir);
+int dedup_update_attrs(const char *manifest_path, const struct stat *source_stat);
+int dedup_store_dir(char *out, const char *store_path, const char *target_root);
+int dedup_register_root(const char *store_dir, const char *target_root);
+int dedup_gc(const char *store_dir);
+
+#endif
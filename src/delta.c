@@ -0,0 +1,414 @@
+// clang-format off
+#define _GNU_SOURCE
+#include "delta.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "attr.h"
+#include "backup.h"
+#include "hash.h"
+#include "iosched.h"
+#include "meta.h"
+
+#define BLOCKMAP_MAGIC 0x424f5054u
+#define APPEND_MAGIC 0x414f5054u
+
+// header of the block hash file, describes which target version the hashes are for,
+// the target path follows it and the hashes come after that
+typedef struct
+{
+    uint32_t magic;
+    uint32_t block_len;
+    uint64_t size;
+    int64_t mtime_ns;
+    uint64_t count;
+    uint32_t path_len;
+    uint32_t pad;
+} blockmap_header_t;
+
+// which source inode the target copy came from, needed to trust an append, target path follows
+typedef struct
+{
+    uint32_t magic;
+    uint32_t path_len;
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+} append_state_t;
+
+// last time state files of deleted or moved targets were looked for
+static time_t last_sweep;
+
+// path inside the target the state file is for, dest_path already passed meta_file_path
+static const char *state_rel(const char *dest_path)
+{
+    return dest_path + strlen(meta_get_root());
+}
+
+static uint64_t block_count(off_t size)
+{
+    return (size + DELTA_BLOCK_LEN - 1) / DELTA_BLOCK_LEN;
+}
+
+// readin whole block at offset, short only at the end
+static ssize_t read_block(int fd, char *buf, off_t offset)
+{
+    size_t len = 0;
+    while (len < DELTA_BLOCK_LEN)
+    {
+        ssize_t c = TEMP_FAILURE_RETRY(pread(fd, buf + len, DELTA_BLOCK_LEN - len, offset + len));
+        if (c < 0)
+            return -1;
+        if (c == 0)
+            break;
+        len += c;
+    }
+    return len;
+}
+
+// loadin saved hashes, only if they still describe the target as it is now
+static uint64_t *load_blockmap(const char *map_path, const struct stat *dest_stat, uint64_t *count)
+{
+    int fd = open(map_path, O_RDONLY);
+    if (fd == -1)
+        return NULL;
+
+    blockmap_header_t hdr;
+    char rel[PATH_MAX];
+    uint64_t *hashes = NULL;
+    if (bulk_read(fd, (char *)&hdr, sizeof(hdr)) == sizeof(hdr) && hdr.magic == BLOCKMAP_MAGIC &&
+        hdr.block_len == DELTA_BLOCK_LEN && hdr.size == (uint64_t)dest_stat->st_size &&
+        hdr.mtime_ns == attr_mtime_ns(dest_stat) && hdr.count == block_count(dest_stat->st_size) &&
+        hdr.path_len < PATH_MAX && bulk_read(fd, rel, hdr.path_len) == hdr.path_len)
+    {
+        hashes = malloc(hdr.count * sizeof(uint64_t) + 1);
+        if (hashes &&
+            bulk_read(fd, (char *)hashes, hdr.count * sizeof(uint64_t)) != (ssize_t)(hdr.count * sizeof(uint64_t)))
+        {
+            free(hashes);
+            hashes = NULL;
+        }
+        *count = hdr.count;
+    }
+    close(fd);
+    return hashes;
+}
+
+// no usable map, so hash the target copy once
+static uint64_t *hash_target(int dest_fd, off_t size, char *buf, uint64_t *count)
+{
+    *count = block_count(size);
+    uint64_t *hashes = malloc(*count * sizeof(uint64_t) + 1);
+    if (!hashes)
+        return NULL;
+    for (uint64_t i = 0; i < *count; i++)
+    {
+        ssize_t len = read_block(dest_fd, buf, i * DELTA_BLOCK_LEN);
+        if (len < 0)
+        {
+            free(hashes);
+            return NULL;
+        }
+        hashes[i] = hash64(buf, len, 0);
+    }
+    return hashes;
+}
+
+// savin hashes next to other metadata, tmp file + rename so it is never half written
+static void save_blockmap(const char *map_path, const char *rel, const struct stat *source_stat, uint64_t *hashes,
+                          uint64_t count)
+{
+    char tmp_path[PATH_MAX];
+    if (snprintf(tmp_path, PATH_MAX, "%s.tmp", map_path) >= PATH_MAX)
+        return;
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1)
+        return;
+
+    blockmap_header_t hdr = {BLOCKMAP_MAGIC, DELTA_BLOCK_LEN, source_stat->st_size, attr_mtime_ns(source_stat), count,
+                             strlen(rel), 0};
+    if (bulk_write(fd, (char *)&hdr, sizeof(hdr)) == -1 || bulk_write(fd, (char *)rel, hdr.path_len) == -1 ||
+        bulk_write(fd, (char *)hashes, count * sizeof(uint64_t)) == -1)
+    {
+        close(fd);
+        unlink(tmp_path);
+        return;
+    }
+    close(fd);
+    if (rename(tmp_path, map_path) == -1)
+        unlink(tmp_path);
+}
+
+// updatin big file in place, only blocks with different hash get rewritten
+// returns 1 when delta is not possible and caller should do full copy
+int copy_file_delta(int source_fd, const struct stat *source_stat, const char *dest_path)
+{
+    char map_path[PATH_MAX];
+    if (meta_file_path(map_path, "blockmaps", dest_path) == -1)
+        return 1;
+
+    int dest_fd = open(dest_path, O_RDWR);
+    if (dest_fd == -1)
+    {
+        if (errno != ENOENT)
+            return -1;
+        // target will be copied fresh, old hashes cant be trusted anymore
+        unlink(map_path);
+        return 1;
+    }
+
+    struct stat dest_stat;
+    if (fstat(dest_fd, &dest_stat) == -1 || !S_ISREG(dest_stat.st_mode))
+    {
+        close(dest_fd);
+        return 1;
+    }
+
+    char *buf = malloc(DELTA_BLOCK_LEN);
+    if (!buf)
+    {
+        close(dest_fd);
+        return -1;
+    }
+
+    uint64_t old_count = 0;
+    uint64_t *old_hashes = load_blockmap(map_path, &dest_stat, &old_count);
+    if (!old_hashes)
+        old_hashes = hash_target(dest_fd, dest_stat.st_size, buf, &old_count);
+    if (!old_hashes)
+    {
+        free(buf);
+        close(dest_fd);
+        return -1;
+    }
+
+    uint64_t new_count = block_count(source_stat->st_size);
+    uint64_t *new_hashes = malloc(new_count * sizeof(uint64_t) + 1);
+    if (!new_hashes)
+    {
+        free(old_hashes);
+        free(buf);
+        close(dest_fd);
+        return -1;
+    }
+
+    int ret = 0;
+    off_t size = 0;
+    for (uint64_t i = 0; i < new_count; i++)
+    {
+        off_t offset = i * DELTA_BLOCK_LEN;
+        ssize_t len = read_block(source_fd, buf, offset);
+        if (len < 0)
+        {
+            ret = -1;
+            break;
+        }
+        new_hashes[i] = hash64(buf, len, 0);
+        size = offset + len;
+        if (i < old_count && old_hashes[i] == new_hashes[i])
+            continue;
+        iosched_charge(len);
+        if (len > 0 && pwrite(dest_fd, buf, len, offset) != len)
+        {
+            ret = -1;
+            break;
+        }
+        if (len < DELTA_BLOCK_LEN)
+        {
+            new_count = i + 1;
+            break;
+        }
+    }
+
+    if (ret == 0 && size != dest_stat.st_size && ftruncate(dest_fd, size) == -1)
+        ret = -1;
+
+    if (ret == 0)
+    {
+        struct stat saved = *source_stat;
+        saved.st_size = size;
+        save_blockmap(map_path, state_rel(dest_path), &saved, new_hashes, block_count(size));
+    }
+    else
+    {
+        unlink(map_path);
+    }
+
+    free(new_hashes);
+    free(old_hashes);
+    free(buf);
+    close(dest_fd);
+    return ret;
+}
+
+// rememberin source inode and size after a copy, so next growth can be appended
+void save_append_state(const struct stat *source_stat, const char *dest_path)
+{
+    char state_path[PATH_MAX];
+    if (source_stat->st_size < APPEND_MIN_SIZE || meta_file_path(state_path, "tails", dest_path) == -1)
+        return;
+
+    int fd = open(state_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1)
+        return;
+    const char *rel = state_rel(dest_path);
+    append_state_t st = {APPEND_MAGIC, strlen(rel), source_stat->st_dev, source_stat->st_ino, source_stat->st_size};
+    if (bulk_write(fd, (char *)&st, sizeof(st)) == -1 || bulk_write(fd, (char *)rel, st.path_len) == -1)
+    {
+        close(fd);
+        unlink(state_path);
+        return;
+    }
+    close(fd);
+}
+
+// comparin the last bytes of the old target with the same range of the source
+static int tail_matches(int source_fd, int dest_fd, off_t old_size)
+{
+    char src_buf[APPEND_TAIL_LEN], dst_buf[APPEND_TAIL_LEN];
+    off_t len = old_size < APPEND_TAIL_LEN ? old_size : APPEND_TAIL_LEN;
+    off_t offset = old_size - len;
+
+    if (pread(source_fd, src_buf, len, offset) != len || pread(dest_fd, dst_buf, len, offset) != len)
+        return 0;
+    return hash64(src_buf, len, 0) == hash64(dst_buf, len, 0);
+}
+
+// copyin only the new tail of a file that just grew, like logs do
+// returns 1 when the file was rewritten or truncated and caller should do full copy
+int copy_file_append(int source_fd, const struct stat *source_stat, const char *dest_path)
+{
+    char state_path[PATH_MAX];
+    if (source_stat->st_size < APPEND_MIN_SIZE || meta_file_path(state_path, "tails", dest_path) == -1)
+        return 1;
+
+    int fd = open(state_path, O_RDONLY);
+    if (fd == -1)
+        return 1;
+    append_state_t st;
+    ssize_t got = bulk_read(fd, (char *)&st, sizeof(st));
+    close(fd);
+    if (got != sizeof(st) || st.magic != APPEND_MAGIC || st.dev != (uint64_t)source_stat->st_dev ||
+        st.ino != (uint64_t)source_stat->st_ino || st.size >= (uint64_t)source_stat->st_size)
+        return 1;
+
+    int dest_fd = open(dest_path, O_RDWR);
+    if (dest_fd == -1)
+        return errno == ENOENT ? 1 : -1;
+
+    struct stat dest_stat;
+    if (fstat(dest_fd, &dest_stat) == -1 || (uint64_t)dest_stat.st_size != st.size ||
+        !tail_matches(source_fd, dest_fd, dest_stat.st_size))
+    {
+        close(dest_fd);
+        return 1;
+    }
+
+    off_t src_off = dest_stat.st_size, dst_off = dest_stat.st_size;
+    off_t left = source_stat->st_size - dest_stat.st_size;
+    while (left > 0)
+    {
+        size_t step = left < IOSCHED_CHARGE_LEN ? (size_t)left : IOSCHED_CHARGE_LEN;
+        iosched_charge(step);
+        ssize_t c = copy_file_range(source_fd, &src_off, dest_fd, &dst_off, step, 0);
+        if (c == -1 && errno == EINTR)
+            continue;
+        if (c == -1 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP))
+        {
+            // no in kernel copy between these filesystems, do it by hand
+            char buf[DELTA_BLOCK_LEN];
+            size_t want = left < DELTA_BLOCK_LEN ? (size_t)left : DELTA_BLOCK_LEN;
+            c = pread(source_fd, buf, want, src_off);
+            if (c > 0 && pwrite(dest_fd, buf, c, dst_off) != c)
+                c = -1;
+            if (c > 0)
+            {
+                src_off += c;
+                dst_off += c;
+            }
+        }
+        if (c == -1)
+        {
+            close(dest_fd);
+            return -1;
+        }
+        if (c == 0)
+            break;
+        left -= c;
+    }
+    close(dest_fd);
+
+    struct stat saved = *source_stat;
+    saved.st_size = dst_off;
+    save_append_state(&saved, dest_path);
+    return 0;
+}
+
+// state file whose target is no longer a regular file, or that is not a state file at all
+static int state_orphaned(int dir_fd, const char *name, uint32_t magic, size_t header_len, size_t path_len_off)
+{
+    int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return 0;
+    char hdr[sizeof(blockmap_header_t)];
+    char rel[PATH_MAX];
+    uint32_t file_magic, path_len;
+    int orphaned = 1;
+    if (bulk_read(fd, hdr, header_len) == (ssize_t)header_len)
+    {
+        memcpy(&file_magic, hdr, sizeof(file_magic));
+        memcpy(&path_len, hdr + path_len_off, sizeof(path_len));
+        if (file_magic == magic && path_len && path_len < PATH_MAX && bulk_read(fd, rel, path_len) == path_len)
+        {
+            rel[path_len] = '\0';
+            char target_path[PATH_MAX];
+            struct stat st;
+            if (snprintf(target_path, PATH_MAX, "%s%s", meta_get_root(), rel) < PATH_MAX)
+                orphaned = lstat(target_path, &st) == 0 ? !S_ISREG(st.st_mode) : errno == ENOENT || errno == ENOTDIR;
+        }
+    }
+    close(fd);
+    return orphaned;
+}
+
+static void sweep_kind(const char *kind, uint32_t magic, size_t header_len, size_t path_len_off)
+{
+    char dir_path[PATH_MAX];
+    if (meta_path(dir_path, kind, "") == -1)
+        return;
+    DIR *dir = opendir(dir_path);
+    if (!dir)
+        return;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (entry->d_name[0] == '.')
+            continue;
+        // a name with a dot is a temp file of a save that never finished
+        if ((strchr(entry->d_name, '.') ||
+             state_orphaned(dirfd(dir), entry->d_name, magic, header_len, path_len_off)) &&
+            unlinkat(dirfd(dir), entry->d_name, 0) == -1 && errno != ENOENT)
+            perror("Failed to remove stale delta state");
+    }
+    closedir(dir);
+}
+
+// droppin block maps and tail states of targets that were deleted or moved away, the
+// removal paths never tell us which big files were under a dir, so this looks once in a while
+void delta_tick(void)
+{
+    if (!meta_get_root() || time(NULL) - last_sweep < DELTA_SWEEP_INTERVAL)
+        return;
+    last_sweep = time(NULL);
+    sweep_kind("blockmaps", BLOCKMAP_MAGIC, sizeof(blockmap_header_t), offsetof(blockmap_header_t, path_len));
+    sweep_kind("tails", APPEND_MAGIC, sizeof(append_state_t), offsetof(append_state_t, path_len));
+}
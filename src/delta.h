@@ -0,0 +1,20 @@
+// clang-format off
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <sys/stat.h>
+
+#define DELTA_THRESHOLD (64LL * 1024 * 1024)
+#define DELTA_BLOCK_LEN (64 * 1024)
+
+#define APPEND_MIN_SIZE (1024 * 1024)
+#define APPEND_TAIL_LEN 4096
+
+#define DELTA_SWEEP_INTERVAL (60 * 60)
+
+int copy_file_delta(int source_fd, const struct stat *source_stat, const char *dest_path);
+int copy_file_append(int source_fd, const struct stat *source_stat, const char *dest_path);
+void save_append_state(const struct stat *source_stat, const char *dest_path);
+void delta_tick(void);
+
+#endif
@@ -0,0 +1,298 @@
+// clang-format off
+#define _GNU_SOURCE
+#include "durable.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "config.h"
+#include "meta.h"
+
+// one open fd per filesystem with unsynced writes, syncfs on it flushes them all
+static int dirty_fds[DURABLE_MAX_FS];
+static dev_t dirty_devs[DURABLE_MAX_FS];
+static int dirty_count;
+static struct timespec last_flush;
+// restore commits files from several threads
+static pthread_mutex_t dirty_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int flush_locked(void);
+
+// fsyncin directory so the rename itself survives a crash
+static void sync_parent(const char *path)
+{
+    char dir[PATH_MAX];
+    strncpy(dir, path, PATH_MAX - 1);
+    dir[PATH_MAX - 1] = '\0';
+    char *slash = strrchr(dir, '/');
+    if (slash == dir)
+        slash[1] = '\0';
+    else if (slash)
+        *slash = '\0';
+    else
+        strcpy(dir, ".");
+
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+        return;
+    fsync(fd);
+    close(fd);
+}
+
+static void mark_dirty(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        return;
+    pthread_mutex_lock(&dirty_lock);
+    for (int i = 0; i < dirty_count; i++)
+    {
+        if (dirty_devs[i] == st.st_dev)
+        {
+            pthread_mutex_unlock(&dirty_lock);
+            return;
+        }
+    }
+    if (dirty_count == DURABLE_MAX_FS)
+    {
+        flush_locked();
+    }
+    int copy = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (copy != -1)
+    {
+        dirty_fds[dirty_count] = copy;
+        dirty_devs[dirty_count++] = st.st_dev;
+    }
+    pthread_mutex_unlock(&dirty_lock);
+}
+
+// staging dir of the current target and the filesystem it is on, looked up once per root
+static char staging_root[PATH_MAX];
+static char staging_path[PATH_MAX];
+static dev_t staging_dev;
+static pthread_mutex_t staging_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// pickin the target's staging dir for dest, -1 when dest is outside the target or
+// on another filesystem than the metadata (a mount inside the target)
+static int staging_dir_for(const char *dest_path, char *dir)
+{
+    const char *root = meta_get_root();
+    size_t root_len = root ? strlen(root) : 0;
+    if (!root_len || strncmp(dest_path, root, root_len) != 0 || dest_path[root_len] != '/')
+        return -1;
+
+    pthread_mutex_lock(&staging_lock);
+    if (strcmp(staging_root, root) != 0)
+    {
+        struct stat st;
+        if (meta_path(staging_path, STAGING_KIND, "") == -1 || stat(staging_path, &st) == -1)
+        {
+            pthread_mutex_unlock(&staging_lock);
+            return -1;
+        }
+        staging_dev = st.st_dev;
+        strcpy(staging_root, root);
+    }
+    strcpy(dir, staging_path);
+    dev_t dev = staging_dev;
+    pthread_mutex_unlock(&staging_lock);
+
+    char parent[PATH_MAX];
+    const char *slash = strrchr(dest_path, '/');
+    snprintf(parent, sizeof(parent), "%.*s", (int)(slash - dest_path), dest_path);
+    struct stat st;
+    if (stat(parent, &st) == -1 || st.st_dev != dev)
+        return -1;
+    return 0;
+}
+
+// creatin temp file for dest, inside a target it goes to the metadata staging dir so no temp
+// ever sits between backed up files, elsewhere a hidden name next to dest, rename stays on one filesystem
+int staged_open(const char *dest_path, mode_t mode, char *tmp_path)
+{
+    char dir[PATH_MAX];
+    int n;
+    if (staging_dir_for(dest_path, dir) == 0)
+    {
+        n = snprintf(tmp_path, PATH_MAX, "%sXXXXXX", dir);
+    }
+    else
+    {
+        const char *slash = strrchr(dest_path, '/');
+        int dir_len = slash ? slash - dest_path + 1 : 0;
+        const char *name = slash ? slash + 1 : dest_path;
+        n = snprintf(tmp_path, PATH_MAX, "%.*s%s%.*sXXXXXX", dir_len, dest_path, STAGED_PREFIX,
+                     NAME_MAX - (int)sizeof(STAGED_PREFIX) - 6, name);
+    }
+    if (n < 0 || n >= PATH_MAX)
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    int fd = mkostemp(tmp_path, O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    if (fchmod(fd, mode & 0777) == -1)
+    {
+        staged_abort(fd, tmp_path);
+        return -1;
+    }
+    return fd;
+}
+
+// puttin finished temp file in place, readers see either old or new file never a half one
+int staged_commit(int fd, const char *tmp_path, const char *dest_path)
+{
+    durability_t level = config_current()->durability;
+    if (level == DURABILITY_FULL && fsync(fd) == -1)
+    {
+        staged_abort(fd, tmp_path);
+        return -1;
+    }
+    if (level == DURABILITY_BATCH)
+        mark_dirty(fd);
+    if (close(fd) == -1)
+    {
+        unlink(tmp_path);
+        return -1;
+    }
+    if (rename(tmp_path, dest_path) == -1)
+    {
+        int saved_errno = errno;
+        unlink(tmp_path);
+        errno = saved_errno;
+        return -1;
+    }
+    if (level == DURABILITY_FULL)
+        sync_parent(dest_path);
+    return 0;
+}
+
+// replacin dest with a hard link to an existin file, through a temp name like staged writes
+int staged_link(const char *existing, const char *dest_path)
+{
+    char tmp_path[PATH_MAX];
+    for (int tries = 0;; tries++)
+    {
+        // mkostemp only picks a free name, link needs it not to exist
+        int fd = staged_open(dest_path, 0600, tmp_path);
+        if (fd == -1)
+            return -1;
+        close(fd);
+        unlink(tmp_path);
+        if (link(existing, tmp_path) == 0)
+            break;
+        if (errno != EEXIST || tries == 8)
+            return -1;
+    }
+    if (rename(tmp_path, dest_path) == -1)
+    {
+        int saved_errno = errno;
+        unlink(tmp_path);
+        errno = saved_errno;
+        return -1;
+    }
+    durability_t level = config_current()->durability;
+    if (level == DURABILITY_FULL)
+        sync_parent(dest_path);
+    else if (level == DURABILITY_BATCH)
+        durable_written_path(dest_path);
+    return 0;
+}
+
+void staged_abort(int fd, const char *tmp_path)
+{
+    int saved_errno = errno;
+    if (fd != -1)
+        close(fd);
+    unlink(tmp_path);
+    errno = saved_errno;
+}
+
+// droppin temp files a killed process left in the staging dir of the current target,
+// called before anythin writes to the target so none of them belongs to a live write
+void staged_cleanup(void)
+{
+    char dir[PATH_MAX];
+    if (meta_path(dir, STAGING_KIND, "") == -1)
+        return;
+    DIR *d = opendir(dir);
+    if (!d)
+        return;
+    struct dirent *entry;
+    int removed = 0;
+    while ((entry = readdir(d)))
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        if (unlinkat(dirfd(d), entry->d_name, 0) == 0)
+            removed++;
+    }
+    closedir(d);
+    if (removed)
+        fprintf(stderr, "Removed %d leftover temp files of %s\n", removed, meta_get_root());
+}
+
+// notin a write done in place, full syncs it now, batch leaves it for next flush
+void durable_written(int fd)
+{
+    durability_t level = config_current()->durability;
+    if (level == DURABILITY_FULL)
+        fsync(fd);
+    else if (level == DURABILITY_BATCH)
+        mark_dirty(fd);
+}
+
+void durable_written_path(const char *path)
+{
+    if (config_current()->durability == DURABILITY_NONE)
+        return;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return;
+    durable_written(fd);
+    close(fd);
+}
+
+// one syncfs per dirty filesystem instead of fsync per file,
+// returns 1 when somethin was synced
+int durable_flush(void)
+{
+    pthread_mutex_lock(&dirty_lock);
+    int synced = flush_locked();
+    pthread_mutex_unlock(&dirty_lock);
+    return synced;
+}
+
+static int flush_locked(void)
+{
+    int synced = dirty_count > 0;
+    for (int i = 0; i < dirty_count; i++)
+    {
+        if (syncfs(dirty_fds[i]) == -1)
+            perror("syncfs");
+        close(dirty_fds[i]);
+    }
+    dirty_count = 0;
+    clock_gettime(CLOCK_MONOTONIC, &last_flush);
+    return synced;
+}
+
+// flushin when the batch interval passed
+void durable_tick(void)
+{
+    if (!dirty_count)
+        return;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if ((now.tv_sec - last_flush.tv_sec) * 1000 + (now.tv_nsec - last_flush.tv_nsec) / 1000000 >= DURABLE_SYNC_MS)
+        durable_flush();
+}
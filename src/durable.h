@@ -0,0 +1,22 @@
+// clang-format off
+#ifndef DURABLE_H
+#define DURABLE_H
+
+#include <sys/types.h>
+
+#define STAGED_PREFIX ".sop-tmp."
+#define STAGING_KIND "staging"
+#define DURABLE_SYNC_MS 1000
+#define DURABLE_MAX_FS 4
+
+int staged_open(const char *dest_path, mode_t mode, char *tmp_path);
+int staged_commit(int fd, const char *tmp_path, const char *dest_path);
+int staged_link(const char *existing, const char *dest_path);
+void staged_abort(int fd, const char *tmp_path);
+void staged_cleanup(void);
+void durable_written(int fd);
+void durable_written_path(const char *path);
+int durable_flush(void);
+void durable_tick(void);
+
+#endif
@@ -0,0 +1,121 @@
+// clang-format off
+#define _GNU_SOURCE
+#include "epoch.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include "attr.h"
+#include "strmap.h"
+
+// what a copy or watch saw of one source path, a later event for the same generation is stale
+typedef struct
+{
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    int64_t mtime_ns;
+    int64_t ctime_ns;
+    int is_dir;
+    int flags;
+} generation_t;
+
+// paths copied or watched in the current epoch, an epoch ends when the inotify queue is
+// empty, by then every event raised before those copies has been read
+static strmap_t copied;
+static int recording;
+
+static int64_t ctime_ns(const struct stat *st)
+{
+    return st->st_ctim.tv_sec * NSEC_PER_SEC + st->st_ctim.tv_nsec;
+}
+
+// files must look exactly as they did, a dir only has to be the same one
+// since its new entries get their own events
+static int same_generation(const generation_t *gen, const struct stat *st)
+{
+    if (gen->dev != st->st_dev || gen->ino != st->st_ino || gen->is_dir != S_ISDIR(st->st_mode))
+        return 0;
+    return gen->is_dir ||
+           (gen->size == st->st_size && gen->mtime_ns == attr_mtime_ns(st) && gen->ctime_ns == ctime_ns(st));
+}
+
+// only the worker records, the initial backup has no events to drop
+void epoch_begin(void)
+{
+    if (!recording && strmap_init(&copied) == 0)
+        recording = 1;
+}
+
+int64_t epoch_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+// a dir copy only counts when the dir was watched before it, otherwise
+// entries made in between have no event
+static void note(const char *source_path, const struct stat *st, int flag)
+{
+    if (!recording)
+        return;
+    generation_t *gen = strmap_get(&copied, source_path);
+    if (!gen)
+    {
+        if (copied.count >= EPOCH_MAX_ENTRIES)
+            return;
+        gen = calloc(1, sizeof(generation_t));
+        if (!gen)
+            return;
+        if (strmap_put(&copied, source_path, gen) == -1)
+        {
+            free(gen);
+            return;
+        }
+    }
+    else if (!same_generation(gen, st))
+    {
+        gen->flags = 0;
+    }
+    gen->dev = st->st_dev;
+    gen->ino = st->st_ino;
+    gen->size = st->st_size;
+    gen->mtime_ns = attr_mtime_ns(st);
+    gen->ctime_ns = ctime_ns(st);
+    gen->is_dir = S_ISDIR(st->st_mode);
+    if (flag == EPOCH_COPIED && gen->is_dir && !(gen->flags & EPOCH_WATCHED))
+        return;
+    gen->flags |= flag;
+}
+
+void epoch_watched(const char *source_path, const struct stat *st)
+{
+    note(source_path, st, EPOCH_WATCHED);
+}
+
+// called after a copy that started at started from the state st shows, a file changed
+// within the same timestamp tick could change again without its stat changin
+void epoch_copied(const char *source_path, const struct stat *st, int64_t started)
+{
+    if (!S_ISDIR(st->st_mode) && ctime_ns(st) >= started - EPOCH_RACY_NS)
+        return;
+    note(source_path, st, EPOCH_COPIED);
+}
+
+// 1 when path was already watched or copied in this epoch and has not changed since
+int epoch_seen(const char *source_path, const struct stat *st, int flag)
+{
+    if (!recording)
+        return 0;
+    const generation_t *gen = strmap_get(&copied, source_path);
+    return gen && (gen->flags & flag) && same_generation(gen, st);
+}
+
+void epoch_advance(void)
+{
+    if (!recording || copied.count == 0)
+        return;
+    strmap_free(&copied, free);
+    if (strmap_init(&copied) == -1)
+        recording = 0;
+}
@@ -0,0 +1,20 @@
+// clang-format off
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+#define EPOCH_MAX_ENTRIES (1024 * 1024)
+#define EPOCH_WATCHED 1
+#define EPOCH_COPIED 2
+#define EPOCH_RACY_NS (20 * 1000 * 1000LL)
+
+void epoch_begin(void);
+int64_t epoch_now(void);
+void epoch_watched(const char *source_path, const struct stat *st);
+void epoch_copied(const char *source_path, const struct stat *st, int64_t started);
+int epoch_seen(const char *source_path, const struct stat *st, int flag);
+void epoch_advance(void);
+
+#endif
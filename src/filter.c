@@ -0,0 +1,286 @@
+// clang-format off
+#define _GNU_SOURCE
+#include "filter.h"
+#include <fnmatch.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "meta.h"
+#include "strmap.h"
+
+// one --include or --exclude rule, split at '/' so ** can match whole components
+typedef struct
+{
+    char *pattern;
+    char **parts;
+    int part_count;
+    int anchored;
+    int dir_only;
+    int exclude;
+    int literal;
+    const char *suffix;
+    size_t suffix_len;
+} filter_rule_t;
+
+// rules of the backup this process works on, compiled once when it starts
+static filter_rule_t *rules;
+static int rule_count;
+// literal names match at any depth, literal paths only from the root,
+// both are one hash lookup, values are rule index + 1, dir only rules get
+// their own maps so a later name/ rule doesn't hide an earlier name rule
+static strmap_t names[2];
+static strmap_t paths[2];
+// rules with wildcards, in rule order
+static int *globs;
+static int glob_count;
+static char filter_root[PATH_MAX];
+static size_t root_len;
+static int meta_warned;
+
+static int has_wildcard(const char *s)
+{
+    return strpbrk(s, "*?[\\") != NULL;
+}
+
+void filter_clear(void)
+{
+    for (int i = 0; i < rule_count; i++)
+    {
+        free(rules[i].pattern);
+        free(rules[i].parts);
+    }
+    free(rules);
+    free(globs);
+    rules = NULL;
+    globs = NULL;
+    rule_count = 0;
+    glob_count = 0;
+    for (int i = 0; i < 2; i++)
+    {
+        strmap_free(&names[i], NULL);
+        strmap_free(&paths[i], NULL);
+    }
+    memset(names, 0, sizeof(names));
+    memset(paths, 0, sizeof(paths));
+}
+
+// turnin one gitignore style pattern into a rule, trailin slash means dirs only,
+// a slash anywhere else anchors it to the backup root
+static int compile_rule(filter_rule_t *rule, const char *text, int exclude)
+{
+    memset(rule, 0, sizeof(*rule));
+    rule->exclude = exclude;
+    rule->pattern = strdup(text);
+    if (!rule->pattern)
+        return -1;
+
+    char *p = rule->pattern;
+    size_t len = strlen(p);
+    while (len > 1 && p[len - 1] == '/')
+    {
+        p[--len] = '\0';
+        rule->dir_only = 1;
+    }
+    // **/name is the same as plain name
+    while (strncmp(p, "**/", 3) == 0 && !strchr(p + 3, '/'))
+        p += 3;
+    if (*p == '/')
+    {
+        rule->anchored = 1;
+        p++;
+    }
+    if (strchr(p, '/'))
+        rule->anchored = 1;
+    if (!*p)
+        return -1;
+    rule->literal = !has_wildcard(p);
+
+    rule->part_count = 1;
+    for (const char *c = p; *c; c++)
+        rule->part_count += *c == '/';
+    rule->parts = malloc(rule->part_count * sizeof(char *));
+    if (!rule->parts)
+        return -1;
+    int n = 0;
+    char *save = NULL;
+    for (char *part = strtok_r(p, "/", &save); part; part = strtok_r(NULL, "/", &save))
+        rule->parts[n++] = part;
+    rule->part_count = n;
+    if (n == 0)
+        return -1;
+
+    // *.o and friends are just a suffix compare
+    if (!rule->anchored && p[0] == '*' && !has_wildcard(p + 1))
+    {
+        rule->suffix = p + 1;
+        rule->suffix_len = strlen(p + 1);
+    }
+    return 0;
+}
+
+// readin rules as saved in config, one per line startin with - or +
+int filter_set(const char *text, const char *source_root)
+{
+    filter_clear();
+    meta_warned = 0;
+    snprintf(filter_root, PATH_MAX, "%s", source_root);
+    root_len = strlen(filter_root);
+    while (root_len > 1 && filter_root[root_len - 1] == '/')
+        filter_root[--root_len] = '\0';
+
+    int lines = 0;
+    for (const char *c = text; *c; c++)
+        lines += *c == '\n';
+    if (lines == 0)
+        return 0;
+    rules = calloc(lines, sizeof(filter_rule_t));
+    globs = calloc(lines, sizeof(int));
+    if (!rules || !globs)
+    {
+        filter_clear();
+        return -1;
+    }
+
+    const char *line = text;
+    while (*line)
+    {
+        const char *end = strchr(line, '\n');
+        if (!end)
+            break;
+        char pattern[PATH_MAX];
+        int len = end - line - 1;
+        if ((line[0] == '-' || line[0] == '+') && len > 0 && len < PATH_MAX)
+        {
+            memcpy(pattern, line + 1, len);
+            pattern[len] = '\0';
+            filter_rule_t *rule = &rules[rule_count];
+            if (compile_rule(rule, pattern, line[0] == '-') == -1)
+            {
+                free(rule->pattern);
+                free(rule->parts);
+                fprintf(stderr, "Warning: ignoring filter rule '%s'\n", pattern);
+            }
+            else
+            {
+                // literal rules go to the hash maps, the rest is matched one by one
+                int ret = 0;
+                if (rule->literal && !rule->anchored)
+                    ret = strmap_put(&names[rule->dir_only], rule->parts[0], (void *)(uintptr_t)(rule_count + 1));
+                else if (rule->literal)
+                {
+                    char key[PATH_MAX] = "";
+                    size_t key_len = 0;
+                    for (int i = 0; i < rule->part_count; i++)
+                        key_len += snprintf(key + key_len, PATH_MAX - key_len, "%s%s", i ? "/" : "", rule->parts[i]);
+                    ret = strmap_put(&paths[rule->dir_only], key, (void *)(uintptr_t)(rule_count + 1));
+                }
+                else
+                    globs[glob_count++] = rule_count;
+                if (ret == -1)
+                {
+                    filter_clear();
+                    return -1;
+                }
+                rule_count++;
+            }
+        }
+        line = end + 1;
+    }
+    return 0;
+}
+
+// matchin pattern parts against path components, ** takes zero or more of them
+static int match_parts(char **parts, int part_count, char **comps, int comp_count)
+{
+    if (part_count == 0)
+        return comp_count == 0;
+    if (strcmp(parts[0], "**") == 0)
+    {
+        for (int skip = 0; skip <= comp_count; skip++)
+        {
+            if (match_parts(parts + 1, part_count - 1, comps + skip, comp_count - skip))
+                return 1;
+        }
+        return 0;
+    }
+    if (comp_count == 0 || fnmatch(parts[0], comps[0], 0) != 0)
+        return 0;
+    return match_parts(parts + 1, part_count - 1, comps + 1, comp_count - 1);
+}
+
+static int rule_matches(const filter_rule_t *rule, const char *base, char **comps, int comp_count)
+{
+    if (!rule->anchored)
+    {
+        size_t base_len = strlen(base);
+        if (rule->suffix)
+            return base_len >= rule->suffix_len && memcmp(base + base_len - rule->suffix_len, rule->suffix, rule->suffix_len) == 0;
+        return fnmatch(rule->parts[0], base, 0) == 0;
+    }
+    return match_parts(rule->parts, rule->part_count, comps, comp_count);
+}
+
+// index of the last rule matchin rel, later rules win like in gitignore
+static int last_match(const char *rel, int is_dir)
+{
+    const char *base = strrchr(rel, '/');
+    base = base ? base + 1 : rel;
+
+    int best = -1;
+    for (int dir_only = 0; dir_only <= (is_dir != 0); dir_only++)
+    {
+        int idx = (int)(uintptr_t)strmap_get(&names[dir_only], base) - 1;
+        if (idx > best)
+            best = idx;
+        idx = (int)(uintptr_t)strmap_get(&paths[dir_only], rel) - 1;
+        if (idx > best)
+            best = idx;
+    }
+
+    if (glob_count == 0 || globs[glob_count - 1] < best)
+        return best;
+
+    char copy[PATH_MAX];
+    char *comps[FILTER_MAX_DEPTH];
+    int comp_count = 0;
+    snprintf(copy, PATH_MAX, "%s", rel);
+    char *save = NULL;
+    for (char *c = strtok_r(copy, "/", &save); c && comp_count < FILTER_MAX_DEPTH; c = strtok_r(NULL, "/", &save))
+        comps[comp_count++] = c;
+
+    for (int i = glob_count - 1; i >= 0 && globs[i] > best; i--)
+    {
+        const filter_rule_t *rule = &rules[globs[i]];
+        if ((is_dir || !rule->dir_only) && rule_matches(rule, base, comps, comp_count))
+            return globs[i];
+    }
+    return best;
+}
+
+// checcs if entry under the source root is left out of the backup, callers
+// walk top down and never go into an excluded dir, so parents are not checked
+int filter_excluded(const char *source_path, int is_dir)
+{
+    if (!root_len || strncmp(source_path, filter_root, root_len) != 0 ||
+        (source_path[root_len] != '/' && root_len > 1))
+        return 0;
+    const char *rel = source_path + root_len;
+    while (*rel == '/')
+        rel++;
+    if (!*rel)
+        return 0;
+    // the target keeps its metadata under this name, copyin it would land on top of that
+    if (is_meta_name(rel))
+    {
+        if (!meta_warned)
+            fprintf(stderr, "Skipping %s, backups keep their metadata under that name\n", source_path);
+        meta_warned = 1;
+        return 1;
+    }
+    if (rule_count == 0)
+        return 0;
+    int idx = last_match(rel, is_dir);
+    return idx >= 0 && rules[idx].exclude;
+}
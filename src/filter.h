@@ -0,0 +1,11 @@
+// clang-format off
+#ifndef FILTER_H
+#define FILTER_H
+
+#define FILTER_MAX_DEPTH 256
+
+int filter_set(const char *rules, const char *source_root);
+void filter_clear(void);
+int filter_excluded(const char *source_path, int is_dir);
+
+#endif
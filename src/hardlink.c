@@ -0,0 +1,155 @@
+// clang-format off
+#define _GNU_SOURCE
+#include "hardlink.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "attr.h"
+#include "config.h"
+#include "durable.h"
+#include "pack.h"
+#include "strmap.h"
+
+// target paths holdin copies of one source inode
+typedef struct
+{
+    char **paths;
+    int count;
+    int cap;
+} link_group_t;
+
+// source (dev, ino) -> group, for the backup this process works on
+static strmap_t groups;
+
+void hardlink_key(char *key, dev_t dev, ino_t ino)
+{
+    snprintf(key, HARDLINK_KEY_LEN, "%lx:%lx", (unsigned long)dev, (unsigned long)ino);
+}
+
+static void free_group(void *value)
+{
+    link_group_t *group = value;
+    for (int i = 0; i < group->count; i++)
+        free(group->paths[i]);
+    free(group->paths);
+    free(group);
+}
+
+void hardlink_reset(void)
+{
+    strmap_free(&groups, free_group);
+    memset(&groups, 0, sizeof(groups));
+}
+
+// only regular files with more than one name, small files of packed targets are not files there
+static int linkable(const struct stat *st)
+{
+    if (!S_ISREG(st->st_mode) || st->st_nlink < 2)
+        return 0;
+    return config_current()->format != FORMAT_PACKED || st->st_size >= PACK_MAX_FILE;
+}
+
+static link_group_t *find_group(const struct stat *st)
+{
+    char key[HARDLINK_KEY_LEN];
+    hardlink_key(key, st->st_dev, st->st_ino);
+    return strmap_get(&groups, key);
+}
+
+static int group_has(const link_group_t *group, const char *path)
+{
+    for (int i = 0; i < group->count; i++)
+    {
+        if (strcmp(group->paths[i], path) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+// target copy still holds this source version, a path reused by another file must not be linked to
+static int holds_version(const struct stat *target, const struct stat *source)
+{
+    if (!attr_same_mtime(target, source))
+        return 0;
+    return config_current()->format != FORMAT_PLAIN || target->st_size == source->st_size;
+}
+
+// linkin dest to an earlier copy of the same source inode, -1 when it has to be copied
+int hardlink_link(const struct stat *source_stat, const char *dest_path)
+{
+    if (!linkable(source_stat))
+        return -1;
+    link_group_t *group = find_group(source_stat);
+    if (!group)
+        return -1;
+
+    struct stat dest_st;
+    int have_dest = lstat(dest_path, &dest_st) == 0;
+    for (int i = 0; i < group->count; i++)
+    {
+        struct stat st;
+        if (strcmp(group->paths[i], dest_path) == 0 || lstat(group->paths[i], &st) == -1 || !S_ISREG(st.st_mode) ||
+            !holds_version(&st, source_stat))
+            continue;
+        // already one file with it, like on a later add over the same target
+        if (have_dest && dest_st.st_dev == st.st_dev && dest_st.st_ino == st.st_ino)
+            return 0;
+        if (staged_link(group->paths[i], dest_path) == -1)
+            return -1;
+        hardlink_remember(source_stat, dest_path);
+        return 0;
+    }
+    return -1;
+}
+
+void hardlink_remember(const struct stat *source_stat, const char *dest_path)
+{
+    if (!linkable(source_stat))
+        return;
+    link_group_t *group = find_group(source_stat);
+    if (!group)
+    {
+        group = calloc(1, sizeof(link_group_t));
+        char key[HARDLINK_KEY_LEN];
+        hardlink_key(key, source_stat->st_dev, source_stat->st_ino);
+        if (!group || strmap_put(&groups, key, group) == -1)
+        {
+            free(group);
+            return;
+        }
+    }
+    if (group_has(group, dest_path))
+        return;
+    if (group->count == group->cap)
+    {
+        int cap = group->cap ? group->cap * 2 : 4;
+        char **paths = realloc(group->paths, cap * sizeof(char *));
+        if (!paths)
+            return;
+        group->paths = paths;
+        group->cap = cap;
+    }
+    char *copy = strdup(dest_path);
+    if (copy)
+        group->paths[group->count++] = copy;
+}
+
+// dest got a new copy through a temp file, other names still on the old copy follow it
+void hardlink_refresh(const struct stat *source_stat, const char *dest_path, const struct stat *old_dest)
+{
+    if (!linkable(source_stat))
+        return;
+    hardlink_remember(source_stat, dest_path);
+    struct stat now;
+    if (lstat(dest_path, &now) == -1 || (now.st_dev == old_dest->st_dev && now.st_ino == old_dest->st_ino))
+        return;
+
+    link_group_t *group = find_group(source_stat);
+    for (int i = 0; group && i < group->count; i++)
+    {
+        struct stat st;
+        if (strcmp(group->paths[i], dest_path) != 0 && lstat(group->paths[i], &st) == 0 &&
+            st.st_dev == old_dest->st_dev && st.st_ino == old_dest->st_ino)
+            staged_link(dest_path, group->paths[i]);
+    }
+}
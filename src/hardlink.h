@@ -0,0 +1,15 @@
+// clang-format off
+#ifndef HARDLINK_H
+#define HARDLINK_H
+
+#include <sys/stat.h>
+
+#define HARDLINK_KEY_LEN 64
+
+void hardlink_key(char *key, dev_t dev, ino_t ino);
+void hardlink_reset(void);
+int hardlink_link(const struct stat *source_stat, const char *dest_path);
+void hardlink_remember(const struct stat *source_stat, const char *dest_path);
+void hardlink_refresh(const struct stat *source_stat, const char *dest_path, const struct stat *old_dest);
+
+#endif
@@ -0,0 +1,146 @@
+// clang-format off
+#include "hash.h"
+#include <string.h>
+
+// xxHash64, four independent lanes so the cpu can run them in paralel
+#define P1 11400714785074694791ULL
+#define P2 14029467366897019727ULL
+#define P3 1609587929392839161ULL
+#define P4 9650029242287828579ULL
+#define P5 2870177450012600261ULL
+
+static inline uint64_t rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const unsigned char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t input)
+{
+    acc += input * P2;
+    acc = rotl(acc, 31);
+    return acc * P1;
+}
+
+static inline uint64_t merge64(uint64_t acc, uint64_t val)
+{
+    acc ^= round64(0, val);
+    return acc * P1 + P4;
+}
+
+void hash_init(hash_state_t *st, uint64_t seed)
+{
+    memset(st, 0, sizeof(*st));
+    st->seed = seed;
+    st->v[0] = seed + P1 + P2;
+    st->v[1] = seed + P2;
+    st->v[2] = seed;
+    st->v[3] = seed - P1;
+}
+
+void hash_update(hash_state_t *st, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    const unsigned char *end = p + len;
+    st->total_len += len;
+
+    // fillin the leftover stripe from last call first
+    if (st->mem_len + len < 32)
+    {
+        memcpy(st->mem + st->mem_len, p, len);
+        st->mem_len += len;
+        return;
+    }
+    if (st->mem_len)
+    {
+        size_t fill = 32 - st->mem_len;
+        memcpy(st->mem + st->mem_len, p, fill);
+        for (int i = 0; i < 4; i++)
+            st->v[i] = round64(st->v[i], read64(st->mem + i * 8));
+        p += fill;
+        st->mem_len = 0;
+    }
+
+    uint64_t v0 = st->v[0], v1 = st->v[1], v2 = st->v[2], v3 = st->v[3];
+    while (p + 32 <= end)
+    {
+        v0 = round64(v0, read64(p));
+        v1 = round64(v1, read64(p + 8));
+        v2 = round64(v2, read64(p + 16));
+        v3 = round64(v3, read64(p + 24));
+        p += 32;
+    }
+    st->v[0] = v0;
+    st->v[1] = v1;
+    st->v[2] = v2;
+    st->v[3] = v3;
+
+    st->mem_len = end - p;
+    memcpy(st->mem, p, st->mem_len);
+}
+
+uint64_t hash_digest(const hash_state_t *st)
+{
+    uint64_t h;
+    if (st->total_len >= 32)
+    {
+        h = rotl(st->v[0], 1) + rotl(st->v[1], 7) + rotl(st->v[2], 12) + rotl(st->v[3], 18);
+        for (int i = 0; i < 4; i++)
+            h = merge64(h, st->v[i]);
+    }
+    else
+    {
+        h = st->seed + P5;
+    }
+    h += st->total_len;
+
+    const unsigned char *p = st->mem;
+    const unsigned char *end = p + st->mem_len;
+    while (p + 8 <= end)
+    {
+        h ^= round64(0, read64(p));
+        h = rotl(h, 27) * P1 + P4;
+        p += 8;
+    }
+    if (p + 4 <= end)
+    {
+        h ^= (uint64_t)read32(p) * P1;
+        h = rotl(h, 23) * P2 + P3;
+        p += 4;
+    }
+    while (p < end)
+    {
+        h ^= (*p) * P5;
+        h = rotl(h, 11) * P1;
+        p++;
+    }
+
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return h;
+}
+
+// one shot version for whole buffers
+uint64_t hash64(const void *data, size_t len, uint64_t seed)
+{
+    hash_state_t st;
+    hash_init(&st, seed);
+    hash_update(&st, data, len);
+    return hash_digest(&st);
+}
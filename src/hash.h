@@ -0,0 +1,22 @@
+// clang-format off
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct
+{
+    uint64_t v[4];
+    uint64_t seed;
+    uint64_t total_len;
+    unsigned char mem[32];
+    size_t mem_len;
+} hash_state_t;
+
+void hash_init(hash_state_t *st, uint64_t seed);
+void hash_update(hash_state_t *st, const void *data, size_t len);
+uint64_t hash_digest(const hash_state_t *st);
+uint64_t hash64(const void *data, size_t len, uint64_t seed);
+
+#endif
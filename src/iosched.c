@@ -0,0 +1,295 @@
+// clang-format off
+#define _GNU_SOURCE
+#include "iosched.h"
+#include <errno.h>
+#include <linux/ioprio.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include "signals.h"
+
+#define NS_PER_MS 1000000LL
+#define NS_PER_SEC 1000000000LL
+
+// one backup as the scheduler sees it, lives in memory shared by the manager and all workers
+typedef struct
+{
+    int used;
+    io_class_t io_class;
+    int weight;
+    int ioprio;
+    int64_t rate;
+    int64_t iops;
+    // token buckets, ops are kept in thousandths so slow iops caps refill smoothly
+    int64_t tokens;
+    int64_t op_tokens;
+    int64_t refill_ns;
+    // bytes written scaled by weight, the backup furthest behind goes next
+    uint64_t vtime;
+    int64_t last_ns;
+    // waitin on its own cap or on a higher class, peers dont wait for it then
+    int64_t held_until_ns;
+} io_slot_t;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    io_slot_t slots[IOSCHED_MAX_SLOTS];
+} io_shared_t;
+
+static io_shared_t *shared;
+// slot of the backup this process writes for, -1 writes unscheduled
+static int my_slot = -1;
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+// mappin the shared table before any worker is forked, so all of them inherit it
+int iosched_init(void)
+{
+    io_shared_t *map = mmap(NULL, sizeof(io_shared_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED)
+        return -1;
+    memset(map, 0, sizeof(*map));
+
+    // robust so a worker killed while holdin the lock does not hang the others
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    int ret = pthread_mutex_init(&map->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (ret != 0)
+    {
+        munmap(map, sizeof(io_shared_t));
+        errno = ret;
+        return -1;
+    }
+    shared = map;
+    return 0;
+}
+
+static void lock_shared(void)
+{
+    if (pthread_mutex_lock(&shared->lock) == EOWNERDEAD)
+        pthread_mutex_consistent(&shared->lock);
+}
+
+// smallest vtime among backups of this class that have work right now
+static int min_busy_vtime(const io_slot_t *self, int64_t now, uint64_t *vtime)
+{
+    int found = 0;
+    for (int i = 0; i < IOSCHED_MAX_SLOTS; i++)
+    {
+        const io_slot_t *s = &shared->slots[i];
+        if (s == self || !s->used || s->io_class != self->io_class || now - s->last_ns > IOSCHED_BUSY_MS * NS_PER_MS ||
+            s->held_until_ns > now)
+            continue;
+        if (!found || s->vtime < *vtime)
+            *vtime = s->vtime;
+        found = 1;
+    }
+    return found;
+}
+
+static int higher_class_active(const io_slot_t *self, int64_t now)
+{
+    for (int i = 0; i < IOSCHED_MAX_SLOTS; i++)
+    {
+        const io_slot_t *s = &shared->slots[i];
+        if (s->used && s->io_class < self->io_class && now - s->last_ns <= IOSCHED_ACTIVE_MS * NS_PER_MS &&
+            s->held_until_ns <= now)
+            return 1;
+    }
+    return 0;
+}
+
+static void refill(io_slot_t *s, int64_t now)
+{
+    // buckets hold at most one second, so longer gaps count as one second
+    int64_t dt = now - s->refill_ns;
+    if (dt > NS_PER_SEC)
+        dt = NS_PER_SEC;
+    s->refill_ns = now;
+    if (s->rate)
+    {
+        s->tokens += s->rate * (dt / 1000) / 1000000;
+        if (s->tokens > s->rate)
+            s->tokens = s->rate;
+    }
+    if (s->iops)
+    {
+        s->op_tokens += s->iops * dt / NS_PER_MS;
+        if (s->op_tokens > s->iops * 1000)
+            s->op_tokens = s->iops * 1000;
+    }
+}
+
+static void set_params(io_slot_t *s, const backup_config_t *cfg)
+{
+    s->io_class = cfg->io_class;
+    s->weight = cfg->io_weight > 0 ? cfg->io_weight : IOSCHED_DEFAULT_WEIGHT;
+    s->ioprio = cfg->ioprio > 0;
+    s->rate = (int64_t)cfg->io_rate * 1024 * 1024;
+    s->iops = cfg->io_iops;
+    if (s->tokens > s->rate)
+        s->tokens = s->rate;
+    if (s->op_tokens > s->iops * 1000)
+        s->op_tokens = s->iops * 1000;
+}
+
+// takin a free slot for a new backup, -1 when the table is full or not there
+int iosched_register(const backup_config_t *cfg)
+{
+    if (!shared)
+        return -1;
+    lock_shared();
+    int slot = -1;
+    for (int i = 0; i < IOSCHED_MAX_SLOTS && slot == -1; i++)
+    {
+        if (!shared->slots[i].used)
+            slot = i;
+    }
+    if (slot != -1)
+    {
+        io_slot_t *s = &shared->slots[slot];
+        memset(s, 0, sizeof(*s));
+        s->used = 1;
+        s->tokens = INT64_MAX;
+        s->op_tokens = INT64_MAX;
+        set_params(s, cfg);
+        s->refill_ns = now_ns();
+    }
+    pthread_mutex_unlock(&shared->lock);
+    return slot;
+}
+
+void iosched_release(int slot)
+{
+    if (!shared || slot < 0 || slot >= IOSCHED_MAX_SLOTS)
+        return;
+    lock_shared();
+    shared->slots[slot].used = 0;
+    pthread_mutex_unlock(&shared->lock);
+}
+
+// kernel side priority for the block layer, high wants realtime which needs root so best effort 0 is the fallback
+static void apply_ioprio(const io_slot_t *s)
+{
+    int value = IOPRIO_PRIO_VALUE(IOPRIO_CLASS_NONE, 0);
+    if (s && s->ioprio)
+    {
+        if (s->io_class == IO_CLASS_HIGH)
+            value = IOPRIO_PRIO_VALUE(IOPRIO_CLASS_RT, 4);
+        else if (s->io_class == IO_CLASS_IDLE)
+            value = IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0);
+        else
+            value = IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, 4);
+    }
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, value) == -1 && s && s->io_class == IO_CLASS_HIGH)
+        syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, 0));
+}
+
+// from now on writes of this process are charged to slot, -1 stops that
+void iosched_attach(int slot)
+{
+    if (!shared || slot >= IOSCHED_MAX_SLOTS)
+        slot = -1;
+    int had_ioprio = my_slot != -1 && shared->slots[my_slot].ioprio;
+    my_slot = slot;
+    if (slot != -1 && shared->slots[slot].ioprio)
+        apply_ioprio(&shared->slots[slot]);
+    else if (had_ioprio)
+        apply_ioprio(NULL);
+}
+
+// options of the attached backup changed, like when the saved config of its target was merged in
+void iosched_configure(const backup_config_t *cfg)
+{
+    if (!shared || my_slot == -1)
+        return;
+    lock_shared();
+    set_params(&shared->slots[my_slot], cfg);
+    pthread_mutex_unlock(&shared->lock);
+    apply_ioprio(&shared->slots[my_slot]);
+}
+
+// called before writin bytes for the current backup, blocks while a higher class is busy,
+// while this backup is ahead of its peers or while its own caps are used up
+void iosched_charge(size_t bytes)
+{
+    if (!shared || my_slot == -1)
+        return;
+
+    io_slot_t *s = &shared->slots[my_slot];
+    int64_t started = now_ns();
+    for (;;)
+    {
+        lock_shared();
+        int64_t now = now_ns();
+        refill(s, now);
+
+        // comin back after a pause does not bank credit over the ones that kept writin
+        uint64_t lowest = 0;
+        int has_peers = min_busy_vtime(s, now, &lowest);
+        if (now - s->last_ns > IOSCHED_BUSY_MS * NS_PER_MS && has_peers && s->vtime < lowest)
+            s->vtime = lowest;
+
+        // normal class only yields for a while so it is never starved, idle yields for good
+        int yield = higher_class_active(s, now) &&
+                    (s->io_class == IO_CLASS_IDLE || now - started < IOSCHED_NORMAL_MAX_WAIT_MS * NS_PER_MS);
+        if (yield)
+        {
+            s->held_until_ns = now + IOSCHED_POLL_US * 1000LL;
+        }
+        else if (has_peers && s->vtime > lowest + IOSCHED_QUANTUM)
+        {
+            s->last_ns = now;
+            yield = 1;
+        }
+        if (yield && !should_exit)
+        {
+            pthread_mutex_unlock(&shared->lock);
+            usleep(IOSCHED_POLL_US);
+            continue;
+        }
+
+        s->vtime += bytes * IOSCHED_DEFAULT_WEIGHT / s->weight;
+        s->last_ns = now;
+        s->held_until_ns = 0;
+        // caps are paid after the fact, a big write just waits longer before the next one
+        int64_t wait_ns = 0;
+        if (s->rate)
+        {
+            s->tokens -= bytes;
+            if (s->tokens < 0)
+                wait_ns = -s->tokens * NS_PER_SEC / s->rate;
+        }
+        if (s->iops)
+        {
+            s->op_tokens -= 1000;
+            if (s->op_tokens < 0 && -s->op_tokens * NS_PER_MS / s->iops > wait_ns)
+                wait_ns = -s->op_tokens * NS_PER_MS / s->iops;
+        }
+        if (wait_ns > 0)
+            s->held_until_ns = now + wait_ns;
+        pthread_mutex_unlock(&shared->lock);
+
+        if (wait_ns > 0 && !should_exit)
+        {
+            struct timespec ts = {wait_ns / NS_PER_SEC, wait_ns % NS_PER_SEC};
+            while (nanosleep(&ts, &ts) == -1 && errno == EINTR && !should_exit)
+                ;
+        }
+        return;
+    }
+}
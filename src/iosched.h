@@ -0,0 +1,25 @@
+// clang-format off
+#ifndef IOSCHED_H
+#define IOSCHED_H
+
+#include <stddef.h>
+#include "config.h"
+
+#define IOSCHED_MAX_SLOTS 64
+#define IOSCHED_DEFAULT_WEIGHT 100
+#define IOSCHED_MAX_WEIGHT 1000
+#define IOSCHED_ACTIVE_MS 200
+#define IOSCHED_BUSY_MS 20
+#define IOSCHED_QUANTUM (4 * 1024 * 1024)
+#define IOSCHED_POLL_US 2000
+#define IOSCHED_NORMAL_MAX_WAIT_MS 50
+#define IOSCHED_CHARGE_LEN (1024 * 1024)
+
+int iosched_init(void);
+int iosched_register(const backup_config_t *cfg);
+void iosched_attach(int slot);
+void iosched_release(int slot);
+void iosched_configure(const backup_config_t *cfg);
+void iosched_charge(size_t bytes);
+
+#endif
@@ -0,0 +1,345 @@
+// clang-format off
+#define _GNU_SOURCE
+#include "journal.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "durable.h"
+#include "hash.h"
+#include "meta.h"
+#include "strmap.h"
+
+#define JOURNAL_MAGIC 0x314e524a
+#define CHECKPOINT_MAGIC 0x31544b434e524aULL
+
+// one event, followed by path relative to the backup root,
+// check covers header and path so a torn tail after crash is recognised
+typedef struct
+{
+    uint32_t magic;
+    uint32_t op;
+    uint64_t seq;
+    int64_t time;
+    uint32_t path_len;
+    uint32_t check;
+} journal_record_t;
+
+typedef struct
+{
+    uint64_t magic;
+    uint64_t applied_seq;
+} checkpoint_t;
+
+typedef int (*record_fn)(const journal_record_t *rec, const char *path, void *arg);
+
+// journal of the worker this process runs
+static int journal_fd = -1;
+static char log_path[PATH_MAX];
+static char old_path[PATH_MAX];
+static char checkpoint_path[PATH_MAX];
+static uint64_t next_seq = 1;
+static uint64_t applied_seq;
+static uint64_t checkpoint_seq;
+static uint64_t replay_from;
+static uint64_t start_seq;
+static time_t started;
+static int pending;
+static struct timespec last_sync;
+
+static uint32_t record_check(const journal_record_t *rec, const char *path)
+{
+    return (uint32_t)hash64(path, rec->path_len, rec->seq ^ ((uint64_t)rec->op << 32) ^ (uint64_t)rec->time);
+}
+
+// readin records of one journal file in order, returns where the last whole record ends
+static off_t scan_file(const char *path, record_fn fn, void *arg)
+{
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return errno == ENOENT ? 0 : -1;
+
+    off_t good = 0;
+    journal_record_t rec;
+    char rel[PATH_MAX];
+    while (fread(&rec, sizeof(rec), 1, f) == 1)
+    {
+        if (rec.magic != JOURNAL_MAGIC || rec.path_len >= PATH_MAX || fread(rel, 1, rec.path_len, f) != rec.path_len)
+            break;
+        rel[rec.path_len] = '\0';
+        if (rec.check != record_check(&rec, rel))
+            break;
+        good += sizeof(rec) + rec.path_len;
+        if (fn && fn(&rec, rel, arg) == -1)
+            break;
+    }
+    fclose(f);
+    return good;
+}
+
+static int find_last_seq(const journal_record_t *rec, const char *path, void *arg)
+{
+    uint64_t *last = arg;
+    if (rec->seq > *last)
+        *last = rec->seq;
+    return 0;
+}
+
+static long elapsed_ms(const struct timespec *since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+// openin journal of current meta root, cuttin off torn tail from a crash
+int journal_open(void)
+{
+    journal_close();
+    if (meta_path(log_path, "journal", "log") == -1 || meta_path(old_path, "journal", "log.old") == -1 ||
+        meta_path(checkpoint_path, "journal", "checkpoint") == -1)
+        return -1;
+
+    applied_seq = 0;
+    FILE *f = fopen(checkpoint_path, "r");
+    if (f)
+    {
+        checkpoint_t cp;
+        if (fread(&cp, sizeof(cp), 1, f) == 1 && cp.magic == CHECKPOINT_MAGIC)
+            applied_seq = cp.applied_seq;
+        fclose(f);
+    }
+
+    uint64_t last = applied_seq;
+    if (scan_file(old_path, find_last_seq, &last) == -1)
+        return -1;
+    off_t good = scan_file(log_path, find_last_seq, &last);
+    if (good == -1)
+        return -1;
+
+    journal_fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (journal_fd == -1)
+        return -1;
+    if (ftruncate(journal_fd, good) == -1)
+    {
+        journal_close();
+        return -1;
+    }
+
+    next_seq = last + 1;
+    checkpoint_seq = applied_seq;
+    replay_from = applied_seq;
+    started = time(NULL);
+    pending = 0;
+    clock_gettime(CLOCK_MONOTONIC, &last_sync);
+
+    // start marker, changes made while no worker was runnin are not in the journal
+    start_seq = next_seq;
+    if (journal_append(JOURNAL_START, "") == -1)
+    {
+        journal_close();
+        return -1;
+    }
+    journal_applied();
+    return 0;
+}
+
+void journal_close(void)
+{
+    if (journal_fd == -1)
+        return;
+    journal_sync();
+    close(journal_fd);
+    journal_fd = -1;
+}
+
+// appendin record before the change is applied, one write so records never interleave
+int journal_append(journal_op_t op, const char *rel_path)
+{
+    if (journal_fd == -1)
+        return 0;
+
+    journal_record_t rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.magic = JOURNAL_MAGIC;
+    rec.op = op;
+    rec.seq = next_seq;
+    rec.time = time(NULL);
+    rec.path_len = strnlen(rel_path, PATH_MAX - 1);
+    rec.check = record_check(&rec, rel_path);
+
+    char buf[sizeof(rec) + PATH_MAX];
+    memcpy(buf, &rec, sizeof(rec));
+    memcpy(buf + sizeof(rec), rel_path, rec.path_len);
+    size_t len = sizeof(rec) + rec.path_len;
+    if (TEMP_FAILURE_RETRY(write(journal_fd, buf, len)) != (ssize_t)len)
+    {
+        perror("Failed to write journal");
+        return -1;
+    }
+    next_seq++;
+    pending++;
+    return 0;
+}
+
+// markin everything appended so far as applied, syncin once per batch
+void journal_applied(void)
+{
+    if (journal_fd == -1)
+        return;
+    applied_seq = next_seq - 1;
+    if (pending >= JOURNAL_SYNC_RECORDS || elapsed_ms(&last_sync) >= JOURNAL_SYNC_MS)
+        journal_sync();
+}
+
+// startin new journal file once the current one is big, previous one stays for changed_since
+static void rotate(void)
+{
+    struct stat st;
+    if (fstat(journal_fd, &st) == -1 || st.st_size < JOURNAL_MAX_SIZE || applied_seq != next_seq - 1)
+        return;
+    if (rename(log_path, old_path) == -1)
+        return;
+    close(journal_fd);
+    journal_fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (journal_fd == -1)
+        perror("Failed to reopen journal");
+}
+
+// flushin journal to disk and then movin the checkpoint, the checkpoint itself
+// needs no fsync since replayin already applied records again is harmless
+void journal_sync(void)
+{
+    if (journal_fd == -1 || (pending == 0 && applied_seq == checkpoint_seq))
+        return;
+    // journal and the target files it covers go to disk before the checkpoint moves,
+    // with batch durability that is one syncfs for all of them
+    if (pending)
+        durable_written(journal_fd);
+    durable_flush();
+    pending = 0;
+    clock_gettime(CLOCK_MONOTONIC, &last_sync);
+
+    if (applied_seq != checkpoint_seq)
+    {
+        char tmp_path[PATH_MAX];
+        if (snprintf(tmp_path, PATH_MAX, "%s.tmp", checkpoint_path) >= PATH_MAX)
+            return;
+        checkpoint_t cp = {CHECKPOINT_MAGIC, applied_seq};
+        int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd == -1)
+            return;
+        int ok = write(fd, &cp, sizeof(cp)) == (ssize_t)sizeof(cp);
+        close(fd);
+        if (ok && rename(tmp_path, checkpoint_path) == 0)
+            checkpoint_seq = applied_seq;
+    }
+    rotate();
+}
+
+typedef struct
+{
+    strmap_t paths;
+    uint64_t after;
+    time_t since;
+    int saw_start;
+} collect_t;
+
+// keepin only last op per path, replayin the same path twice is wasted work
+static int collect_record(const journal_record_t *rec, const char *path, void *arg)
+{
+    collect_t *c = arg;
+    if (rec->seq == start_seq)
+        c->saw_start = 1;
+    if (rec->op == JOURNAL_START || rec->seq <= c->after || rec->time < c->since)
+        return 0;
+    if (strmap_put(&c->paths, path, (void *)(uintptr_t)(rec->op + 1)) == -1)
+        return -1;
+    return 0;
+}
+
+typedef struct
+{
+    const char **keys;
+    size_t count;
+} flat_t;
+
+static void flatten(const char *key, void *value, void *arg)
+{
+    flat_t *flat = arg;
+    flat->keys[flat->count++] = key;
+}
+
+static int compare_paths(const void *a, const void *b)
+{
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+// visitin collected paths sorted, so parent dirs come before what is inside them
+static int visit_collected(collect_t *c, journal_visit_fn fn, void *arg)
+{
+    flat_t flat = {0};
+    flat.keys = malloc((c->paths.count + 1) * sizeof(char *));
+    if (!flat.keys)
+        return -1;
+    strmap_foreach(&c->paths, flatten, &flat);
+    qsort(flat.keys, flat.count, sizeof(char *), compare_paths);
+    for (size_t i = 0; i < flat.count; i++)
+        fn((journal_op_t)((uintptr_t)strmap_get(&c->paths, flat.keys[i]) - 1), flat.keys[i], arg);
+
+    int count = flat.count;
+    free(flat.keys);
+    return count;
+}
+
+static int collect(collect_t *c)
+{
+    if (scan_file(old_path, collect_record, c) == -1 || scan_file(log_path, collect_record, c) == -1)
+        return -1;
+    return 0;
+}
+
+// replayin records a previous worker wrote but did not get to apply
+int journal_replay(journal_visit_fn fn, void *arg)
+{
+    if (journal_fd == -1)
+        return 0;
+
+    collect_t c = {.after = replay_from};
+    if (strmap_init(&c.paths) == -1)
+        return -1;
+    int ret = collect(&c);
+    if (ret == 0)
+        ret = visit_collected(&c, fn, arg);
+    strmap_free(&c.paths, NULL);
+    if (ret == -1)
+        return -1;
+
+    replay_from = next_seq - 1;
+    journal_applied();
+    journal_sync();
+    return ret;
+}
+
+// listin paths changed at or after given time, -1 when the journal does not
+// cover all of that time (worker started later or records already rotated away)
+int journal_changed_since(time_t since, journal_visit_fn fn, void *arg)
+{
+    if (journal_fd == -1 || since < started)
+        return -1;
+
+    collect_t c = {.since = since};
+    if (strmap_init(&c.paths) == -1)
+        return -1;
+    int ret = collect(&c);
+    if (ret == 0 && !c.saw_start)
+        ret = -1;
+    if (ret == 0)
+        ret = visit_collected(&c, fn, arg);
+    strmap_free(&c.paths, NULL);
+    return ret;
+}
@@ -0,0 +1,29 @@
+// clang-format off
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+#include <time.h>
+
+#define JOURNAL_SYNC_RECORDS 64
+#define JOURNAL_SYNC_MS 200
+#define JOURNAL_MAX_SIZE (4 * 1024 * 1024)
+
+typedef enum
+{
+    JOURNAL_START,
+    JOURNAL_SYNC,
+    JOURNAL_REMOVE
+} journal_op_t;
+
+typedef void (*journal_visit_fn)(journal_op_t op, const char *rel_path, void *arg);
+
+int journal_open(void);
+void journal_close(void);
+int journal_append(journal_op_t op, const char *rel_path);
+void journal_applied(void);
+void journal_sync(void);
+int journal_replay(journal_visit_fn fn, void *arg);
+int journal_changed_since(time_t since, journal_visit_fn fn, void *arg);
+
+#endif
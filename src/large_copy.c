@@ -0,0 +1,348 @@
+// clang-format off
+#define _GNU_SOURCE
+#include "large_copy.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "iosched.h"
+
+// two aligned buffers, reader thread fills one while we write the other
+typedef struct
+{
+    int fd;
+    char *buf[2];
+    ssize_t len[2];
+    int full[2];
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} stream_t;
+
+// readin whole chunk at given offset, short only at end of file
+static ssize_t read_chunk(int fd, char *buf, size_t count, off_t offset)
+{
+    size_t len = 0;
+    while (len < count)
+    {
+        ssize_t c = TEMP_FAILURE_RETRY(pread(fd, buf + len, count - len, offset + len));
+        if (c < 0)
+            return -1;
+        if (c == 0)
+            break;
+        len += c;
+    }
+    return len;
+}
+
+// writin whole chunk, turnin off O_DIRECT if the filesystem refuses it
+static int write_chunk(int fd, char *buf, size_t count, off_t offset)
+{
+    size_t len = 0;
+    iosched_charge(count);
+    while (len < count)
+    {
+        ssize_t c = TEMP_FAILURE_RETRY(pwrite(fd, buf + len, count - len, offset + len));
+        if (c < 0)
+        {
+            int flags = fcntl(fd, F_GETFL);
+            if (errno == EINVAL && flags != -1 && (flags & O_DIRECT))
+            {
+                fcntl(fd, F_SETFL, flags & ~O_DIRECT);
+                continue;
+            }
+            return -1;
+        }
+        len += c;
+    }
+    return 0;
+}
+
+// reader thread, runs ahead of the writer by one chunk
+static void *reader_thread(void *arg)
+{
+    stream_t *s = arg;
+    off_t offset = 0;
+    for (int i = 0;; i ^= 1)
+    {
+        pthread_mutex_lock(&s->lock);
+        while (s->full[i] && !s->stop)
+            pthread_cond_wait(&s->cond, &s->lock);
+        int stop = s->stop;
+        pthread_mutex_unlock(&s->lock);
+        if (stop)
+            break;
+
+        ssize_t len = read_chunk(s->fd, s->buf[i], DIRECT_CHUNK_LEN, offset);
+
+        pthread_mutex_lock(&s->lock);
+        s->len[i] = len;
+        s->full[i] = 1;
+        pthread_cond_broadcast(&s->cond);
+        pthread_mutex_unlock(&s->lock);
+
+        if (len < DIRECT_CHUNK_LEN)
+            break;
+        offset += len;
+    }
+    return NULL;
+}
+
+// streamin big file with O_DIRECT and preallocated target, avoids page cache and fragmentation
+int copy_file_large(const char *source_path, int source_fd, int dest_fd, off_t size)
+{
+    if (fallocate(dest_fd, 0, 0, size) == -1 && errno != EOPNOTSUPP && errno != ENOSYS)
+    {
+        return -1;
+    }
+
+    int read_fd = open(source_path, O_RDONLY | O_DIRECT);
+    if (read_fd == -1)
+    {
+        // no O_DIRECT here, at least tell the kernel we read sequentialy
+        read_fd = source_fd;
+        posix_fadvise(read_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+
+    int direct_write = 0;
+    int flags = fcntl(dest_fd, F_GETFL);
+    if (flags != -1 && fcntl(dest_fd, F_SETFL, flags | O_DIRECT) == 0)
+        direct_write = 1;
+
+    stream_t s;
+    memset(&s, 0, sizeof(s));
+    s.fd = read_fd;
+    if (posix_memalign((void **)&s.buf[0], DIRECT_ALIGN, DIRECT_CHUNK_LEN) != 0 ||
+        posix_memalign((void **)&s.buf[1], DIRECT_ALIGN, DIRECT_CHUNK_LEN) != 0)
+    {
+        free(s.buf[0]);
+        if (read_fd != source_fd)
+            close(read_fd);
+        errno = ENOMEM;
+        return -1;
+    }
+    pthread_mutex_init(&s.lock, NULL);
+    pthread_cond_init(&s.cond, NULL);
+
+    int ret = 0;
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, reader_thread, &s) != 0)
+    {
+        ret = -1;
+        goto out;
+    }
+
+    off_t offset = 0;
+    for (int i = 0;; i ^= 1)
+    {
+        pthread_mutex_lock(&s.lock);
+        while (!s.full[i])
+            pthread_cond_wait(&s.cond, &s.lock);
+        ssize_t len = s.len[i];
+        pthread_mutex_unlock(&s.lock);
+
+        if (len < 0)
+        {
+            ret = -1;
+            break;
+        }
+
+        // O_DIRECT needs aligned length, so pad the tail and truncate afterwards
+        size_t out_len = len;
+        if (direct_write && out_len % DIRECT_ALIGN)
+        {
+            size_t padded = (out_len + DIRECT_ALIGN - 1) & ~((size_t)DIRECT_ALIGN - 1);
+            memset(s.buf[i] + out_len, 0, padded - out_len);
+            out_len = padded;
+        }
+        if (out_len > 0 && write_chunk(dest_fd, s.buf[i], out_len, offset) == -1)
+        {
+            ret = -1;
+            break;
+        }
+        offset += len;
+
+        pthread_mutex_lock(&s.lock);
+        s.full[i] = 0;
+        pthread_cond_broadcast(&s.cond);
+        pthread_mutex_unlock(&s.lock);
+
+        if (len < DIRECT_CHUNK_LEN)
+            break;
+    }
+
+    pthread_mutex_lock(&s.lock);
+    s.stop = 1;
+    pthread_cond_broadcast(&s.cond);
+    pthread_mutex_unlock(&s.lock);
+    pthread_join(tid, NULL);
+
+    if (ret == 0 && ftruncate(dest_fd, offset) == -1)
+        ret = -1;
+
+out:;
+    int saved_errno = errno;
+    pthread_mutex_destroy(&s.lock);
+    pthread_cond_destroy(&s.cond);
+    free(s.buf[0]);
+    free(s.buf[1]);
+    if (read_fd != source_fd)
+        close(read_fd);
+    if (flags != -1)
+        fcntl(dest_fd, F_SETFL, flags);
+    errno = saved_errno;
+    return ret;
+}
+
+// shared state for the chunk workers, each grabs next range until done
+typedef struct
+{
+    int source_fd;
+    int dest_fd;
+    off_t size;
+    atomic_llong next_chunk;
+    atomic_llong end;
+    atomic_int error;
+} parallel_copy_t;
+
+// copyin one range with pread/pwrite when copy_file_range is not possible, returns bytes copied
+static off_t copy_range_rw(int source_fd, int dest_fd, off_t offset, off_t len)
+{
+    char *buf = malloc(DIRECT_CHUNK_LEN);
+    if (!buf)
+        return -1;
+    off_t done = 0;
+    while (len > 0)
+    {
+        size_t want = len < DIRECT_CHUNK_LEN ? (size_t)len : DIRECT_CHUNK_LEN;
+        ssize_t got = read_chunk(source_fd, buf, want, offset);
+        if (got <= 0)
+        {
+            free(buf);
+            return got == 0 ? done : -1;
+        }
+        if (write_chunk(dest_fd, buf, got, offset) == -1)
+        {
+            free(buf);
+            return -1;
+        }
+        offset += got;
+        len -= got;
+        done += got;
+    }
+    free(buf);
+    return done;
+}
+
+// copyin one range, in kernel if we can, returns bytes copied, short when the source shrank
+static off_t copy_range(int source_fd, int dest_fd, off_t offset, off_t len)
+{
+    off_t src_off = offset, dst_off = offset;
+    off_t done = 0;
+    while (len > 0)
+    {
+        // charged after the copy, the fallback below charges its own writes
+        size_t step = len < IOSCHED_CHARGE_LEN ? (size_t)len : IOSCHED_CHARGE_LEN;
+        ssize_t c = copy_file_range(source_fd, &src_off, dest_fd, &dst_off, step, 0);
+        if (c == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)
+            {
+                off_t rest = copy_range_rw(source_fd, dest_fd, src_off, len);
+                return rest == -1 ? -1 : done + rest;
+            }
+            return -1;
+        }
+        if (c == 0)
+            break;
+        iosched_charge(c);
+        len -= c;
+        done += c;
+    }
+    return done;
+}
+
+// worker thread for parallel copy, every range is written back and dropped from the page
+// cache like the O_DIRECT stream would, so copy_file_range stays usable for reflinks
+static void *chunk_worker(void *arg)
+{
+    parallel_copy_t *pc = arg;
+    while (!atomic_load(&pc->error))
+    {
+        off_t offset = atomic_fetch_add(&pc->next_chunk, 1) * PARALLEL_CHUNK_LEN;
+        if (offset >= pc->size)
+            break;
+        off_t len = pc->size - offset < PARALLEL_CHUNK_LEN ? pc->size - offset : PARALLEL_CHUNK_LEN;
+        off_t copied = copy_range(pc->source_fd, pc->dest_fd, offset, len);
+        if (copied == -1)
+        {
+            int expected = 0;
+            atomic_compare_exchange_strong(&pc->error, &expected, errno ? errno : EIO);
+            break;
+        }
+        if (copied == 0)
+            continue;
+        sync_file_range(pc->dest_fd, offset, copied,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(pc->dest_fd, offset, copied, POSIX_FADV_DONTNEED);
+        posix_fadvise(pc->source_fd, offset, copied, POSIX_FADV_DONTNEED);
+
+        // ranges past the end of a shrunk source copy nothin, the furthest copied byte is the new size
+        long long end = offset + copied;
+        long long seen = atomic_load(&pc->end);
+        while (seen < end && !atomic_compare_exchange_weak(&pc->end, &seen, end))
+            ;
+    }
+    return NULL;
+}
+
+// splittin huge file into ranges and copyin them at once from few threads, target is
+// preallocated to the size seen at the start and cut to what was copied if the source shrank
+int copy_file_parallel(int source_fd, int dest_fd, off_t size)
+{
+    if (fallocate(dest_fd, 0, 0, size) == -1)
+    {
+        if (errno != EOPNOTSUPP && errno != ENOSYS)
+            return -1;
+        if (ftruncate(dest_fd, size) == -1)
+            return -1;
+    }
+
+    parallel_copy_t pc;
+    pc.source_fd = source_fd;
+    pc.dest_fd = dest_fd;
+    pc.size = size;
+    atomic_init(&pc.next_chunk, 0);
+    atomic_init(&pc.end, 0);
+    atomic_init(&pc.error, 0);
+
+    pthread_t tids[PARALLEL_COPY_WORKERS];
+    int started = 0;
+    for (; started < PARALLEL_COPY_WORKERS; started++)
+    {
+        if (pthread_create(&tids[started], NULL, chunk_worker, &pc) != 0)
+            break;
+    }
+    // if no thread started just do it ourselves
+    if (started == 0)
+        chunk_worker(&pc);
+    for (int i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+
+    int err = atomic_load(&pc.error);
+    if (err)
+    {
+        errno = err;
+        return -1;
+    }
+    off_t end = atomic_load(&pc.end);
+    if (end < size && ftruncate(dest_fd, end) == -1)
+        return -1;
+    return 0;
+}
@@ -0,0 +1,18 @@
+// clang-format off
+#ifndef LARGE_COPY_H
+#define LARGE_COPY_H
+
+#include <sys/types.h>
+
+#define LARGE_FILE_THRESHOLD (256LL * 1024 * 1024)
+#define DIRECT_CHUNK_LEN (8 * 1024 * 1024)
+#define DIRECT_ALIGN 4096
+
+#define PARALLEL_COPY_THRESHOLD (1024LL * 1024 * 1024)
+#define PARALLEL_CHUNK_LEN (64LL * 1024 * 1024)
+#define PARALLEL_COPY_WORKERS 4
+
+int copy_file_large(const char *source_path, int source_fd, int dest_fd, off_t size);
+int copy_file_parallel(int source_fd, int dest_fd, off_t size);
+
+#endif
@@ -0,0 +1,175 @@
+// clang-format off
+#include "lz.h"
+#include <stdint.h>
+#include <string.h>
+
+// small LZ4 style block codec: token with literal and match length,
+// literals, 2 byte offset, extra length bytes of 255 when needed
+
+#define MIN_MATCH 4
+#define LAST_LITERALS 5
+#define MATCH_SAFE 12
+#define MAX_OFFSET 65535
+
+static inline uint32_t read32(const char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t hash_seq(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// writin 255 bytes until the length fits, returns new position or NULL when out of space
+static char *put_length(char *op, char *oend, size_t len)
+{
+    while (len >= 255)
+    {
+        if (op >= oend)
+            return NULL;
+        *op++ = (char)255;
+        len -= 255;
+    }
+    if (op >= oend)
+        return NULL;
+    *op++ = (char)len;
+    return op;
+}
+
+// emitin one sequence of literals and (optionaly) a match
+static char *put_sequence(char *op, char *oend, const char *lit, size_t lit_len, size_t offset, size_t match_len)
+{
+    if (op >= oend)
+        return NULL;
+    char *token = op++;
+    unsigned char t = (lit_len >= 15 ? 15 : lit_len) << 4;
+    if (lit_len >= 15 && !(op = put_length(op, oend, lit_len - 15)))
+        return NULL;
+    if ((size_t)(oend - op) < lit_len)
+        return NULL;
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+
+    if (match_len)
+    {
+        if (oend - op < 2)
+            return NULL;
+        *op++ = offset & 0xff;
+        *op++ = offset >> 8;
+        size_t ml = match_len - MIN_MATCH;
+        t |= ml >= 15 ? 15 : ml;
+        if (ml >= 15 && !(op = put_length(op, oend, ml - 15)))
+            return NULL;
+    }
+    *token = t;
+    return op;
+}
+
+// compressin a block, returns 0 when it does not fit (caller stores it raw then),
+// table of LZ_TABLE_LEN entries is the caller's so one can serve every block of a thread
+size_t lz_compress(const char *src, size_t src_len, char *dst, size_t dst_cap, uint32_t *table)
+{
+    memset(table, 0, LZ_TABLE_LEN * sizeof(uint32_t));
+
+    const char *ip = src;
+    const char *anchor = src;
+    const char *iend = src + src_len;
+    const char *mlimit = src_len > MATCH_SAFE ? iend - MATCH_SAFE : src;
+    char *op = dst;
+    char *oend = dst + dst_cap;
+
+    while (ip < mlimit)
+    {
+        uint32_t seq = read32(ip);
+        uint32_t h = hash_seq(seq);
+        const char *ref = src + table[h];
+        table[h] = ip - src;
+
+        if (ref >= ip || ip - ref > MAX_OFFSET || read32(ref) != seq)
+        {
+            // movin faster through data that does not compress
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+
+        // extendin match forward, keepin last bytes as literals
+        const char *mend = ip + MIN_MATCH;
+        const char *ref_end = ref + MIN_MATCH;
+        while (mend < iend - LAST_LITERALS && *mend == *ref_end)
+        {
+            mend++;
+            ref_end++;
+        }
+
+        op = put_sequence(op, oend, anchor, ip - anchor, ip - ref, mend - ip);
+        if (!op)
+            return 0;
+        ip = mend;
+        anchor = ip;
+    }
+
+    op = put_sequence(op, oend, anchor, iend - anchor, 0, 0);
+    if (!op)
+        return 0;
+    return op - dst;
+}
+
+// readin extra length bytes after a 15 in the token
+static int get_length(const unsigned char **ip, const unsigned char *iend, size_t *len)
+{
+    unsigned char b;
+    do
+    {
+        if (*ip >= iend)
+            return -1;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+// decompressin a block, checkin every bound so broken data cant overflow
+long lz_decompress(const char *src, size_t src_len, char *dst, size_t dst_cap)
+{
+    const unsigned char *ip = (const unsigned char *)src;
+    const unsigned char *iend = ip + src_len;
+    char *op = dst;
+    char *oend = dst + dst_cap;
+
+    while (ip < iend)
+    {
+        unsigned char token = *ip++;
+        size_t lit_len = token >> 4;
+        if (lit_len == 15 && get_length(&ip, iend, &lit_len) == -1)
+            return -1;
+        if ((size_t)(iend - ip) < lit_len || (size_t)(oend - op) < lit_len)
+            return -1;
+        memcpy(op, ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        size_t match_len = token & 15;
+        if (match_len == 15 && get_length(&ip, iend, &match_len) == -1)
+            return -1;
+        match_len += MIN_MATCH;
+
+        if (offset == 0 || offset > (size_t)(op - dst) || (size_t)(oend - op) < match_len)
+            return -1;
+        // byte by byte because match can overlap what we are writin
+        const char *ref = op - offset;
+        for (size_t i = 0; i < match_len; i++)
+            op[i] = ref[i];
+        op += match_len;
+    }
+    return op - dst;
+}
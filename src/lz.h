@@ -0,0 +1,15 @@
+// clang-format off
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LZ_BOUND(n) ((n) + (n) / 255 + 16)
+#define LZ_HASH_BITS 14
+#define LZ_TABLE_LEN (1u << LZ_HASH_BITS)
+
+size_t lz_compress(const char *src, size_t src_len, char *dst, size_t dst_cap, uint32_t *table);
+long lz_decompress(const char *src, size_t src_len, char *dst, size_t dst_cap);
+
+#endif
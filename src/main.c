@@ -1,15 +1,23 @@
 // clang-format off
 #define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include "backup.h"
 #include "backup_manager.h"
+#include "config.h"
+#include "control.h"
+#include "dedup.h"
 #include "monitor.h"
 #include "parser.h"
 #include "restore.h"
 #include "signals.h"
+#include "snapshot.h"
 
 volatile sig_atomic_t should_exit = 0;
 
@@ -17,14 +25,102 @@ volatile sig_atomic_t should_exit = 0;
 void print_help()
 {
     fprintf(stdout, "Available commands:\n");
-    fprintf(stdout, "  add <source> <target> [<target> ...] - Start backup\n");
+    fprintf(stdout, "  add <source> <target> [<target> ...] [--format plain|dedup|compressed|packed] [--store <dir>]\n"
+                    "      [--snapshots <seconds>] [--keep hourly=N,daily=N,weekly=N] [--durability none|batch|full]\n"
+                    "      [--scrub <MiB/s>] [--exclude <pattern>] [--include <pattern>] [--priority high|normal|idle]\n"
+                    "      [--weight <1-1000>] [--bwlimit <MiB/s>] [--iops <n>] [--ioprio on|off] [--walk-fds <n>]\n"
+                    "      [--walk-mem <MiB>] - Start backup\n"
+                    "      target may also be unix:<socket> or tcp:<host>:<port> of a running sop-backup-recv\n");
     fprintf(stdout, "  end <source> <target> [<target> ...] - Stop backup\n");
     fprintf(stdout, "  help - prints out the functions usage\n");
-    fprintf(stdout, "  list - Show active backups\n");
-    fprintf(stdout, "  restore <backup> <source> - Restore backup to source\n");
+    fprintf(stdout, "  list - Show active backups and worker health\n");
+    fprintf(stdout, "  stats - Count backups by worker health and format\n");
+    fprintf(stdout, "  restore <backup> <source> [--snapshot <name>] [--path <dir|file>] [--include <glob>]\n"
+                    "      - Restore backup to source, or only a subtree and/or files matching globs\n");
+    fprintf(stdout, "  gc <backup> - Remove unreferenced chunks from dedup store\n");
+    fprintf(stdout, "  snapshots <backup> - List snapshots of backup\n");
     fprintf(stdout, "  exit - Exit program\n");
 }
 
+// waitin for a line on stdin, meanwhile restartin dead workers and servin control clients,
+// with stdin closed only the socket is served until a signal stops us
+static int wait_for_input(backup_manager_t *mgr, int stdin_open)
+{
+    struct pollfd *fds = NULL;
+    size_t cap = 0;
+    while (!should_exit)
+    {
+        size_t need = 2 + CONTROL_MAX_CLIENTS + mgr->count;
+        if (need > cap)
+        {
+            struct pollfd *tmp = realloc(fds, need * sizeof(struct pollfd));
+            if (!tmp)
+                break;
+            fds = tmp;
+            cap = need;
+        }
+
+        int n = 0;
+        if (stdin_open)
+            fds[n++] = (struct pollfd){STDIN_FILENO, POLLIN, 0};
+        int control_at = n;
+        int control_count = control_fds(fds + n, CONTROL_MAX_CLIENTS + 1);
+        n += control_count;
+        int timeout = SUPERVISE_POLL_MS;
+        n += supervise_fds(mgr, fds + n, mgr->count, &timeout);
+
+        int ret = poll(fds, n, timeout);
+        supervise_workers(mgr);
+        if (ret > 0)
+            control_handle(mgr, fds + control_at, control_count);
+        if (stdin_open && ((ret == -1 && errno != EINTR) || (ret > 0 && fds[0].revents)))
+        {
+            free(fds);
+            return 0;
+        }
+    }
+    free(fds);
+    return -1;
+}
+
+// pickin what restore reads from, the backup itself or one of its snapshots,
+// and which part of it with --path and --include
+static int restore_source(command_t *cmd, char *snapshot_dir, const char **backup, restore_filter_t *filter)
+{
+    memset(filter, 0, sizeof(*filter));
+    for (int i = 0; i < cmd->option_count; i++)
+    {
+        if (strcmp(cmd->options[i].name, "path") == 0)
+        {
+            filter->path = cmd->options[i].value;
+            continue;
+        }
+        if (strcmp(cmd->options[i].name, "include") == 0)
+        {
+            if (filter->include_count == RESTORE_MAX_INCLUDES)
+            {
+                fprintf(stderr, "Error: at most %d --include patterns\n", RESTORE_MAX_INCLUDES);
+                return -1;
+            }
+            filter->includes[filter->include_count++] = cmd->options[i].value;
+            continue;
+        }
+        if (strcmp(cmd->options[i].name, "snapshot") != 0)
+        {
+            fprintf(stderr, "Error: unknown restore option --%s\n", cmd->options[i].name);
+            return -1;
+        }
+        if (snapshot_path(snapshot_dir, cmd->target_paths[0], cmd->options[i].value) == -1 ||
+            access(snapshot_dir, F_OK) == -1)
+        {
+            fprintf(stderr, "Error: no snapshot %s in %s\n", cmd->options[i].value, cmd->target_paths[0]);
+            return -1;
+        }
+        *backup = snapshot_dir;
+    }
+    return 0;
+}
+
 // main function, handlin user input in loop
 int main(int argc, char *argv[])
 {
@@ -37,6 +133,19 @@ int main(int argc, char *argv[])
         }
     }
 
+    // sop-backup --control <socket> also takes commands from scripts over a unix socket
+    const char *control_path = NULL;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--control") == 0 && i + 1 < argc)
+            control_path = argv[++i];
+        else
+        {
+            fprintf(stderr, "Usage: %s [--control <socket>]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
     setup_signal_handlers();
 
     backup_manager_t *manager = create_backup_manager();
@@ -46,20 +155,41 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
+    if (control_path && control_open(control_path) == -1)
+    {
+        perror("Failed to open control socket");
+        destroy_backup_manager(manager);
+        return EXIT_FAILURE;
+    }
+
     fprintf(stdout, "Backup system started.\n");
     print_help();
 
+    // unbuffered, so nothin waits in stdio while we poll the fd
+    setvbuf(stdin, NULL, _IONBF, 0);
+
     char *line = NULL;
     size_t len = 0;
+    int stdin_open = 1;
 
     while (!should_exit)
     {
         printf("> ");
         fflush(stdout);
 
+        // dead workers get restarted while we wait for the user
+        if (wait_for_input(manager, stdin_open) == -1)
+            continue;
+
         ssize_t nread = getline(&line, &len, stdin);
         if (nread == -1)
         {
+            if (feof(stdin) && control_path && !should_exit)
+            {
+                // run as a service, keep servin the control socket
+                stdin_open = 0;
+                continue;
+            }
             if (feof(stdin) || should_exit)
             {
                 printf("\n");
@@ -74,46 +204,23 @@ int main(int argc, char *argv[])
         if (line[0] == '\0')
             continue;
 
-        command_t *cmd = parse_command(line);
+        command_t *cmd = parse_command(line, stderr);
         if (!cmd)
             continue;
+        if (cmd->option_count > 0 && cmd->type != CMD_ADD && cmd->type != CMD_RESTORE)
+        {
+            fprintf(stderr, "Error: this command takes no options\n");
+            free_command(cmd);
+            continue;
+        }
 
         switch (cmd->type)
         {
             case CMD_ADD:
-                printf("Adding backup: %s\n", cmd->source_path);
-                for (int i = 0; i < cmd->target_count; i++)
-                {
-                    fprintf(stdout, "  Target: %s\n", cmd->target_paths[i]);
-
-                    if (create_initial_backup(cmd->source_path, cmd->target_paths[i]) != 0)
-                    {
-                        fprintf(stderr, "Failed to create backup for %s -> %s\n", cmd->source_path,
-                                cmd->target_paths[i]);
-                        continue;
-                    }
-
-                    if (add_backup(manager, cmd->source_path, cmd->target_paths[i]) == 0)
-                    {
-                        fprintf(stdout, "Backup added successfully: %s -> %s\n", cmd->source_path,
-                                cmd->target_paths[i]);
-                    }
-                }
-                break;
-
             case CMD_END:
-                fprintf(stdout, "Ending backup: %s\n", cmd->source_path);
-                for (int i = 0; i < cmd->target_count; i++)
-                {
-                    if (remove_backup(manager, cmd->source_path, cmd->target_paths[i]) == 0)
-                    {
-                        fprintf(stdout, "Backup ended: %s -> %s\n", cmd->source_path, cmd->target_paths[i]);
-                    }
-                }
-                break;
-
             case CMD_LIST:
-                list_backups(manager);
+            case CMD_STATS:
+                command_execute(manager, cmd, stdout, stderr);
                 break;
             case CMD_HELP:
                 print_help();
@@ -121,8 +228,14 @@ int main(int argc, char *argv[])
             case CMD_RESTORE:
                 if (cmd->target_count > 0)
                 {
-                    fprintf(stdout, "Restoring backup: %s -> %s\n", cmd->target_paths[0], cmd->source_path);
-                    if (restore_backup(cmd->source_path, cmd->target_paths[0]) == 0)
+                    // snapshot is a complete backup of its own, restore just reads from there
+                    char snapshot_dir[PATH_MAX];
+                    const char *backup = cmd->target_paths[0];
+                    restore_filter_t filter;
+                    if (restore_source(cmd, snapshot_dir, &backup, &filter) == -1)
+                        break;
+                    fprintf(stdout, "Restoring backup: %s -> %s\n", backup, cmd->source_path);
+                    if (restore_backup(cmd->source_path, backup, filter.path || filter.include_count ? &filter : NULL) == 0)
                     {
                         fprintf(stdout, "Restore completed successfully\n");
                     }
@@ -137,6 +250,28 @@ int main(int argc, char *argv[])
                 }
                 break;
 
+            case CMD_GC:
+            {
+                backup_config_t config;
+                char store_dir[PATH_MAX];
+                if (config_load(&config, cmd->source_path) == -1 || config.format != FORMAT_DEDUP)
+                {
+                    fprintf(stderr, "Error: %s is not a dedup backup\n", cmd->source_path);
+                    break;
+                }
+                if (dedup_store_dir(store_dir, config.store_path, cmd->source_path) == -1 ||
+                    dedup_gc(store_dir) == -1)
+                {
+                    fprintf(stderr, "Garbage collection failed\n");
+                }
+                break;
+            }
+
+            case CMD_SNAPSHOTS:
+                if (snapshot_list(cmd->source_path) == -1)
+                    perror("Failed to list snapshots");
+                break;
+
             case CMD_EXIT:
                 fprintf(stdout, "Exiting...\n");
                 should_exit = 1;
@@ -154,6 +289,7 @@ int main(int argc, char *argv[])
 
     free(line);
 
+    control_close();
     cleanup_on_exit(manager);
     destroy_backup_manager(manager);
     return EXIT_SUCCESS;
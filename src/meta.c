@@ -0,0 +1,76 @@
+// clang-format off
+#define _GNU_SOURCE
+#include "meta.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "hash.h"
+
+// target root of the backup this process works on, metadata lives under it
+static char meta_root[PATH_MAX];
+
+void meta_set_root(const char *target_root)
+{
+    if (!target_root)
+    {
+        meta_root[0] = '\0';
+        return;
+    }
+    strncpy(meta_root, target_root, PATH_MAX - 1);
+    meta_root[PATH_MAX - 1] = '\0';
+
+    size_t len = strlen(meta_root);
+    while (len > 1 && meta_root[len - 1] == '/')
+        meta_root[--len] = '\0';
+}
+
+const char *meta_get_root(void)
+{
+    return meta_root[0] ? meta_root : NULL;
+}
+
+// buildin <root>/.sop-backup/<kind>/<name>, creatin the dirs on the way
+int meta_path(char *out, const char *kind, const char *name)
+{
+    if (!meta_root[0])
+        return -1;
+
+    int n = snprintf(out, PATH_MAX, "%s/%s", meta_root, META_DIR_NAME);
+    if (n < 0 || n >= PATH_MAX)
+        return -1;
+    if (mkdir(out, 0700) == -1 && errno != EEXIST)
+        return -1;
+
+    n = snprintf(out, PATH_MAX, "%s/%s/%s", meta_root, META_DIR_NAME, kind);
+    if (n < 0 || n >= PATH_MAX)
+        return -1;
+    if (mkdir(out, 0700) == -1 && errno != EEXIST)
+        return -1;
+
+    n = snprintf(out, PATH_MAX, "%s/%s/%s/%s", meta_root, META_DIR_NAME, kind, name);
+    if (n < 0 || n >= PATH_MAX)
+        return -1;
+    return 0;
+}
+
+// per file metadata, named by hash of the path inside the target
+int meta_file_path(char *out, const char *kind, const char *target_path)
+{
+    size_t root_len = strlen(meta_root);
+    if (!root_len || strncmp(target_path, meta_root, root_len) != 0 || target_path[root_len] != '/')
+        return -1;
+
+    const char *rel = target_path + root_len;
+    char name[32];
+    snprintf(name, sizeof(name), "%016" PRIx64, hash64(rel, strlen(rel), 0));
+    return meta_path(out, kind, name);
+}
+
+// checcs if directory entry is our metadata dir
+int is_meta_name(const char *name)
+{
+    return strcmp(name, META_DIR_NAME) == 0;
+}
@@ -0,0 +1,13 @@
+// clang-format off
+#ifndef META_H
+#define META_H
+
+#define META_DIR_NAME ".sop-backup"
+
+void meta_set_root(const char *target_root);
+const char *meta_get_root(void);
+int meta_path(char *out, const char *kind, const char *name);
+int meta_file_path(char *out, const char *kind, const char *target_path);
+int is_meta_name(const char *name);
+
+#endif
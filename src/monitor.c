@@ -3,6 +3,7 @@
 #include "monitor.h"
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,8 +11,27 @@
 #include <sys/inotify.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include "attr.h"
 #include "backup.h"
+#include "compress.h"
+#include "dedup.h"
+#include "delta.h"
+#include "durable.h"
+#include "epoch.h"
+#include "filter.h"
+#include "hardlink.h"
+#include "iosched.h"
+#include "journal.h"
+#include "meta.h"
+#include "pack.h"
+#include "replicate.h"
+#include "resume.h"
+#include "scrub.h"
 #include "signals.h"
+#include "snapshot.h"
+#include "trash.h"
+#include "walk.h"
+#include "wire.h"
 
 #define ERR(source) (perror(source), fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), exit(EXIT_FAILURE))
 
@@ -61,7 +81,7 @@ static void remove_watch_entry(int wd)
 // addin inotify watch and storin in list
 static int register_watch(int inotify_fd, const char *path)
 {
-    uint32_t mask = IN_CREATE | IN_MODIFY | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE;
+    uint32_t mask = IN_CREATE | IN_MODIFY | IN_ATTRIB | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE;
 
     int wd = inotify_add_watch(inotify_fd, path, mask);
     if (wd == -1)
@@ -87,8 +107,48 @@ static int register_watch(int inotify_fd, const char *path)
     return wd;
 }
 
+// removin everythin inside a dir, names are unlinked relative to their dir fd
+// and dirs go after their content, the root itself is left to the caller
+static int remove_children(int parent_fd, const char *name, const char *path)
+{
+    walk_tree_t tree;
+    if (walk_tree_open(&tree, parent_fd, name, path, NULL) == -1)
+    {
+        if (errno == ENOENT)
+            return 0;
+        perror("opendir failed");
+        return -1;
+    }
+
+    int ret = 0;
+    int step;
+    while (ret == 0 && (step = walk_tree_next(&tree)) > 0)
+    {
+        if (step == WALK_LEAVE && tree.depth == 0)
+            break;
+        if (step == WALK_ENTRY && tree.type == DT_DIR)
+        {
+            if (walk_tree_enter(&tree) == 0)
+                continue;
+            if (errno != ENOENT)
+            {
+                fprintf(stderr, "Failed to open %s: %s\n", tree.path, strerror(errno));
+                ret = -1;
+            }
+            continue;
+        }
+        if (unlinkat(tree.dir_fd, tree.name, tree.type == DT_DIR ? AT_REMOVEDIR : 0) == -1 && errno != ENOENT)
+        {
+            fprintf(stderr, "Failed to remove %s: %s\n", tree.path, strerror(errno));
+            ret = -1;
+        }
+    }
+    walk_tree_close(&tree);
+    return ret;
+}
+
 // deletin path recursivly, for folders and files
-static int remove_path_recursive(const char *path)
+int remove_path_recursive(const char *path)
 {
     struct stat st;
     if (lstat(path, &st) == -1)
@@ -101,34 +161,8 @@ static int remove_path_recursive(const char *path)
 
     if (S_ISDIR(st.st_mode))
     {
-        DIR *dir = opendir(path);
-        if (!dir)
-        {
-            if (errno == ENOENT)
-                return 0;
-            perror("opendir failed");
+        if (remove_children(AT_FDCWD, path, path) == -1)
             return -1;
-        }
-        struct dirent *ent;
-        char child[PATH_MAX];
-        while ((ent = readdir(dir)) != NULL)
-        {
-            if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
-                continue;
-            int n = snprintf(child, PATH_MAX, "%s/%s", path, ent->d_name);
-            if (n <= 0 || n >= PATH_MAX)
-            {
-                fprintf(stderr, "Path too long while removing: %s/%s\n", path, ent->d_name);
-                closedir(dir);
-                return -1;
-            }
-            if (remove_path_recursive(child) == -1)
-            {
-                closedir(dir);
-                return -1;
-            }
-        }
-        closedir(dir);
         if (rmdir(path) == -1 && errno != ENOENT)
         {
             perror("rmdir failed");
@@ -146,20 +180,120 @@ static int remove_path_recursive(const char *path)
     return 0;
 }
 
-// creatin first baccup before startin monitor
-int create_initial_backup(const char *source, const char *target)
+// deletes from the worker, whole dirs go to the trash thread and only files are unlinked here
+static void remove_target(const char *path)
+{
+    if (trash_move(path) == -1)
+        remove_path_recursive(path);
+}
+
+static void catch_up(const char *source, const char *target);
+
+// settin up target dir and its saved config, earlier add keeps its format
+// unless user asks for a diferent one
+static int prepare_target(const char *source, const char *target, backup_config_t *config, FILE *err)
+{
+    backup_config_t saved;
+    if (config_load(&saved, target) == 0)
+    {
+        if (config->format_set && config->format != saved.format)
+        {
+            fprintf(err, "Error: Target '%s' already uses format '%s'\n", target, format_name(saved.format));
+            return -1;
+        }
+        config_merge_saved(config, &saved);
+        iosched_configure(config);
+    }
+
+    struct stat st;
+    if (lstat(source, &st) == -1 || !S_ISDIR(st.st_mode))
+    {
+        if (config->format != FORMAT_PLAIN)
+        {
+            fprintf(err, "Error: Format '%s' needs a directory source\n", format_name(config->format));
+            return -1;
+        }
+        return 0;
+    }
+
+    if (mkdir(target, st.st_mode & 0777) == -1 && errno != EEXIST)
+    {
+        fprintf(err, "Error: Cannot create target '%s'\n", target);
+        return -1;
+    }
+    if (config_save(config, target) == -1)
+    {
+        fprintf(err, "Error: Cannot write backup config to '%s'\n", target);
+        return -1;
+    }
+    if (config->format == FORMAT_DEDUP)
+    {
+        char store_dir[PATH_MAX];
+        if (dedup_store_dir(store_dir, config->store_path, target) == -1 ||
+            dedup_register_root(store_dir, target) == -1)
+        {
+            fprintf(err, "Error: Cannot set up chunk store for '%s'\n", target);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// remote target is a receiver process, the first backup is a scan that sends only
+// what the receiver does not have yet, so re-addin an old target is cheap
+static int create_remote_backup(const char *source, const char *target, backup_config_t *config, FILE *err)
 {
     struct stat st;
+    if (lstat(source, &st) == -1 || !S_ISDIR(st.st_mode))
+    {
+        fprintf(err, "Error: Remote target needs a directory source\n");
+        return -1;
+    }
+    if (config->format != FORMAT_PLAIN || config->store_path[0] || config->snapshot_interval > 0 ||
+        config->scrub_rate > 0)
+    {
+        fprintf(err, "Error: Remote targets are plain copies without store, snapshots or scrub\n");
+        return -1;
+    }
+
+    fprintf(stdout, "Creating initial backup from %s to %s...\n", source, target);
+    meta_set_root(NULL);
+    config_set_current(config);
+    filter_set(config->filters, source);
+    if (repl_open(target, source) == -1)
+    {
+        fprintf(err, "Error: Cannot reach receiver '%s': %s\n", target, strerror(errno));
+        return -1;
+    }
+    int ret = repl_scan(0);
+    repl_close();
+    if (ret != 0 || repl_broken())
+    {
+        fprintf(err, "Error: Initial backup to '%s' failed\n", target);
+        return -1;
+    }
+    fprintf(stdout, "Initial backup completed\n");
+    return 0;
+}
+
+// creatin first baccup before startin monitor, reasons it can't be done go to err
+int create_initial_backup(const char *source, const char *target, backup_config_t *config, FILE *err)
+{
+    struct stat st;
+    if (wire_is_endpoint(target))
+    {
+        return create_remote_backup(source, target, config, err);
+    }
     if (lstat(source, &st) == -1)
     {
-        fprintf(stderr, "Error: Source path '%s' does not exist\n", source);
+        fprintf(err, "Error: Source path '%s' does not exist\n", source);
         return -1;
     }
 
     char *real_source = realpath(source, NULL);
     if (!real_source)
     {
-        fprintf(stderr, "Error: Cannot resolve source path '%s'\n", source);
+        fprintf(err, "Error: Cannot resolve source path '%s'\n", source);
         return -1;
     }
 
@@ -169,7 +303,7 @@ int create_initial_backup(const char *source, const char *target)
     {
         if (getcwd(target_buf, PATH_MAX) == NULL)
         {
-            fprintf(stderr, "Error: Cannot get current directory\n");
+            fprintf(err, "Error: Cannot get current directory\n");
             free(real_source);
             return -1;
         }
@@ -193,7 +327,7 @@ int create_initial_backup(const char *source, const char *target)
     if (strncmp(target_to_check, real_source, source_len) == 0 &&
         (target_check_len == source_len || target_to_check[source_len] == '/'))
     {
-        fprintf(stderr, "Error: Cannot backup directory inside itself\n");
+        fprintf(err, "Error: Cannot backup directory inside itself\n");
         free(real_source);
         return -1;
     }
@@ -202,15 +336,48 @@ int create_initial_backup(const char *source, const char *target)
 
     if (lstat(target, &st) == 0 && !S_ISDIR(st.st_mode))
     {
-        fprintf(stderr, "Error: Target '%s' exists but is not a directory\n", target);
+        fprintf(err, "Error: Target '%s' exists but is not a directory\n", target);
+        return -1;
+    }
+
+    if (prepare_target(source, target, config, err) == -1)
+    {
         return -1;
     }
 
     fprintf(stdout, "Creating initial backup from %s to %s...\n", source, target);
 
-    if (copy_tree(source, target, source, target) != 0)
+    meta_set_root(target);
+    staged_cleanup();
+    config_set_current(config);
+    filter_set(config->filters, source);
+    // worker forked after this inherits the links seen here
+    hardlink_reset();
+    if (config->format == FORMAT_PACKED && pack_open(target) == -1)
+    {
+        fprintf(err, "Error: Cannot open pack index of '%s'\n", target);
+        return -1;
+    }
+
+    // an interrupted run of a directory tree is continued like a restarted worker:
+    // unchanged files are kept, changed ones copied, gone ones dropped
+    int resumed = 0;
+    if (lstat(source, &st) == 0 && S_ISDIR(st.st_mode) && (resumed = resume_begin()) == -1)
     {
-        fprintf(stderr, "Error: Failed to create initial backup\n");
+        fprintf(err, "Warning: Cannot record initial backup of '%s' as in progress\n", target);
+    }
+    int ret = 0;
+    if (resumed == 1)
+        catch_up(source, target);
+    else
+        ret = copy_tree(source, target, source, target);
+    resume_end(ret == 0 && !should_exit);
+    pack_close();
+    compress_stop();
+    durable_flush();
+    if (ret != 0 || should_exit)
+    {
+        fprintf(err, "Error: Initial backup %s\n", should_exit ? "interrupted, next add resumes it" : "failed");
         return -1;
     }
 
@@ -218,61 +385,193 @@ int create_initial_backup(const char *source, const char *target)
     return 0;
 }
 
-// addin watches to all subdirectorys
-int add_watch_recursive(int inotify_fd, const char *path)
+// watchin dir opened relative to its parent and every dir under it, d_type picks subdirs
+// without any stat, each dir is watched before it is listed so nothin made meanwhile is missed
+static int add_watch_at(int inotify_fd, int parent_fd, const char *name, const char *path)
 {
     if (register_watch(inotify_fd, path) == -1)
     {
         return -1;
     }
 
-    DIR *dir = opendir(path);
-    if (!dir)
+    walk_tree_t tree;
+    if (walk_tree_open(&tree, parent_fd, name, path, NULL) == -1)
     {
         ERR("Failed to open directory for watching");
     }
+    epoch_watched(path, tree.st);
 
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL)
+    int step;
+    while ((step = walk_tree_next(&tree)) > 0)
     {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        if (step == WALK_LEAVE || tree.type != DT_DIR)
         {
             continue;
         }
 
-        int path_size = strlen(path) + 1 + strlen(entry->d_name) + 1;
-        char *full_path = malloc(path_size);
-        if (full_path == NULL)
+        // excluded dirs get no watch at all
+        if (filter_excluded(tree.path, 1))
         {
-            perror("Memory allocation failed");
-            closedir(dir);
+            continue;
+        }
+        if (register_watch(inotify_fd, tree.path) == -1)
+        {
+            fprintf(stderr, "Failed to watch directory: %s\n", tree.path);
+            walk_tree_close(&tree);
             return -1;
         }
-        snprintf(full_path, path_size, "%s/%s", path, entry->d_name);
+        if (walk_tree_enter(&tree) == -1)
+        {
+            ERR("Failed to open directory for watching");
+        }
+        epoch_watched(tree.path, tree.st);
+    }
+
+    walk_tree_close(&tree);
+    return 0;
+}
+
+// addin watches to all subdirectorys
+int add_watch_recursive(int inotify_fd, const char *path)
+{
+    return add_watch_at(inotify_fd, AT_FDCWD, path, path);
+}
+
+// same as below but the change goes to the receiver as frames
+static void apply_remote_event(uint32_t mask, const char *source_path, int inotify_fd)
+{
+    if (mask & IN_CREATE)
+    {
+        struct stat st;
+        if (lstat(source_path, &st) == -1 || epoch_seen(source_path, &st, EPOCH_COPIED))
+        {
+            return;
+        }
+        if (S_ISDIR(st.st_mode) && inotify_fd != -1 && !epoch_seen(source_path, &st, EPOCH_WATCHED) &&
+            add_watch_recursive(inotify_fd, source_path) == -1)
+        {
+            fprintf(stderr, "Failed to watch directory: %s\n", source_path);
+        }
+        repl_send_path(source_path);
+    }
+    if ((mask & IN_ATTRIB) && !(mask & (IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM)))
+    {
+        repl_send_attr(source_path);
+        return;
+    }
+    if (mask & (IN_MODIFY | IN_CLOSE_WRITE))
+    {
+        struct stat st;
+        if (lstat(source_path, &st) == 0 && epoch_seen(source_path, &st, EPOCH_COPIED))
+        {
+            return;
+        }
+        repl_send_path(source_path);
+    }
+    if (mask & (IN_DELETE | IN_MOVED_FROM))
+    {
+        repl_send_remove(source_path);
+    }
+}
+
+// applyin one event to the target, inotify_fd is -1 when replayin journal
+static void apply_event(uint32_t mask, const char *source_path, const char *target_path, const char *root_source,
+                        const char *root_target, int inotify_fd)
+{
+    if (repl_active())
+    {
+        apply_remote_event(mask, source_path, inotify_fd);
+        return;
+    }
 
+    if (mask & IN_CREATE)
+    {
         struct stat st;
-        if (lstat(full_path, &st) == -1)
+        if (lstat(source_path, &st) == -1)
         {
+            if (errno == ENOENT)
+            {
+                return;
+            }
             perror("Failed to get file status");
-            free(full_path);
-            continue;
+            return;
+        }
+        // already copied by an earlier subtree copy of this epoch and not changed since
+        if (epoch_seen(source_path, &st, EPOCH_COPIED))
+        {
+            return;
         }
 
         if (S_ISDIR(st.st_mode))
         {
-            if (add_watch_recursive(inotify_fd, full_path) == -1)
+            if (mkdir(target_path, st.st_mode & 0777) == -1 && errno != EEXIST)
+            {
+                perror("Failed to create backup directory");
+                return;
+            }
+            if (inotify_fd != -1 && !epoch_seen(source_path, &st, EPOCH_WATCHED) &&
+                add_watch_recursive(inotify_fd, source_path) == -1)
             {
-                fprintf(stderr, "Failed to watch directory: %s\n", full_path);
-                free(full_path);
-                closedir(dir);
-                return -1;
+                fprintf(stderr, "Failed to watch directory: %s\n", source_path);
+            }
+            if (copy_tree(source_path, target_path, root_source, root_target) != 0)
+            {
+                fprintf(stderr, "Failed to backup directory: %s\n", source_path);
             }
         }
-        free(full_path);
+        else if (S_ISLNK(st.st_mode))
+        {
+            copy_symlink(source_path, target_path, root_source, root_target);
+        }
+        else
+        {
+            copy_tree(source_path, target_path, root_source, root_target);
+        }
     }
 
-    closedir(dir);
-    return 0;
+    // chmod, chown or utimes without new data only touches the metadata of the copy
+    if ((mask & IN_ATTRIB) && !(mask & (IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM)))
+    {
+        if (attr_sync(source_path, target_path) == -1)
+            copy_tree(source_path, target_path, root_source, root_target);
+        return;
+    }
+
+    if (mask & (IN_MODIFY | IN_CLOSE_WRITE))
+    {
+        struct stat st;
+        if (stat(source_path, &st) == -1)
+        {
+            // gone again is normal, anythin else leaves st unset and the copy would fail too
+            if (errno != ENOENT)
+            {
+                perror("Failed to get file status");
+            }
+            return;
+        }
+        if (epoch_seen(source_path, &st, EPOCH_COPIED))
+        {
+            return;
+        }
+        struct stat before;
+        int had_copy = lstat(target_path, &before) == 0;
+        int64_t started = epoch_now();
+        if (copy_file(source_path, target_path) == 0 && S_ISREG(st.st_mode))
+        {
+            if (had_copy)
+                hardlink_refresh(&st, target_path, &before);
+            epoch_copied(source_path, &st, started);
+        }
+    }
+
+    if (mask & (IN_DELETE | IN_MOVED_FROM))
+    {
+        if (config_current()->format == FORMAT_PACKED)
+        {
+            pack_forget(target_path);
+        }
+        remove_target(target_path);
+    }
 }
 
 // handlin inotify events, this is where the magic hapens
@@ -341,73 +640,154 @@ void handle_inotify_event(struct inotify_event *event, const char *root_source,
         return;
     }
 
-    if (event->mask & IN_CREATE)
+    // journal first, so a worker killed while applyin it redoes it on next start
+    uint32_t mask = event->mask;
+    if (filter_excluded(source_path, (mask & IN_ISDIR) != 0))
+        return;
+    if (mask & (IN_CREATE | IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM))
+    {
+        const char *rel = strncmp(source_path, root_source, root_len) == 0 ? source_path + root_len : event->name;
+        while (*rel == '/')
+            rel++;
+        journal_append((mask & (IN_DELETE | IN_MOVED_FROM)) ? JOURNAL_REMOVE : JOURNAL_SYNC, rel);
+        apply_event(mask, source_path, target_path, root_source, root_target, inotify_fd);
+        journal_applied();
+    }
+}
+
+typedef struct
+{
+    const char *source;
+    const char *target;
+} replay_roots_t;
+
+// bringin one journaled path in line with how the source looks now
+static void replay_path(journal_op_t op, const char *rel_path, void *arg)
+{
+    replay_roots_t *roots = arg;
+    char source_path[PATH_MAX], target_path[PATH_MAX];
+    if (snprintf(source_path, PATH_MAX, "%s/%s", roots->source, rel_path) >= PATH_MAX ||
+        snprintf(target_path, PATH_MAX, "%s/%s", roots->target, rel_path) >= PATH_MAX)
+        return;
+
+    struct stat st;
+    uint32_t mask = lstat(source_path, &st) == 0 ? IN_CREATE : IN_DELETE;
+    if (mask == IN_CREATE && filter_excluded(source_path, S_ISDIR(st.st_mode)))
+        return;
+    apply_event(mask, source_path, target_path, roots->source, roots->target, -1);
+}
+
+// droppin what the target dir has but the source dir no longer has, or has as a dir
+// instead of a file, top is set for the target root where our metadata dir lives
+static void catch_up_removed(int source_fd, const char *target_path, int top)
+{
+    walk_dir_t dst;
+    if (walk_open(&dst, AT_FDCWD, target_path) == -1)
+        return;
+
+    const char *entry;
+    int type;
+    char child_dst[PATH_MAX];
+    while (!should_exit && walk_next(&dst, &entry, &type) == 1)
+    {
+        if (top && is_meta_name(entry))
+            continue;
+        int src_type = walk_type(source_fd, entry);
+        if (src_type != DT_UNKNOWN && (src_type == DT_DIR) == (type == DT_DIR))
+            continue;
+        if (snprintf(child_dst, PATH_MAX, "%s/%s", target_path, entry) >= PATH_MAX)
+            continue;
+        if (config_current()->format == FORMAT_PACKED)
+            pack_forget(child_dst);
+        remove_target(child_dst);
+    }
+    walk_close(&dst);
+}
+
+// nothin watched the source while a crashed worker was down, so a restarted one walks
+// source and target together, copies files whose size or time changed and drops what is gone
+static void catch_up_dir(const char *source_path, const char *target_path, const char *root_source,
+                         const char *root_target)
+{
+    walk_tree_t tree;
+    if (walk_tree_open(&tree, AT_FDCWD, source_path, source_path, target_path) == -1)
+        return;
+    catch_up_removed(walk_tree_fd(&tree), target_path, 1);
+
+    int step;
+    while (!should_exit && (step = walk_tree_next(&tree)) > 0)
     {
+        if (step == WALK_LEAVE)
+            continue;
         struct stat st;
-        if (lstat(source_path, &st) == -1)
-        {
-            if (errno == ENOENT)
-            {
-                return;
-            }
-            perror("Failed to get file status");
-            return;
-        }
+        if (walk_stat(tree.dir_fd, tree.name, &st) == -1 || filter_excluded(tree.path, S_ISDIR(st.st_mode)))
+            continue;
 
         if (S_ISDIR(st.st_mode))
         {
-            if (mkdir(target_path, st.st_mode & 0777) == -1 && errno != EEXIST)
-            {
-                perror("Failed to create backup directory");
-                return;
-            }
-            if (add_watch_recursive(inotify_fd, source_path) == -1)
-            {
-                fprintf(stderr, "Failed to watch directory: %s\n", source_path);
-            }
-            if (copy_tree(source_path, target_path, root_source, root_target) != 0)
-            {
-                fprintf(stderr, "Failed to backup directory: %s\n", source_path);
-            }
+            if ((mkdir(tree.mirror, st.st_mode & 0777) == 0 || errno == EEXIST) && walk_tree_enter(&tree) == 0)
+                catch_up_removed(walk_tree_fd(&tree), tree.mirror, 0);
         }
-        else if (S_ISLNK(st.st_mode))
+        else if (S_ISREG(st.st_mode) && resume_copy_current(tree.path, tree.mirror))
         {
-            copy_symlink(source_path, target_path, root_source, root_target);
+            // unchanged, but later names of it still have to become links
+            if (st.st_nlink > 1)
+                hardlink_remember(&st, tree.mirror);
         }
         else
         {
-            copy_file(source_path, target_path);
+            if (S_ISLNK(st.st_mode))
+                unlink(tree.mirror);
+            copy_tree(tree.path, tree.mirror, root_source, root_target);
         }
     }
+    walk_tree_close(&tree);
+}
 
-    if (event->mask & (IN_MODIFY | IN_CLOSE_WRITE))
+static void catch_up(const char *source, const char *target)
+{
+    struct stat st;
+    if (lstat(source, &st) == -1 || !S_ISDIR(st.st_mode))
     {
-        struct stat st;
-        if (stat(source_path, &st) == -1)
-        {
-            if (errno == ENOENT)
-            {
-                return;
-            }
-        }
-        copy_file(source_path, target_path);
+        copy_tree(source, target, source, target);
+        return;
+    }
+    catch_up_dir(source, target, source, target);
+    if (config_current()->format == FORMAT_PACKED)
+        pack_forget_missing(source);
+    durable_flush();
+}
+
+// main worker loop, runs in forked proces, a restarted one first catches up with the source
+void start_backup_worker(const char *source, const char *target, const backup_config_t *config, int restarted)
+{
+    setup_signal_handlers();
+    // remote targets keep no metadata dir, the receiver owns everythin on its side
+    int remote = wire_is_endpoint(target);
+    meta_set_root(remote ? NULL : target);
+    if (!remote)
+        staged_cleanup();
+    config_set_current(config);
+    filter_set(config->filters, source);
+    // links seen by the manager belong to whichever backup it added last
+    if (restarted)
+        hardlink_reset();
+    if (config->format == FORMAT_PACKED && pack_open(target) == -1)
+    {
+        perror("Failed to open pack index");
+        exit(EXIT_FAILURE);
     }
 
-    if (event->mask & IN_DELETE)
+    if (remote && repl_open(target, source) == -1)
     {
-        remove_path_recursive(target_path);
+        fprintf(stderr, "Cannot reach receiver %s: %s\n", target, strerror(errno));
+        exit(EXIT_FAILURE);
     }
 
-    if (event->mask & IN_MOVED_FROM)
+    if (!remote && trash_start() == -1)
     {
-        remove_path_recursive(target_path);
+        fprintf(stderr, "Cannot start background deletes, removin synchronously\n");
     }
-}
-
-// main worker loop, runs in forked proces
-void start_backup_worker(const char *source, const char *target)
-{
-    setup_signal_handlers();
 
     int inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
     if (inotify_fd == -1)
@@ -416,6 +796,8 @@ void start_backup_worker(const char *source, const char *target)
         exit(EXIT_FAILURE);
     }
 
+    // watches and copies from here on are remembered until the queue drains
+    epoch_begin();
     if (add_watch_recursive(inotify_fd, source) == -1)
     {
         fprintf(stderr, "Failed to set up file monitoring\n");
@@ -431,26 +813,102 @@ void start_backup_worker(const char *source, const char *target)
         exit(EXIT_FAILURE);
     }
 
+    // watches are set, now finish what a killed worker left in the journal, a restarted worker
+    // skips that since source changes made while it was down are not journaled and the full
+    // catch-up below visits every journaled path anyway, remote ones have no journal at all
+    if (!remote && journal_open() == -1)
+    {
+        perror("Failed to open journal");
+    }
+    else if (!remote && !restarted)
+    {
+        replay_roots_t roots = {source, target};
+        int replayed = journal_replay(replay_path, &roots);
+        if (replayed > 0)
+            fprintf(stdout, "Replayed %d journaled changes for %s\n", replayed, target);
+    }
+    if (restarted && remote)
+    {
+        repl_scan(1);
+        fprintf(stdout, "Restarted worker caught up: %s -> %s\n", source, target);
+    }
+    else if (restarted)
+    {
+        catch_up(source, target);
+        fprintf(stdout, "Restarted worker caught up: %s -> %s\n", source, target);
+    }
+
+    // scrubber only knows how to compare plain files with their source
+    if (config->scrub_rate > 0 && config->format != FORMAT_PLAIN && config->format != FORMAT_PACKED)
+    {
+        fprintf(stderr, "Scrubbing is not supported for %s targets\n", format_name(config->format));
+    }
+    else if (scrub_start(source, target, config->scrub_rate) == -1)
+    {
+        perror("Failed to start scrubber");
+    }
+
     fprintf(stdout, "Monitoring: %s -> %s\n", source, target);
 
+    const backup_config_t *worker_config = config_current();
+    time_t last_snapshot = remote ? 0 : snapshot_latest_time(target);
+
+    // only SIGTERM and a removed source are a clean stop, anythin else gets the worker restarted
+    int failed = 0;
     struct stat st;
     while (!should_exit)
     {
+        // takin snapshot when interval passed, then droppin the ones retention does not keep
+        if (worker_config->snapshot_interval > 0 && time(NULL) - last_snapshot >= worker_config->snapshot_interval)
+        {
+            snapshot_create(target, worker_config);
+            snapshot_prune(target, worker_config);
+            last_snapshot = time(NULL);
+        }
+
         if (stat(source, &st) == -1)
         {
+            if (errno != ENOENT)
+            {
+                perror("Failed to check source directory");
+                failed = 1;
+                break;
+            }
             fprintf(stdout, "Source directory no longer exists, stopping monitor\n");
             break;
         }
+        if (repl_broken())
+        {
+            break;
+        }
 
         ssize_t bytes_read = read(inotify_fd, event_buffer, sizeof(struct inotify_event) + NAME_MAX + 1);
         if (bytes_read == -1)
         {
             if (errno == EAGAIN || errno == EWOULDBLOCK)
             {
+                // queue is empty, every event older than the copies so far was seen
+                epoch_advance();
+                journal_sync();
+                durable_tick();
+                scrub_tick();
+                pack_tick();
+                delta_tick();
+                // a lost receiver ends the worker, the supervisor reconnects it with backoff
+                if (repl_tick() == -1)
+                {
+                    break;
+                }
                 usleep(100000);
                 continue;
             }
+            // signal, the loop condition decides
+            if (errno == EINTR)
+            {
+                continue;
+            }
             perror("Failed to read events");
+            failed = 1;
             break;
         }
 
@@ -463,7 +921,13 @@ void start_backup_worker(const char *source, const char *target)
         }
     }
 
+    scrub_stop();
+    trash_stop();
+    compress_stop();
+    journal_close();
+    durable_flush();
+    repl_close();
     free(event_buffer);
     close(inotify_fd);
-    exit(EXIT_SUCCESS);
+    exit(failed || repl_broken() ? EXIT_FAILURE : EXIT_SUCCESS);
 }
@@ -5,6 +5,7 @@
 
 #include <sys/inotify.h>
 #include <sys/types.h>
+#include "config.h"
 
 typedef struct
 {
@@ -12,9 +13,10 @@ typedef struct
     char *target_path;
 } backup_paths_t;
 
-void start_backup_worker(const char *source, const char *target);
-int create_initial_backup(const char *source, const char *target);
+void start_backup_worker(const char *source, const char *target, const backup_config_t *config, int restarted);
+int create_initial_backup(const char *source, const char *target, backup_config_t *config, FILE *err);
 int add_watch_recursive(int inotify_fd, const char *path);
+int remove_path_recursive(const char *path);
 void handle_inotify_event(struct inotify_event *event, const char *source, const char *target, int inotify_fd);
 
 #endif
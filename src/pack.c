@@ -0,0 +1,693 @@
+// clang-format off
+#define _GNU_SOURCE
+#include "pack.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+#include "attr.h"
+#include "backup.h"
+#include "durable.h"
+#include "hash.h"
+#include "iosched.h"
+#include "meta.h"
+#include "strmap.h"
+
+#define RECORD_PUT 1
+#define RECORD_DEL 2
+#define RECORD_DEL_TREE 3
+#define INDEX_MAGIC 0x31584450
+
+// one index record, path relative to target root follows it, check covers both
+typedef struct
+{
+    uint32_t magic;
+    uint32_t type;
+    uint32_t pack_id;
+    uint32_t len;
+    uint64_t offset;
+    uint32_t mode;
+    uint32_t path_len;
+    int64_t mtime_ns;
+    uint64_t check;
+} index_record_t;
+
+// packs of the target this process works on
+static char pack_root[PATH_MAX];
+static char pack_dir[PATH_MAX];
+static strmap_t entries;
+static int index_fd = -1;
+static int pack_fd = -1;
+static uint32_t current_pack = 0;
+static off_t current_size = 0;
+// size of every pack and how much of it entries still point to, steers compaction
+static off_t *pack_sizes;
+static off_t *pack_live;
+static size_t pack_slots;
+static size_t index_records;
+
+// path inside target root, or NULL when it is not under it
+static const char *relative_path(const char *dest_path)
+{
+    size_t len = strlen(pack_root);
+    if (!len || strncmp(dest_path, pack_root, len) != 0 || (dest_path[len] != '/' && dest_path[len] != '\0'))
+        return NULL;
+    return dest_path + len;
+}
+
+// growin per pack counters so id fits, they only steer compaction so a failure just skips countin
+static int ensure_slot(uint32_t id)
+{
+    if (id < pack_slots)
+        return 0;
+    size_t slots = pack_slots ? pack_slots : 16;
+    while (slots <= id)
+        slots *= 2;
+    off_t *sizes = realloc(pack_sizes, slots * sizeof(off_t));
+    if (!sizes)
+        return -1;
+    pack_sizes = sizes;
+    off_t *live = realloc(pack_live, slots * sizeof(off_t));
+    if (!live)
+        return -1;
+    pack_live = live;
+    memset(pack_sizes + pack_slots, 0, (slots - pack_slots) * sizeof(off_t));
+    memset(pack_live + pack_slots, 0, (slots - pack_slots) * sizeof(off_t));
+    pack_slots = slots;
+    return 0;
+}
+
+// entry goes away or moves, its bytes in the old pack are dead from now
+static void drop_live(const pack_entry_t *e)
+{
+    if (e && e->pack_id < pack_slots)
+        pack_live[e->pack_id] -= e->len;
+}
+
+static void add_live(const pack_entry_t *e)
+{
+    if (ensure_slot(e->pack_id) == 0)
+    {
+        pack_live[e->pack_id] += e->len;
+        pack_sizes[e->pack_id] += e->len;
+    }
+}
+
+// collectin keys first, removin while iteratin would break the map
+typedef struct
+{
+    const char *prefix;
+    size_t prefix_len;
+    char **keys;
+    size_t count;
+    size_t cap;
+} prefix_match_t;
+
+static void push_key(prefix_match_t *pm, const char *key)
+{
+    if (pm->count == pm->cap)
+    {
+        size_t cap = pm->cap ? pm->cap * 2 : 16;
+        char **tmp = realloc(pm->keys, cap * sizeof(char *));
+        if (!tmp)
+            return;
+        pm->keys = tmp;
+        pm->cap = cap;
+    }
+    pm->keys[pm->count++] = strdup(key);
+}
+
+static void collect_prefix(const char *key, void *value, void *arg)
+{
+    prefix_match_t *pm = arg;
+    if (strncmp(key, pm->prefix, pm->prefix_len) != 0 || key[pm->prefix_len] != '/')
+        return;
+    push_key(pm, key);
+}
+
+// droppin all entries under rel, returns how many were there
+static size_t remove_tree(const char *rel)
+{
+    prefix_match_t pm = {rel, strlen(rel), NULL, 0, 0};
+    strmap_foreach(&entries, collect_prefix, &pm);
+    for (size_t i = 0; i < pm.count; i++)
+    {
+        pack_entry_t *e = pm.keys[i] ? strmap_remove(&entries, pm.keys[i]) : NULL;
+        drop_live(e);
+        free(e);
+        free(pm.keys[i]);
+    }
+    free(pm.keys);
+    return pm.count;
+}
+
+static uint64_t record_check(const index_record_t *rec, const char *rel)
+{
+    index_record_t copy = *rec;
+    copy.check = 0;
+    hash_state_t st;
+    hash_init(&st, INDEX_MAGIC);
+    hash_update(&st, &copy, sizeof(copy));
+    hash_update(&st, rel, rec->path_len);
+    return hash_digest(&st);
+}
+
+// replayin index log into memory, later records win, returns where the last whole
+// record ends so a torn or garbage tail can be cut off before appendin
+static off_t load_index(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return errno == ENOENT ? 0 : -1;
+
+    off_t good = 0;
+    index_record_t rec;
+    char rel[PATH_MAX];
+    while (bulk_read(fd, (char *)&rec, sizeof(rec)) == sizeof(rec))
+    {
+        if (rec.magic != INDEX_MAGIC || rec.path_len == 0 || rec.path_len >= PATH_MAX ||
+            bulk_read(fd, rel, rec.path_len) != rec.path_len || rec.check != record_check(&rec, rel))
+            break;
+        rel[rec.path_len] = '\0';
+        good += sizeof(rec) + rec.path_len;
+        index_records++;
+
+        if (rec.type == RECORD_PUT)
+        {
+            pack_entry_t *e = malloc(sizeof(*e));
+            if (!e)
+            {
+                close(fd);
+                return -1;
+            }
+            *e = (pack_entry_t){rec.pack_id, rec.len, rec.offset, rec.mode, attr_stored_ns(rec.mtime_ns)};
+            free(strmap_remove(&entries, rel));
+            strmap_put(&entries, rel, e);
+            if (rec.pack_id > current_pack)
+                current_pack = rec.pack_id;
+        }
+        else if (rec.type == RECORD_DEL)
+        {
+            free(strmap_remove(&entries, rel));
+        }
+        else if (rec.type == RECORD_DEL_TREE)
+        {
+            remove_tree(rel);
+        }
+    }
+    close(fd);
+    return good;
+}
+
+static void count_live(const char *key, void *value, void *arg)
+{
+    pack_entry_t *e = value;
+    if (e->pack_id < pack_slots)
+        pack_live[e->pack_id] += e->len;
+}
+
+// loadin index of the target, needed before storin or restorin packed files
+int pack_open(const char *target_root)
+{
+    pack_close();
+
+    strncpy(pack_root, target_root, PATH_MAX - 1);
+    pack_root[PATH_MAX - 1] = '\0';
+    size_t len = strlen(pack_root);
+    while (len > 1 && pack_root[len - 1] == '/')
+        pack_root[--len] = '\0';
+
+    if (snprintf(pack_dir, PATH_MAX, "%s/%s", pack_root, META_DIR_NAME) >= PATH_MAX)
+        return -1;
+    mkdir(pack_dir, 0700);
+    if (snprintf(pack_dir, PATH_MAX, "%s/%s/packs", pack_root, META_DIR_NAME) >= PATH_MAX)
+        return -1;
+    if (mkdir(pack_dir, 0700) == -1 && errno != EEXIST)
+        return -1;
+
+    if (strmap_init(&entries) == -1)
+        return -1;
+
+    char path[PATH_MAX];
+    off_t good = -1;
+    index_records = 0;
+    if (snprintf(path, PATH_MAX, "%s/index", pack_dir) >= PATH_MAX || (good = load_index(path)) == -1)
+        return -1;
+    index_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+    if (index_fd == -1)
+        return -1;
+    // records appended behind garbage would never be read again
+    struct stat st;
+    if (fstat(index_fd, &st) == -1 || (st.st_size > good && ftruncate(index_fd, good) == -1))
+        return -1;
+
+    if (snprintf(path, PATH_MAX, "%s/pack-%06u", pack_dir, current_pack) >= PATH_MAX)
+        return -1;
+    current_size = stat(path, &st) == 0 ? st.st_size : 0;
+
+    if (ensure_slot(current_pack) == 0)
+    {
+        for (uint32_t id = 0; id <= current_pack; id++)
+        {
+            if (snprintf(path, PATH_MAX, "%s/pack-%06u", pack_dir, id) < PATH_MAX && stat(path, &st) == 0)
+                pack_sizes[id] = st.st_size;
+        }
+        strmap_foreach(&entries, count_live, NULL);
+    }
+    return 0;
+}
+
+void pack_close(void)
+{
+    strmap_free(&entries, free);
+    if (index_fd != -1)
+        close(index_fd);
+    if (pack_fd != -1)
+        close(pack_fd);
+    index_fd = -1;
+    pack_fd = -1;
+    current_pack = 0;
+    current_size = 0;
+    pack_root[0] = '\0';
+    free(pack_sizes);
+    free(pack_live);
+    pack_sizes = NULL;
+    pack_live = NULL;
+    pack_slots = 0;
+    index_records = 0;
+}
+
+static int write_record(int fd, uint32_t type, const char *rel, const pack_entry_t *e)
+{
+    index_record_t rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.magic = INDEX_MAGIC;
+    rec.type = type;
+    rec.path_len = strlen(rel);
+    if (e)
+    {
+        rec.pack_id = e->pack_id;
+        rec.offset = e->offset;
+        rec.len = e->len;
+        rec.mode = e->mode;
+        rec.mtime_ns = e->mtime_ns;
+    }
+    rec.check = record_check(&rec, rel);
+
+    // one write per record so a crash never leaves half a record in the middle
+    char buf[sizeof(rec) + PATH_MAX];
+    memcpy(buf, &rec, sizeof(rec));
+    memcpy(buf + sizeof(rec), rel, rec.path_len);
+    return bulk_write(fd, buf, sizeof(rec) + rec.path_len) == -1 ? -1 : 0;
+}
+
+static int append_record(uint32_t type, const char *rel, const pack_entry_t *e)
+{
+    if (write_record(index_fd, type, rel, e) == -1)
+        return -1;
+    index_records++;
+    return 0;
+}
+
+// openin pack we append to, startin a new one when current is full
+static int open_current_pack(size_t need)
+{
+    if (pack_fd != -1 && current_size + (off_t)need <= PACK_MAX_SIZE)
+        return 0;
+    char path[PATH_MAX];
+    if (pack_fd != -1)
+    {
+        close(pack_fd);
+        pack_fd = -1;
+        current_pack++;
+        current_size = 0;
+        // no index record points past the current pack, a file there is what a crash left
+        if (snprintf(path, PATH_MAX, "%s/pack-%06u", pack_dir, current_pack) < PATH_MAX)
+            unlink(path);
+    }
+    if (snprintf(path, PATH_MAX, "%s/pack-%06u", pack_dir, current_pack) >= PATH_MAX)
+        return -1;
+    pack_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+    if (pack_fd == -1)
+        return -1;
+    struct stat st;
+    if (fstat(pack_fd, &st) == -1)
+        return -1;
+    current_size = st.st_size;
+    if (current_size + (off_t)need > PACK_MAX_SIZE && current_size > 0)
+        return open_current_pack(need);
+    return 0;
+}
+
+// appendin small file to the pack and recordin where it is
+int pack_store_file(const char *source_path, const char *dest_path, const struct stat *source_stat)
+{
+    const char *rel = relative_path(dest_path);
+    if (!rel || index_fd == -1)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // same size and time as packed copy, and not changed in the current second
+    pack_entry_t *old = strmap_get(&entries, rel);
+    if (old && old->len == (uint64_t)source_stat->st_size && old->mtime_ns == attr_mtime_ns(source_stat) &&
+        old->mode == (source_stat->st_mode & 0777) && source_stat->st_mtime < time(NULL) - 1)
+        return 0;
+
+    char buf[PACK_MAX_FILE];
+    int fd = open(source_path, O_RDONLY);
+    if (fd == -1)
+        return -1;
+    ssize_t len = bulk_read(fd, buf, sizeof(buf));
+    close(fd);
+    if (len < 0)
+        return -1;
+
+    if (open_current_pack(len) == -1)
+        return -1;
+    iosched_charge(len);
+    if (len > 0 && bulk_write(pack_fd, buf, len) == -1)
+        return -1;
+    durable_written(pack_fd);
+
+    pack_entry_t *e = malloc(sizeof(*e));
+    if (!e)
+        return -1;
+    *e = (pack_entry_t){current_pack, len, current_size, source_stat->st_mode & 0777, attr_mtime_ns(source_stat)};
+    current_size += len;
+    if (append_record(RECORD_PUT, rel, e) == -1)
+    {
+        free(e);
+        return -1;
+    }
+    durable_written(index_fd);
+    add_live(e);
+    pack_entry_t *replaced = strmap_remove(&entries, rel);
+    drop_live(replaced);
+    free(replaced);
+    strmap_put(&entries, rel, e);
+
+    // file used to be big and lived as regular file in target
+    unlink(dest_path);
+    return 0;
+}
+
+// forgettin packed file or whole packed dir, after delete or when file grew too big
+void pack_forget(const char *dest_path)
+{
+    const char *rel = relative_path(dest_path);
+    if (!rel || index_fd == -1)
+        return;
+
+    pack_entry_t *e = strmap_remove(&entries, rel);
+    if (e)
+    {
+        drop_live(e);
+        free(e);
+        append_record(RECORD_DEL, rel, NULL);
+        return;
+    }
+    if (remove_tree(rel) > 0)
+        append_record(RECORD_DEL_TREE, rel, NULL);
+}
+
+typedef struct
+{
+    const char *source_root;
+    prefix_match_t *gone;
+} missing_ctx_t;
+
+static void collect_missing(const char *key, void *value, void *arg)
+{
+    missing_ctx_t *ctx = arg;
+    char source_path[PATH_MAX];
+    struct stat st;
+    if (snprintf(source_path, PATH_MAX, "%s/%s", ctx->source_root, key) >= PATH_MAX)
+        return;
+    if (lstat(source_path, &st) == 0 ? S_ISREG(st.st_mode) : errno != ENOENT)
+        return;
+    push_key(ctx->gone, key);
+}
+
+// droppin packed files whose source was deleted while no worker was watchin, returns how many
+size_t pack_forget_missing(const char *source_root)
+{
+    if (index_fd == -1)
+        return 0;
+    prefix_match_t pm = {"", 0, NULL, 0, 0};
+    missing_ctx_t ctx = {source_root, &pm};
+    strmap_foreach(&entries, collect_missing, &ctx);
+    size_t count = 0;
+    for (size_t i = 0; i < pm.count; i++)
+    {
+        if (pm.keys[i])
+        {
+            pack_entry_t *e = strmap_remove(&entries, pm.keys[i]);
+            drop_live(e);
+            free(e);
+            append_record(RECORD_DEL, pm.keys[i], NULL);
+            free(pm.keys[i]);
+            count++;
+        }
+    }
+    free(pm.keys);
+    return count;
+}
+
+// mode or time of a packed file changed, only the index gets a new record
+int pack_update_attrs(const char *dest_path, const struct stat *source_stat)
+{
+    const char *rel = relative_path(dest_path);
+    pack_entry_t *e = rel ? strmap_get(&entries, rel) : NULL;
+    if (!e || index_fd == -1)
+        return -1;
+    e->mode = source_stat->st_mode & 0777;
+    e->mtime_ns = attr_mtime_ns(source_stat);
+    return append_record(RECORD_PUT, rel, e);
+}
+
+int pack_contains(const char *dest_path)
+{
+    const char *rel = relative_path(dest_path);
+    return rel && strmap_get(&entries, rel) != NULL;
+}
+
+typedef struct
+{
+    const char *restore_root;
+    const char *prefix;
+    size_t prefix_len;
+    pack_filter_fn filter;
+    void *arg;
+    int failed;
+} restore_ctx_t;
+
+// writin one packed file back, skipped when the one in place looks the same
+static void restore_entry(const char *rel, void *value, void *arg)
+{
+    restore_ctx_t *ctx = arg;
+    pack_entry_t *e = value;
+
+    if (ctx->prefix_len && (strncmp(rel, ctx->prefix, ctx->prefix_len) != 0 ||
+                            (rel[ctx->prefix_len] != '/' && rel[ctx->prefix_len] != '\0')))
+        return;
+    if (ctx->filter && !ctx->filter(rel, ctx->arg))
+        return;
+
+    char dest[PATH_MAX];
+    if (snprintf(dest, PATH_MAX, "%s%s", ctx->restore_root, rel) >= PATH_MAX)
+        return;
+    struct stat st;
+    if (lstat(dest, &st) == 0 && S_ISREG(st.st_mode) && st.st_size == (off_t)e->len && attr_mtime_ns(&st) == e->mtime_ns)
+        return;
+
+    char path[PATH_MAX], buf[PACK_MAX_FILE];
+    int fd = -1;
+    if (snprintf(path, PATH_MAX, "%s/pack-%06u", pack_dir, e->pack_id) >= PATH_MAX ||
+        (fd = open(path, O_RDONLY)) == -1 || e->len > sizeof(buf) ||
+        pread(fd, buf, e->len, e->offset) != (ssize_t)e->len)
+    {
+        if (fd != -1)
+            close(fd);
+        fprintf(stderr, "Failed to read packed file: %s\n", rel);
+        ctx->failed = 1;
+        return;
+    }
+    close(fd);
+
+    char tmp_path[PATH_MAX];
+    int out = staged_open(dest, e->mode, tmp_path);
+    if (out == -1 || bulk_write(out, buf, e->len) == -1)
+    {
+        if (out != -1)
+            staged_abort(out, tmp_path);
+        fprintf(stderr, "Failed to restore packed file: %s\n", dest);
+        ctx->failed = 1;
+        return;
+    }
+    attr_set_mtime_ns(tmp_path, e->mtime_ns);
+    if (staged_commit(out, tmp_path, dest) == -1)
+    {
+        fprintf(stderr, "Failed to restore packed file: %s\n", dest);
+        ctx->failed = 1;
+        return;
+    }
+    fprintf(stdout, "Restored: %s\n", dest);
+}
+
+// restorin packed files under prefix (like "/sub/dir", empty for all) that pass the filter,
+// a single file is found straight in the index without goin through all entries
+int pack_restore(const char *restore_root, const char *prefix, pack_filter_fn filter, void *arg)
+{
+    restore_ctx_t ctx = {restore_root, prefix, strlen(prefix), filter, arg, 0};
+    void *e = ctx.prefix_len ? strmap_get(&entries, prefix) : NULL;
+    if (e)
+        restore_entry(prefix, e, &ctx);
+    else
+        strmap_foreach(&entries, restore_entry, &ctx);
+    return ctx.failed ? -1 : 0;
+}
+
+typedef struct
+{
+    uint32_t pack_id;
+    prefix_match_t *members;
+} members_ctx_t;
+
+static void collect_members(const char *key, void *value, void *arg)
+{
+    members_ctx_t *ctx = arg;
+    if (((pack_entry_t *)value)->pack_id == ctx->pack_id)
+        push_key(ctx->members, key);
+}
+
+// movin files still in a mostly dead pack to the current one and droppin the pack, packs are
+// never changed in place so snapshots that link the old one keep readin it
+static void compact_pack(uint32_t id)
+{
+    char path[PATH_MAX];
+    if (snprintf(path, PATH_MAX, "%s/pack-%06u", pack_dir, id) >= PATH_MAX)
+        return;
+    prefix_match_t pm = {"", 0, NULL, 0, 0};
+    members_ctx_t ctx = {id, &pm};
+    strmap_foreach(&entries, collect_members, &ctx);
+
+    int fd = pm.count ? open(path, O_RDONLY | O_CLOEXEC) : -1;
+    int ok = !pm.count || fd != -1;
+    size_t moved = 0;
+    off_t moved_bytes = 0;
+    char buf[PACK_MAX_FILE];
+    for (size_t i = 0; i < pm.count && ok; i++)
+    {
+        pack_entry_t *e = pm.keys[i] ? strmap_get(&entries, pm.keys[i]) : NULL;
+        if (!e)
+        {
+            ok = pm.keys[i] != NULL;
+            continue;
+        }
+        if (e->len > sizeof(buf) || pread(fd, buf, e->len, e->offset) != (ssize_t)e->len ||
+            open_current_pack(e->len) == -1 || (e->len && bulk_write(pack_fd, buf, e->len) == -1))
+        {
+            ok = 0;
+            break;
+        }
+        iosched_charge(e->len);
+        pack_entry_t to = *e;
+        to.pack_id = current_pack;
+        to.offset = current_size;
+        current_size += e->len;
+        if (append_record(RECORD_PUT, pm.keys[i], &to) == -1)
+        {
+            ok = 0;
+            break;
+        }
+        drop_live(e);
+        add_live(&to);
+        *e = to;
+        moved++;
+        moved_bytes += to.len;
+    }
+    for (size_t i = 0; i < pm.count; i++)
+        free(pm.keys[i]);
+    free(pm.keys);
+    if (fd != -1)
+        close(fd);
+
+    // moved copies and their records must be on disk before the only other copy goes,
+    // whatever the durability level, those files were safe before compaction touched them
+    if (!ok || (pack_fd != -1 && fsync(pack_fd) == -1) || fsync(index_fd) == -1 ||
+        (unlink(path) == -1 && errno != ENOENT))
+    {
+        fprintf(stderr, "Failed to compact pack %s, leavin it for now\n", path);
+        pack_sizes[id] = 0;
+        return;
+    }
+    fprintf(stdout, "Compacted %s: %zu files moved, %lld KiB freed\n", path, moved,
+            (long long)(pack_sizes[id] - moved_bytes) / 1024);
+    pack_sizes[id] = 0;
+    pack_live[id] = 0;
+}
+
+static void write_entry(const char *key, void *value, void *arg)
+{
+    int *fd = arg;
+    if (*fd != -1 && write_record(*fd, RECORD_PUT, key, value) == -1)
+        *fd = -1;
+}
+
+// rewritin the index log with one record per packed file once most records in it are dead
+static void rewrite_index(void)
+{
+    char path[PATH_MAX], tmp_path[PATH_MAX];
+    if (snprintf(path, PATH_MAX, "%s/index", pack_dir) >= PATH_MAX)
+        return;
+    // a failed try waits till as many dead records piled up again
+    size_t records = index_records;
+    index_records = entries.count;
+
+    int fd = staged_open(path, 0600, tmp_path);
+    if (fd == -1)
+        return;
+    int out = fd;
+    strmap_foreach(&entries, write_entry, &out);
+    // the new log becomes the only record of every packed file, so it is synced at any level,
+    // the appendin fd is opened before the rename so it can't end up on the old log
+    int append_fd = out == -1 || fsync(fd) == -1 ? -1 : open(tmp_path, O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (append_fd == -1)
+    {
+        staged_abort(fd, tmp_path);
+        return;
+    }
+    if (staged_commit(fd, tmp_path, path) == -1)
+    {
+        close(append_fd);
+        return;
+    }
+    close(index_fd);
+    index_fd = append_fd;
+    fprintf(stdout, "Rewrote pack index of %s: %zu records down to %zu\n", pack_root, records, entries.count);
+}
+
+// compactin one mostly dead pack per call and the index when it is mostly dead records,
+// called when the worker is idle
+void pack_tick(void)
+{
+    if (index_fd == -1)
+        return;
+    for (uint32_t id = 0; id < current_pack && id < pack_slots; id++)
+    {
+        if (pack_sizes[id] > 0 && pack_live[id] * PACK_COMPACT_RATIO < pack_sizes[id])
+        {
+            compact_pack(id);
+            break;
+        }
+    }
+    if (index_records > PACK_INDEX_MIN_RECORDS && index_records > PACK_INDEX_SLACK * (entries.count + 1))
+        rewrite_index();
+}
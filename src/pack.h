@@ -0,0 +1,36 @@
+// clang-format off
+#ifndef PACK_H
+#define PACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#define PACK_MAX_FILE 4096
+#define PACK_MAX_SIZE (64LL * 1024 * 1024)
+#define PACK_COMPACT_RATIO 2
+#define PACK_INDEX_SLACK 4
+#define PACK_INDEX_MIN_RECORDS 4096
+
+typedef struct
+{
+    uint32_t pack_id;
+    uint32_t len;
+    uint64_t offset;
+    uint32_t mode;
+    int64_t mtime_ns;
+} pack_entry_t;
+
+typedef int (*pack_filter_fn)(const char *rel, void *arg);
+
+int pack_open(const char *target_root);
+void pack_close(void);
+int pack_store_file(const char *source_path, const char *dest_path, const struct stat *source_stat);
+void pack_forget(const char *dest_path);
+size_t pack_forget_missing(const char *source_root);
+int pack_contains(const char *dest_path);
+int pack_update_attrs(const char *dest_path, const struct stat *source_stat);
+int pack_restore(const char *restore_root, const char *prefix, pack_filter_fn filter, void *arg);
+void pack_tick(void);
+
+#endif
@@ -15,7 +15,7 @@ static void free_tokens(char **tokens, int cnt)
 }
 
 // splitin line into tokens, handles quotes too
-static char **tokenize(const char *line, int *count)
+static char **tokenize(const char *line, int *count, FILE *err)
 {
     if (!line || !count)
         return NULL;
@@ -43,14 +43,16 @@ static char **tokenize(const char *line, int *count)
             break;
 
         char *start = cursor;
-        if (*cursor == '"')
+        if (*cursor == '"' || *cursor == '\'')
         {
+            // single quotes keep globs like '*.cfg' in one token
+            char quote = *cursor;
             start = ++cursor;
-            while (*cursor && *cursor != '"')
+            while (*cursor && *cursor != quote)
                 cursor++;
             if (*cursor == '\0')
             {
-                fprintf(stderr, "Error: unmatched quote in command\n");
+                fprintf(err, "Error: unmatched quote in command\n");
                 free_tokens(tokens, *count);
                 free(copy);
                 return NULL;
@@ -60,9 +62,9 @@ static char **tokenize(const char *line, int *count)
         {
             while (*cursor && !isspace(*cursor))
             {
-                if (*cursor == '"')
+                if (*cursor == '"' || *cursor == '\'')
                 {
-                    fprintf(stderr, "Error: unexpected quote in token\n");
+                    fprintf(err, "Error: unexpected quote in token\n");
                     free_tokens(tokens, *count);
                     free(copy);
                     return NULL;
@@ -91,12 +93,50 @@ static char **tokenize(const char *line, int *count)
     return tokens;
 }
 
+// pullin --name value options out of tokens, leavin only positional ones
+static int extract_options(command_t *cmd, char **tokens, int *cnt, FILE *err)
+{
+    int kept = 0;
+    for (int i = 0; i < *cnt; i++)
+    {
+        if (i == 0 || strncmp(tokens[i], "--", 2) != 0)
+        {
+            tokens[kept++] = tokens[i];
+            continue;
+        }
+        if (i + 1 >= *cnt)
+        {
+            fprintf(err, "Error: option '%s' requires a value\n", tokens[i]);
+            for (int j = i; j < *cnt; j++)
+                free(tokens[j]);
+            *cnt = kept;
+            return -1;
+        }
+        command_option_t *tmp = realloc(cmd->options, sizeof(command_option_t) * (cmd->option_count + 1));
+        if (!tmp)
+        {
+            for (int j = i; j < *cnt; j++)
+                free(tokens[j]);
+            *cnt = kept;
+            return -1;
+        }
+        cmd->options = tmp;
+        cmd->options[cmd->option_count].name = strdup(tokens[i] + 2);
+        cmd->options[cmd->option_count].value = tokens[i + 1];
+        cmd->option_count++;
+        free(tokens[i]);
+        i++;
+    }
+    *cnt = kept;
+    return 0;
+}
+
 // parsin source and target paths from tokens
-static int parse_paths(command_t *cmd, char **tokens, int cnt, int min_args, const char *name)
+static int parse_paths(command_t *cmd, char **tokens, int cnt, int min_args, const char *name, FILE *err)
 {
     if (cnt < min_args)
     {
-        fprintf(stderr, "Error: '%s' requires source and target path(s)\n", name);
+        fprintf(err, "Error: '%s' requires source and target path(s)\n", name);
         return -1;
     }
     cmd->source_path = strdup(tokens[1]);
@@ -108,13 +148,13 @@ static int parse_paths(command_t *cmd, char **tokens, int cnt, int min_args, con
 }
 
 // main parsin function, returns command struct
-command_t *parse_command(const char *line)
+command_t *parse_command(const char *line, FILE *err)
 {
     if (!line)
         return NULL;
 
     int cnt = 0;
-    char **tokens = tokenize(line, &cnt);
+    char **tokens = tokenize(line, &cnt, err);
     if (!tokens || cnt == 0)
     {
         if (tokens)
@@ -129,14 +169,21 @@ command_t *parse_command(const char *line)
         return NULL;
     }
 
+    if (extract_options(cmd, tokens, &cnt, err) < 0)
+    {
+        free_command(cmd);
+        free_tokens(tokens, cnt);
+        return NULL;
+    }
+
     const char *c = tokens[0];
 
     if (strcmp(c, "add") == 0)
     {
         cmd->type = CMD_ADD;
-        if (parse_paths(cmd, tokens, cnt, 3, "add") < 0)
+        if (parse_paths(cmd, tokens, cnt, 3, "add", err) < 0)
         {
-            free(cmd);
+            free_command(cmd);
             free_tokens(tokens, cnt);
             return NULL;
         }
@@ -144,15 +191,17 @@ command_t *parse_command(const char *line)
     else if (strcmp(c, "end") == 0)
     {
         cmd->type = CMD_END;
-        if (parse_paths(cmd, tokens, cnt, 3, "end") < 0)
+        if (parse_paths(cmd, tokens, cnt, 3, "end", err) < 0)
         {
-            free(cmd);
+            free_command(cmd);
             free_tokens(tokens, cnt);
             return NULL;
         }
     }
     else if (strcmp(c, "list") == 0)
         cmd->type = CMD_LIST;
+    else if (strcmp(c, "stats") == 0)
+        cmd->type = CMD_STATS;
     else if (strcmp(c, "help") == 0)
         cmd->type = CMD_HELP;
     else if (strcmp(c, "exit") == 0)
@@ -162,8 +211,8 @@ command_t *parse_command(const char *line)
         cmd->type = CMD_RESTORE;
         if (cnt != 3)
         {
-            fprintf(stderr, "Error: 'restore' requires backup and source path\n");
-            free(cmd);
+            fprintf(err, "Error: 'restore' requires backup and source path\n");
+            free_command(cmd);
             free_tokens(tokens, cnt);
             return NULL;
         }
@@ -172,10 +221,34 @@ command_t *parse_command(const char *line)
         cmd->target_paths[0] = strdup(tokens[1]);
         cmd->source_path = strdup(tokens[2]);
     }
+    else if (strcmp(c, "gc") == 0)
+    {
+        cmd->type = CMD_GC;
+        if (cnt != 2)
+        {
+            fprintf(err, "Error: 'gc' requires backup path\n");
+            free_command(cmd);
+            free_tokens(tokens, cnt);
+            return NULL;
+        }
+        cmd->source_path = strdup(tokens[1]);
+    }
+    else if (strcmp(c, "snapshots") == 0)
+    {
+        cmd->type = CMD_SNAPSHOTS;
+        if (cnt != 2)
+        {
+            fprintf(err, "Error: 'snapshots' requires backup path\n");
+            free_command(cmd);
+            free_tokens(tokens, cnt);
+            return NULL;
+        }
+        cmd->source_path = strdup(tokens[1]);
+    }
     else
     {
         cmd->type = CMD_UNKNOWN;
-        fprintf(stderr, "Error: Unknown command '%s'\n", c);
+        fprintf(err, "Error: Unknown command '%s'\n", c);
     }
 
     free_tokens(tokens, cnt);
@@ -190,5 +263,11 @@ void free_command(command_t *cmd)
     for (int i = 0; i < cmd->target_count; i++)
         free(cmd->target_paths[i]);
     free(cmd->target_paths);
+    for (int i = 0; i < cmd->option_count; i++)
+    {
+        free(cmd->options[i].name);
+        free(cmd->options[i].value);
+    }
+    free(cmd->options);
     free(cmd);
 }
@@ -2,6 +2,8 @@
 #ifndef PARSER_H
 #define PARSER_H
 
+#include <stdio.h>
+
 typedef enum
 {
     CMD_ADD,
@@ -9,19 +11,30 @@ typedef enum
     CMD_LIST,
     CMD_HELP,
     CMD_RESTORE,
+    CMD_GC,
+    CMD_SNAPSHOTS,
+    CMD_STATS,
     CMD_EXIT,
     CMD_UNKNOWN
 } command_type_t;
 
+typedef struct
+{
+    char *name;
+    char *value;
+} command_option_t;
+
 typedef struct
 {
     command_type_t type;
     char *source_path;
     char **target_paths;
     int target_count;
+    command_option_t *options;
+    int option_count;
 } command_t;
 
-command_t *parse_command(const char *line);
+command_t *parse_command(const char *line, FILE *err);
 void free_command(command_t *cmd);
 
 #endif
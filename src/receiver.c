@@ -0,0 +1,664 @@
+// clang-format off
+#define _GNU_SOURCE
+#include "receiver.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "signals.h"
+#include "strmap.h"
+#include "walk.h"
+#include "wire.h"
+
+#define RECV_ACK_EVERY 256
+#define RECV_NSEC 1000000000LL
+
+// one connected sender, frames are applied in order and acked once its input runs dry
+typedef struct
+{
+    int fd;
+    // the sender's own dir under the receive dir, set by its hello
+    char root[PATH_MAX];
+    int root_fd;
+    char space[NAME_MAX + 1];
+    uint8_t in[RECV_BUF_LEN];
+    size_t in_len;
+    size_t in_pos;
+    uint8_t out[RECV_OUT_LEN];
+    size_t out_len;
+    int pipe_fd[2];
+    int no_splice;
+    int dead;
+    uint64_t last_seq;
+    uint64_t acked_seq;
+    // paths the sender still has, collected between scan and prune
+    strmap_t seen;
+    int scanning;
+    int seen_lost;
+} session_t;
+
+// dirs claimed by connected senders, one sender per dir so a prune never sees
+// files another sender is still writin
+static strmap_t spaces;
+static pthread_mutex_t spaces_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int write_full(int fd, const uint8_t *buf, size_t len)
+{
+    while (len)
+    {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void flush_out(session_t *s)
+{
+    if (s->out_len && write_full(s->fd, s->out, s->out_len) == -1)
+        s->dead = 1;
+    s->out_len = 0;
+}
+
+static void queue_reply(session_t *s, int op, uint64_t seq, const char *path, uint64_t size)
+{
+    size_t path_len = strlen(path);
+    if (s->out_len + WIRE_HEADER_LEN + path_len > RECV_OUT_LEN)
+        flush_out(s);
+    wire_frame_t frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.op = op;
+    frame.seq = seq;
+    frame.path_len = path_len;
+    frame.size = size;
+    wire_encode(s->out + s->out_len, &frame);
+    memcpy(s->out + s->out_len + WIRE_HEADER_LEN, path, path_len);
+    s->out_len += WIRE_HEADER_LEN + path_len;
+}
+
+static void send_ack(session_t *s)
+{
+    if (s->last_seq > s->acked_seq)
+    {
+        queue_reply(s, WIRE_ACK, s->last_seq, "", 0);
+        s->acked_seq = s->last_seq;
+    }
+    flush_out(s);
+}
+
+// readin more from the sender, when everythin so far is applied it gets acked first
+static int fill(session_t *s)
+{
+    if (s->in_pos == s->in_len)
+    {
+        s->in_pos = s->in_len = 0;
+        send_ack(s);
+    }
+    else if (s->in_pos)
+    {
+        memmove(s->in, s->in + s->in_pos, s->in_len - s->in_pos);
+        s->in_len -= s->in_pos;
+        s->in_pos = 0;
+    }
+    for (;;)
+    {
+        ssize_t got = read(s->fd, s->in + s->in_len, RECV_BUF_LEN - s->in_len);
+        if (got == -1 && errno == EINTR)
+            continue;
+        if (got <= 0)
+        {
+            s->dead = 1;
+            return -1;
+        }
+        s->in_len += got;
+        return 0;
+    }
+}
+
+static int need(session_t *s, size_t len)
+{
+    while (s->in_len - s->in_pos < len)
+    {
+        if (fill(s) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+// movin size payload bytes into out_fd, or droppin them when out_fd is -1 or a write failed,
+// the whole payload is always consumed so the next frame starts where it should
+static int take_payload(session_t *s, int out_fd, uint64_t size)
+{
+    int err = 0;
+    while (size > 0)
+    {
+        size_t have = s->in_len - s->in_pos;
+        if (have == 0 && out_fd != -1 && !err && !s->no_splice && size >= RECV_SPLICE_MIN)
+        {
+            // nothin buffered, the rest of a big file goes socket -> pipe -> file inside the kernel
+            ssize_t n = splice(s->fd, NULL, s->pipe_fd[1], NULL, size < RECV_SPLICE_LEN ? size : RECV_SPLICE_LEN,
+                               SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n == -1 && errno == EINVAL)
+            {
+                s->no_splice = 1;
+                continue;
+            }
+            if (n <= 0)
+            {
+                s->dead = 1;
+                return -1;
+            }
+            size -= n;
+            while (n > 0)
+            {
+                ssize_t moved = splice(s->pipe_fd[0], NULL, out_fd, NULL, n, SPLICE_F_MOVE);
+                if (moved == -1 && errno == EINTR)
+                    continue;
+                if (moved <= 0)
+                {
+                    err = moved == -1 ? errno : EIO;
+                    // emptyin the pipe so the rest of the stream stays in order
+                    char scratch[4096];
+                    while (n > 0)
+                    {
+                        ssize_t got = read(s->pipe_fd[0], scratch, (size_t)n < sizeof(scratch) ? (size_t)n : sizeof(scratch));
+                        if (got <= 0)
+                        {
+                            s->dead = 1;
+                            return -1;
+                        }
+                        n -= got;
+                    }
+                    break;
+                }
+                n -= moved;
+            }
+            continue;
+        }
+        if (have == 0)
+        {
+            if (fill(s) == -1)
+                return -1;
+            continue;
+        }
+        size_t take = have < size ? have : size;
+        if (out_fd != -1 && !err && write_full(out_fd, s->in + s->in_pos, take) == -1)
+            err = errno ? errno : EIO;
+        s->in_pos += take;
+        size -= take;
+    }
+    return err;
+}
+
+static void frame_times(const wire_frame_t *frame, struct timespec ts[2])
+{
+    ts[0].tv_sec = frame->atime_ns / RECV_NSEC;
+    ts[0].tv_nsec = frame->atime_ns % RECV_NSEC;
+    ts[1].tv_sec = frame->mtime_ns / RECV_NSEC;
+    ts[1].tv_nsec = frame->mtime_ns % RECV_NSEC;
+}
+
+// owner is only copied when we run as root, like the local backup does, an empty name is dir_fd itself
+static void set_owner(int dir_fd, const char *name, const char *path, const wire_frame_t *frame)
+{
+    if (geteuid() == 0 &&
+        fchownat(dir_fd, name, frame->uid, frame->gid, AT_SYMLINK_NOFOLLOW | AT_EMPTY_PATH) == -1)
+        perror(path);
+}
+
+static int full_path(const session_t *s, const char *rel, char *out)
+{
+    if (snprintf(out, PATH_MAX, "%s%s%s", s->root, *rel ? "/" : "", rel) >= PATH_MAX)
+        return ENAMETOOLONG;
+    return 0;
+}
+
+// openin the dir that holds rel one component at a time from the sender's dir, a symlink or
+// anythin else that is not a dir on the way is refused so no frame reaches outside it,
+// missin dirs are made when create is set (dirs usually come before their files, not always)
+static int open_parent(const session_t *s, const char *rel, int create, const char **name)
+{
+    int fd = fcntl(s->root_fd, F_DUPFD_CLOEXEC, 0);
+    const char *p = rel;
+    const char *slash;
+    while (fd != -1 && (slash = strchr(p, '/')))
+    {
+        char part[NAME_MAX + 1];
+        size_t len = slash - p;
+        if (len > NAME_MAX)
+        {
+            close(fd);
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        memcpy(part, p, len);
+        part[len] = '\0';
+        int next = openat(fd, part, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (next == -1 && errno == ENOENT && create && (mkdirat(fd, part, 0755) == 0 || errno == EEXIST))
+            next = openat(fd, part, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        fd = next;
+        p = slash + 1;
+    }
+    *name = *p ? p : ".";
+    return fd;
+}
+
+// contents go first, each relative to its dir fd, returns 0 or the errno of the last rmdir
+static int remove_tree(int dir_fd, const char *name, const char *path)
+{
+    struct stat st;
+    if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+        return errno == ENOENT ? 0 : errno;
+    if (!S_ISDIR(st.st_mode))
+        return unlinkat(dir_fd, name, 0) == -1 && errno != ENOENT ? errno : 0;
+
+    walk_tree_t tree;
+    if (walk_tree_open(&tree, dir_fd, name, path, NULL) == -1)
+        return unlinkat(dir_fd, name, AT_REMOVEDIR) == -1 && errno != ENOENT ? errno : 0;
+    int err = 0;
+    int step;
+    while ((step = walk_tree_next(&tree)) > 0)
+    {
+        if (step == WALK_ENTRY && tree.type == DT_DIR && walk_tree_enter(&tree) == 0)
+            continue;
+        err = unlinkat(tree.dir_fd, tree.name, tree.type == DT_DIR ? AT_REMOVEDIR : 0) == -1 && errno != ENOENT
+                  ? errno
+                  : 0;
+    }
+    walk_tree_close(&tree);
+    return err;
+}
+
+// temp name next to the entry, so the rename that publishes it stays in one dir
+static void temp_name(const wire_frame_t *frame, char *tmp)
+{
+    snprintf(tmp, NAME_MAX + 1, RECV_TMP_PREFIX "%llu", (unsigned long long)frame->seq);
+}
+
+static int apply_file(session_t *s, const wire_frame_t *frame, int dir_fd, const char *name, const char *dest)
+{
+    char tmp[NAME_MAX + 1];
+    temp_name(frame, tmp);
+    unlinkat(dir_fd, tmp, 0);
+    int fd = openat(dir_fd, tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd == -1)
+    {
+        int err = errno;
+        return take_payload(s, -1, frame->size) == -1 ? -1 : err;
+    }
+
+    int err = take_payload(s, fd, frame->size);
+    if (err == 0)
+    {
+        struct timespec ts[2];
+        frame_times(frame, ts);
+        if (fchmod(fd, frame->mode & 07777) == -1 || futimens(fd, ts) == -1)
+            err = errno;
+        set_owner(fd, "", dest, frame);
+    }
+    close(fd);
+
+    struct stat st;
+    if (err == 0 && fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode))
+        remove_tree(dir_fd, name, dest);
+    if (err == 0 && renameat(dir_fd, tmp, dir_fd, name) == -1)
+        err = errno;
+    if (err != 0)
+        unlinkat(dir_fd, tmp, 0);
+    return err;
+}
+
+static int apply_symlink(session_t *s, const wire_frame_t *frame, int dir_fd, const char *name, const char *dest)
+{
+    if (frame->size >= PATH_MAX || need(s, frame->size) == -1)
+        return -1;
+    char link_buf[PATH_MAX];
+    memcpy(link_buf, s->in + s->in_pos, frame->size);
+    link_buf[frame->size] = '\0';
+    s->in_pos += frame->size;
+
+    char tmp[NAME_MAX + 1];
+    temp_name(frame, tmp);
+    unlinkat(dir_fd, tmp, 0);
+    if (symlinkat(link_buf, dir_fd, tmp) == -1)
+        return errno;
+
+    struct timespec ts[2];
+    frame_times(frame, ts);
+    set_owner(dir_fd, tmp, dest, frame);
+    utimensat(dir_fd, tmp, ts, AT_SYMLINK_NOFOLLOW);
+    struct stat st;
+    if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode))
+        remove_tree(dir_fd, name, dest);
+    if (renameat(dir_fd, tmp, dir_fd, name) == -1)
+    {
+        int err = errno;
+        unlinkat(dir_fd, tmp, 0);
+        return err;
+    }
+    return 0;
+}
+
+static int apply_mkdir(const wire_frame_t *frame, int dir_fd, const char *name, const char *dest)
+{
+    // a file or link where the dir goes is replaced
+    struct stat st;
+    if (mkdirat(dir_fd, name, 0700) == -1)
+    {
+        int err = errno;
+        if (err == EEXIST && fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && !S_ISDIR(st.st_mode))
+            err = remove_tree(dir_fd, name, dest) == 0 && mkdirat(dir_fd, name, 0700) == 0 ? 0 : EEXIST;
+        else if (err == EEXIST)
+            err = 0;
+        if (err)
+            return err;
+    }
+    int fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1)
+        return errno;
+    int err = fchmod(fd, frame->mode & 07777) == -1 ? errno : 0;
+    set_owner(fd, "", dest, frame);
+    close(fd);
+    return err;
+}
+
+static int apply_attr(const wire_frame_t *frame, int dir_fd, const char *name, const char *dest)
+{
+    struct stat st;
+    if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+        return errno == ENOENT ? 0 : errno;
+    if (!S_ISLNK(st.st_mode) && fchmodat(dir_fd, name, frame->mode & 07777, 0) == -1)
+        return errno;
+    set_owner(dir_fd, name, dest, frame);
+    struct timespec ts[2];
+    frame_times(frame, ts);
+    if (utimensat(dir_fd, name, ts, AT_SYMLINK_NOFOLLOW) == -1)
+        return errno;
+    return 0;
+}
+
+// sender has this file, we ask for it unless our copy has the same size and time
+static int apply_have(session_t *s, const wire_frame_t *frame, const char *rel, int dir_fd, const char *name)
+{
+    struct stat st;
+    if (dir_fd != -1 && fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(st.st_mode) &&
+        (uint64_t)st.st_size == frame->size && st.st_mtim.tv_sec * RECV_NSEC + st.st_mtim.tv_nsec == frame->mtime_ns)
+    {
+        if ((st.st_mode & 07777) != (frame->mode & 07777))
+            fchmodat(dir_fd, name, frame->mode & 07777, 0);
+        return 0;
+    }
+    queue_reply(s, WIRE_NEED, frame->seq, rel, 0);
+    return 0;
+}
+
+// droppin everythin under the sender's dir the last scan did not mention
+static void prune_dir(session_t *s)
+{
+    walk_tree_t tree;
+    if (walk_tree_open(&tree, s->root_fd, ".", s->root, NULL) == -1)
+        return;
+    int step;
+    while ((step = walk_tree_next(&tree)) > 0)
+    {
+        if (step == WALK_LEAVE)
+            continue;
+        if (!strmap_get(&s->seen, tree.rel))
+            remove_tree(tree.dir_fd, tree.name, tree.path);
+        else if (tree.type == DT_DIR)
+            walk_tree_enter(&tree);
+    }
+    walk_tree_close(&tree);
+}
+
+// takin the dir the sender named for this session, a second sender for it is turned away
+static int claim_space(session_t *s, const char *name)
+{
+    if (!wire_valid_path(name, 0) || strchr(name, '/') || strlen(name) > NAME_MAX)
+        return EINVAL;
+    pthread_mutex_lock(&spaces_lock);
+    int err = strmap_get(&spaces, name) ? EBUSY : strmap_put(&spaces, name, s) == -1 ? ENOMEM : 0;
+    pthread_mutex_unlock(&spaces_lock);
+    if (err)
+        return err;
+    snprintf(s->space, sizeof(s->space), "%s", name);
+
+    int fd = -1;
+    size_t len = strlen(s->root);
+    if (snprintf(s->root + len, PATH_MAX - len, "/%s", name) >= (int)(PATH_MAX - len))
+        err = ENAMETOOLONG;
+    else if (mkdirat(s->root_fd, name, 0755) == -1 && errno != EEXIST)
+        err = errno;
+    else if ((fd = openat(s->root_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) == -1)
+        err = errno;
+    if (err)
+        return err;
+    close(s->root_fd);
+    s->root_fd = fd;
+    return 0;
+}
+
+static void release_space(session_t *s)
+{
+    if (!s->space[0])
+        return;
+    pthread_mutex_lock(&spaces_lock);
+    strmap_remove(&spaces, s->space);
+    pthread_mutex_unlock(&spaces_lock);
+}
+
+static void end_scan(session_t *s)
+{
+    if (s->scanning)
+        strmap_free(&s->seen, NULL);
+    s->scanning = 0;
+    s->seen_lost = 0;
+}
+
+// applyin one frame, returns 0, an errno to report back, or -1 when the session is over
+static int apply(session_t *s, const wire_frame_t *frame, const char *rel)
+{
+    char dest[PATH_MAX];
+    // nothin is applied before the sender said hello and got its dir
+    if (frame->op != WIRE_HELLO && !s->space[0])
+        return -1;
+    switch (frame->op)
+    {
+        case WIRE_HELLO:
+        {
+            int err = s->space[0] ? EPROTO : frame->mode != WIRE_VERSION ? EPROTONOSUPPORT : claim_space(s, rel);
+            if (err)
+            {
+                fprintf(stderr, "Cannot accept sender for '%s': %s\n", rel, strerror(err));
+                queue_reply(s, WIRE_FAIL, frame->seq, rel, err);
+                flush_out(s);
+                return -1;
+            }
+            return 0;
+        }
+        case WIRE_SCAN:
+            end_scan(s);
+            if (strmap_init(&s->seen) == 0)
+                s->scanning = 1;
+            return 0;
+        case WIRE_PRUNE:
+            if (s->scanning && !s->seen_lost)
+                prune_dir(s);
+            end_scan(s);
+            return 0;
+        case WIRE_SYNC:
+            return syncfs(s->root_fd) == -1 ? errno : 0;
+        case WIRE_HAVE:
+        case WIRE_MKDIR:
+        case WIRE_FILE:
+        case WIRE_SYMLINK:
+        case WIRE_REMOVE:
+        case WIRE_ATTR:
+            break;
+        default:
+            return -1;
+    }
+
+    int payload = frame->op == WIRE_FILE || frame->op == WIRE_SYMLINK;
+    int allow_root = frame->op == WIRE_MKDIR || frame->op == WIRE_ATTR;
+    int create = frame->op == WIRE_MKDIR || frame->op == WIRE_FILE || frame->op == WIRE_SYMLINK;
+    int err = wire_valid_path(rel, allow_root) ? full_path(s, rel, dest) : EINVAL;
+    if (err)
+        return payload && take_payload(s, -1, frame->size) == -1 ? -1 : err;
+    if (s->scanning && frame->op != WIRE_REMOVE && frame->op != WIRE_ATTR && *rel && !strmap_get(&s->seen, rel) &&
+        strmap_put(&s->seen, rel, s) == -1)
+        s->seen_lost = 1;
+
+    const char *name;
+    int dir_fd = open_parent(s, rel, create, &name);
+    if (dir_fd == -1)
+    {
+        err = errno;
+        // under a missin parent there is nothin to remove or update, and a file to ask for
+        if (!create && (err == ENOENT || err == ENOTDIR))
+            return frame->op == WIRE_HAVE ? apply_have(s, frame, rel, -1, NULL) : 0;
+        return payload && take_payload(s, -1, frame->size) == -1 ? -1 : err;
+    }
+
+    switch (frame->op)
+    {
+        case WIRE_HAVE:
+            err = apply_have(s, frame, rel, dir_fd, name);
+            break;
+        case WIRE_MKDIR:
+            err = apply_mkdir(frame, dir_fd, name, dest);
+            break;
+        case WIRE_FILE:
+            err = apply_file(s, frame, dir_fd, name, dest);
+            break;
+        case WIRE_SYMLINK:
+            err = apply_symlink(s, frame, dir_fd, name, dest);
+            break;
+        case WIRE_REMOVE:
+            err = remove_tree(dir_fd, name, dest);
+            break;
+        default:
+            err = apply_attr(frame, dir_fd, name, dest);
+            break;
+    }
+    close(dir_fd);
+    return err;
+}
+
+static void *session_main(void *arg)
+{
+    session_t *s = arg;
+    unsigned long long applied = 0;
+    fprintf(stdout, "Sender connected\n");
+    while (!s->dead)
+    {
+        if (need(s, WIRE_HEADER_LEN) == -1)
+            break;
+        wire_frame_t frame;
+        wire_decode(s->in + s->in_pos, &frame);
+        if (frame.path_len >= PATH_MAX || need(s, WIRE_HEADER_LEN + frame.path_len) == -1)
+            break;
+        char rel[PATH_MAX];
+        memcpy(rel, s->in + s->in_pos + WIRE_HEADER_LEN, frame.path_len);
+        rel[frame.path_len] = '\0';
+        s->in_pos += WIRE_HEADER_LEN + frame.path_len;
+
+        int ret = apply(s, &frame, rel);
+        if (ret == -1)
+            break;
+        if (ret > 0)
+        {
+            fprintf(stderr, "Cannot apply '%s': %s\n", rel, strerror(ret));
+            queue_reply(s, WIRE_FAIL, frame.seq, rel, ret);
+        }
+        s->last_seq = frame.seq;
+        applied++;
+        // sync and hello are waited on by the sender, the rest is acked in bulk
+        if (frame.op == WIRE_SYNC || frame.op == WIRE_HELLO || s->last_seq - s->acked_seq >= RECV_ACK_EVERY)
+            send_ack(s);
+    }
+    fprintf(stdout, "Sender disconnected after %llu changes\n", applied);
+
+    end_scan(s);
+    release_space(s);
+    close(s->pipe_fd[0]);
+    close(s->pipe_fd[1]);
+    close(s->root_fd);
+    close(s->fd);
+    free(s);
+    return NULL;
+}
+
+static int start_session(int fd, const char *root)
+{
+    session_t *s = calloc(1, sizeof(session_t));
+    if (!s)
+        return -1;
+    s->fd = fd;
+    snprintf(s->root, PATH_MAX, "%s", root);
+    s->root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (s->root_fd == -1 || pipe2(s->pipe_fd, O_CLOEXEC) == -1)
+    {
+        if (s->root_fd != -1)
+            close(s->root_fd);
+        free(s);
+        return -1;
+    }
+    fcntl(s->pipe_fd[1], F_SETPIPE_SZ, RECV_SPLICE_LEN);
+
+    pthread_attr_t attr;
+    pthread_t thread;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int ret = pthread_create(&thread, &attr, session_main, s);
+    pthread_attr_destroy(&attr);
+    if (ret != 0)
+    {
+        close(s->pipe_fd[0]);
+        close(s->pipe_fd[1]);
+        close(s->root_fd);
+        free(s);
+        return -1;
+    }
+    return 0;
+}
+
+// acceptin senders until a signal, each one is served on its own thread
+int recv_serve(int listen_fd, const char *root)
+{
+    if (strmap_init(&spaces) == -1)
+        return -1;
+    while (!should_exit)
+    {
+        struct pollfd p = {listen_fd, POLLIN, 0};
+        if (poll(&p, 1, RECV_POLL_MS) <= 0)
+            continue;
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd == -1)
+            continue;
+        if (start_session(fd, root) == -1)
+        {
+            perror("Cannot start session");
+            close(fd);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,14 @@
+// clang-format off
+#ifndef RECEIVER_H
+#define RECEIVER_H
+
+#define RECV_BUF_LEN (256 * 1024)
+#define RECV_OUT_LEN (64 * 1024)
+#define RECV_SPLICE_MIN (64 * 1024)
+#define RECV_SPLICE_LEN (1024 * 1024)
+#define RECV_TMP_PREFIX ".sop-recv."
+#define RECV_POLL_MS 500
+
+int recv_serve(int listen_fd, const char *root);
+
+#endif
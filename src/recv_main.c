@@ -0,0 +1,77 @@
+// clang-format off
+#define _GNU_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "receiver.h"
+#include "signals.h"
+#include "wire.h"
+
+volatile sig_atomic_t should_exit = 0;
+
+static void signal_handler(int signo)
+{
+    (void)signo;
+    should_exit = 1;
+}
+
+// receiver has no manager to clean up, so it only needs the flag and no SIGPIPE
+static void setup_receiver_signals(void)
+{
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = signal_handler;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGINT, &sa, NULL) == -1 || sigaction(SIGTERM, &sa, NULL) == -1)
+        perror("sigaction");
+    sa.sa_handler = SIG_IGN;
+    if (sigaction(SIGPIPE, &sa, NULL) == -1)
+        perror("sigaction SIGPIPE");
+}
+
+// sop-backup-recv unix:<socket>|tcp:[<host>:]<port> <dir>, applies streamed backups under dir
+int main(int argc, char *argv[])
+{
+    if (argc != 3 || !wire_is_endpoint(argv[1]))
+    {
+        fprintf(stderr, "Usage: %s unix:<socket>|tcp:[<host>:]<port> <dir>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    setup_receiver_signals();
+    // session threads log too, whole lines keep them readable
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    if (mkdir(argv[2], 0755) == -1 && errno != EEXIST)
+    {
+        perror("Cannot create receive directory");
+        return EXIT_FAILURE;
+    }
+    char *root = realpath(argv[2], NULL);
+    if (!root)
+    {
+        perror("Cannot resolve receive directory");
+        return EXIT_FAILURE;
+    }
+
+    int listen_fd = wire_listen(argv[1]);
+    if (listen_fd == -1)
+    {
+        perror("Cannot listen");
+        free(root);
+        return EXIT_FAILURE;
+    }
+
+    fprintf(stdout, "Receiving on %s into %s\n", argv[1], root);
+    if (recv_serve(listen_fd, root) == -1)
+        perror("Cannot serve senders");
+
+    close(listen_fd);
+    wire_unlink(argv[1]);
+    free(root);
+    fprintf(stdout, "Receiver stopped\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,547 @@
+// clang-format off
+#define _GNU_SOURCE
+#include "replicate.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "attr.h"
+#include "backup.h"
+#include "epoch.h"
+#include "filter.h"
+#include "hash.h"
+#include "iosched.h"
+#include "walk.h"
+#include "wire.h"
+
+// connection of this process to its receiver, frames are queued in batch and go out
+// together, replies (acks and requests for files) are read whenever the socket is waited on
+static int sock = -1;
+static int broken;
+static char root[PATH_MAX];
+static size_t root_len;
+static uint8_t batch[REPL_BATCH_LEN];
+static size_t batch_len;
+static uint8_t replies[REPL_REPLY_LEN];
+static size_t reply_len;
+static uint8_t inline_buf[REPL_INLINE_MAX];
+static uint64_t next_seq;
+static uint64_t acked_seq;
+static int dirty;
+static int64_t last_sync_ms;
+
+// files the receiver asked for after a scan, sent once the scan is through
+static char **needs;
+static size_t need_count;
+static size_t need_cap;
+
+static int64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static int fail(const char *what)
+{
+    if (!broken)
+        fprintf(stderr, "Replication to receiver failed, %s: %s\n", what, strerror(errno));
+    broken = 1;
+    return -1;
+}
+
+static int push_need(const char *path)
+{
+    if (need_count == need_cap)
+    {
+        size_t cap = need_cap ? need_cap * 2 : 64;
+        char **tmp = realloc(needs, cap * sizeof(char *));
+        if (!tmp)
+            return -1;
+        needs = tmp;
+        need_cap = cap;
+    }
+    needs[need_count] = strdup(path);
+    if (!needs[need_count])
+        return -1;
+    need_count++;
+    return 0;
+}
+
+// takin whatever replies are waitin, never blocks
+static int read_replies(void)
+{
+    for (;;)
+    {
+        ssize_t got = read(sock, replies + reply_len, REPL_REPLY_LEN - reply_len);
+        if (got == -1 && errno == EINTR)
+            continue;
+        if (got == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (got == -1)
+            return fail("read");
+        if (got == 0)
+        {
+            errno = ECONNRESET;
+            return fail("receiver closed connection");
+        }
+        reply_len += got;
+
+        size_t pos = 0;
+        while (reply_len - pos >= WIRE_HEADER_LEN)
+        {
+            wire_frame_t frame;
+            wire_decode(replies + pos, &frame);
+            if (frame.path_len >= PATH_MAX)
+            {
+                errno = EPROTO;
+                return fail("bad reply");
+            }
+            if (reply_len - pos < WIRE_HEADER_LEN + (size_t)frame.path_len)
+                break;
+            char path[PATH_MAX];
+            memcpy(path, replies + pos + WIRE_HEADER_LEN, frame.path_len);
+            path[frame.path_len] = '\0';
+            pos += WIRE_HEADER_LEN + frame.path_len;
+
+            if (frame.op == WIRE_ACK && frame.seq > acked_seq)
+                acked_seq = frame.seq;
+            else if (frame.op == WIRE_NEED && push_need(path) == -1)
+                return fail("out of memory");
+            else if (frame.op == WIRE_FAIL)
+                fprintf(stderr, "Receiver could not apply '%s': %s\n", path, strerror((int)frame.size));
+        }
+        memmove(replies, replies + pos, reply_len - pos);
+        reply_len -= pos;
+    }
+}
+
+// waitin until the socket takes more data or replies come, replies are always read
+// so a receiver blocked on sendin them never deadlocks with us
+static int wait_io(short events)
+{
+    struct pollfd p = {sock, events | POLLIN, 0};
+    int ret = poll(&p, 1, REPL_TIMEOUT_MS);
+    if (ret == -1)
+        return errno == EINTR ? 0 : fail("poll");
+    if (ret == 0)
+    {
+        errno = ETIMEDOUT;
+        return fail("receiver not respondin");
+    }
+    if (p.revents & (POLLIN | POLLHUP | POLLERR))
+        return read_replies();
+    return 0;
+}
+
+static int write_all(const uint8_t *buf, size_t len)
+{
+    while (len)
+    {
+        if (broken)
+            return -1;
+        ssize_t n = write(sock, buf, len);
+        if (n > 0)
+        {
+            buf += n;
+            len -= n;
+            continue;
+        }
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            if (wait_io(POLLOUT) == -1)
+                return -1;
+            continue;
+        }
+        return fail("write");
+    }
+    return 0;
+}
+
+static int flush_batch(void)
+{
+    int ret = write_all(batch, batch_len);
+    batch_len = 0;
+    return ret;
+}
+
+// queuein one frame, the batch is flushed first when it would not fit and
+// we stop for acks when too many frames are still unapplied
+static int put_frame(wire_frame_t *frame, const char *rel, const void *payload, size_t len)
+{
+    if (broken)
+        return -1;
+    size_t path_len = strlen(rel);
+    size_t need = WIRE_HEADER_LEN + path_len + len;
+    if (batch_len + need > REPL_BATCH_LEN && flush_batch() == -1)
+        return -1;
+    while (next_seq - acked_seq > REPL_WINDOW)
+    {
+        if ((batch_len && flush_batch() == -1) || wait_io(0) == -1)
+            return -1;
+    }
+
+    frame->seq = next_seq++;
+    frame->path_len = path_len;
+    if (payload)
+        frame->size = len;
+    wire_encode(batch + batch_len, frame);
+    memcpy(batch + batch_len + WIRE_HEADER_LEN, rel, path_len);
+    if (len)
+        memcpy(batch + batch_len + WIRE_HEADER_LEN + path_len, payload, len);
+    batch_len += need;
+    dirty = 1;
+    return 0;
+}
+
+static void frame_from_stat(wire_frame_t *frame, int op, const struct stat *st)
+{
+    memset(frame, 0, sizeof(*frame));
+    frame->op = op;
+    frame->mode = st->st_mode;
+    frame->uid = st->st_uid;
+    frame->gid = st->st_gid;
+    frame->atime_ns = st->st_atim.tv_sec * NSEC_PER_SEC + st->st_atim.tv_nsec;
+    frame->mtime_ns = attr_mtime_ns(st);
+}
+
+static const char *rel_path(const char *source_path)
+{
+    if (strncmp(source_path, root, root_len) != 0 || (source_path[root_len] && source_path[root_len] != '/'))
+        return NULL;
+    const char *rel = source_path + root_len;
+    while (*rel == '/')
+        rel++;
+    return rel;
+}
+
+// small files ride in the batch, big ones go straight from the page cache with sendfile
+static int send_file(const char *source_path, const char *rel)
+{
+    int64_t started = epoch_now();
+    int fd = open(source_path, O_RDONLY | O_CLOEXEC);
+    // gone or unreadable files are skipped like in a local copy, the stream goes on
+    if (fd == -1)
+    {
+        if (errno != ENOENT)
+            perror(source_path);
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+    {
+        close(fd);
+        return 0;
+    }
+
+    wire_frame_t frame;
+    frame_from_stat(&frame, WIRE_FILE, &st);
+    if (st.st_size <= REPL_INLINE_MAX)
+    {
+        ssize_t got = bulk_read(fd, (char *)inline_buf, st.st_size);
+        close(fd);
+        if (got == -1)
+            return 0;
+        iosched_charge(got);
+        if (put_frame(&frame, rel, inline_buf, got) == -1)
+            return -1;
+        if (got == st.st_size)
+            epoch_copied(source_path, &st, started);
+        return 0;
+    }
+
+    frame.size = st.st_size;
+    if (put_frame(&frame, rel, NULL, 0) == -1 || flush_batch() == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    off_t off = 0;
+    int padded = 0;
+    while (off < st.st_size && !broken)
+    {
+        size_t chunk = st.st_size - off < IOSCHED_CHARGE_LEN ? st.st_size - off : IOSCHED_CHARGE_LEN;
+        ssize_t n = sendfile(sock, fd, &off, chunk);
+        if (n > 0)
+        {
+            iosched_charge(n);
+            continue;
+        }
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            wait_io(POLLOUT);
+            continue;
+        }
+        if (n == -1)
+            fail("sendfile");
+        // file shrank while sendin, the frame still has to be full length, the change
+        // event that follows sends it again
+        memset(inline_buf, 0, sizeof(inline_buf));
+        padded = 1;
+        while (off < st.st_size && !broken)
+        {
+            size_t pad = st.st_size - off < REPL_INLINE_MAX ? st.st_size - off : REPL_INLINE_MAX;
+            write_all(inline_buf, pad);
+            off += pad;
+        }
+    }
+    close(fd);
+    if (!broken && !padded)
+        epoch_copied(source_path, &st, started);
+    return broken ? -1 : 0;
+}
+
+// sendin one entry, in a scan regular files are only announced with size and time
+// and the receiver asks for the ones it does not have, returns 1 for a dir to go into
+static int send_entry(const char *source_path, const char *rel, const struct stat *st, int scan)
+{
+    if (filter_excluded(source_path, S_ISDIR(st->st_mode)))
+        return 0;
+
+    wire_frame_t frame;
+    frame_from_stat(&frame, WIRE_MKDIR, st);
+    if (S_ISREG(st->st_mode))
+    {
+        if (!scan)
+            return send_file(source_path, rel);
+        frame.op = WIRE_HAVE;
+        frame.size = st->st_size;
+        return put_frame(&frame, rel, NULL, 0);
+    }
+    if (S_ISLNK(st->st_mode))
+    {
+        char link_buf[PATH_MAX];
+        ssize_t len = readlink(source_path, link_buf, PATH_MAX - 1);
+        if (len == -1)
+            return 0;
+        frame.op = WIRE_SYMLINK;
+        return put_frame(&frame, rel, link_buf, len);
+    }
+    if (!S_ISDIR(st->st_mode))
+        return 0;
+    return put_frame(&frame, rel, NULL, 0) == -1 ? -1 : 1;
+}
+
+// sendin one entry and everythin under it, dirs are walked with an explicit stack
+static int send_tree(const char *source_path, const char *rel, int scan)
+{
+    struct stat st;
+    if (lstat(source_path, &st) == -1)
+        return 0;
+    int ret = send_entry(source_path, rel, &st, scan);
+    if (ret != 1)
+        return ret;
+
+    walk_tree_t tree;
+    if (walk_tree_open(&tree, AT_FDCWD, source_path, source_path, NULL) == -1)
+        return 0;
+    int step;
+    while (!broken && (step = walk_tree_next(&tree)) > 0)
+    {
+        if (step == WALK_LEAVE)
+        {
+            if (!scan)
+                epoch_copied(tree.path, tree.st, 0);
+            continue;
+        }
+        const char *child_rel = rel_path(tree.path);
+        if (!child_rel || walk_stat(tree.dir_fd, tree.name, &st) == -1)
+            continue;
+        if (send_entry(tree.path, child_rel, &st, scan) == 1)
+            walk_tree_enter(&tree);
+    }
+    walk_tree_close(&tree);
+    return broken ? -1 : 0;
+}
+
+// sync frame is answered only after everythin before it was applied and synced
+static int barrier(void)
+{
+    wire_frame_t frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.op = WIRE_SYNC;
+    if (put_frame(&frame, "", NULL, 0) == -1 || flush_batch() == -1)
+        return -1;
+    while (!broken && acked_seq < frame.seq)
+        wait_io(0);
+    dirty = 0;
+    last_sync_ms = now_ms();
+    return broken ? -1 : 0;
+}
+
+static int serve_needs(void)
+{
+    char source_path[PATH_MAX];
+    for (size_t i = 0; i < need_count; i++)
+    {
+        if (!broken && snprintf(source_path, PATH_MAX, "%s/%s", root, needs[i]) < PATH_MAX)
+            send_file(source_path, needs[i]);
+        free(needs[i]);
+    }
+    need_count = 0;
+    return broken ? -1 : 0;
+}
+
+// name of the dir this source gets on the receiver, the last component keeps it readable
+// and the hash of the whole path keeps two sources with the same last component apart
+static void space_name(char *out)
+{
+    const char *base = strrchr(root, '/');
+    base = base && base[1] ? base + 1 : "root";
+    snprintf(out, REPL_SPACE_LEN, "%.*s-%016llx", REPL_SPACE_LEN - 18, base,
+             (unsigned long long)hash64(root, root_len, 0));
+}
+
+// connectin to the receiver, checkin it speaks our version and claimin our dir there
+int repl_open(const char *endpoint, const char *source_root)
+{
+    repl_close();
+    broken = 0;
+    batch_len = 0;
+    reply_len = 0;
+    next_seq = 1;
+    acked_seq = 0;
+    snprintf(root, PATH_MAX, "%s", source_root);
+    root_len = strlen(root);
+    while (root_len > 1 && root[root_len - 1] == '/')
+        root[--root_len] = '\0';
+
+    sock = wire_connect(endpoint);
+    if (sock == -1)
+        return -1;
+    int flags = fcntl(sock, F_GETFL);
+    if (flags == -1 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) == -1)
+    {
+        close(sock);
+        sock = -1;
+        return -1;
+    }
+
+    wire_frame_t frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.op = WIRE_HELLO;
+    frame.mode = WIRE_VERSION;
+    char space[REPL_SPACE_LEN];
+    space_name(space);
+    if (put_frame(&frame, space, NULL, 0) == -1 || barrier() == -1)
+    {
+        repl_close();
+        return -1;
+    }
+    return 0;
+}
+
+// waitin until the receiver applied and synced everythin, then hangin up
+void repl_close(void)
+{
+    if (sock == -1)
+        return;
+    if (!broken)
+        barrier();
+    close(sock);
+    sock = -1;
+    for (size_t i = 0; i < need_count; i++)
+        free(needs[i]);
+    free(needs);
+    needs = NULL;
+    need_count = need_cap = 0;
+}
+
+int repl_active(void)
+{
+    return sock != -1;
+}
+
+int repl_broken(void)
+{
+    return broken;
+}
+
+// bringin the receiver in line with the whole source, only changed files are sent,
+// with prune the receiver also drops what the source no longer has
+int repl_scan(int prune)
+{
+    wire_frame_t frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.op = WIRE_SCAN;
+    if (put_frame(&frame, "", NULL, 0) == -1 || send_tree(root, "", 1) == -1)
+        return -1;
+    if (prune)
+    {
+        frame.op = WIRE_PRUNE;
+        if (put_frame(&frame, "", NULL, 0) == -1)
+            return -1;
+    }
+    // once the first barrier is acked every request for a file has arrived
+    if (barrier() == -1 || serve_needs() == -1)
+        return -1;
+    return barrier();
+}
+
+// new or changed path from an event, dirs go whole
+int repl_send_path(const char *source_path)
+{
+    const char *rel = rel_path(source_path);
+    if (!rel || broken)
+        return -1;
+    return send_tree(source_path, rel, 0);
+}
+
+int repl_send_attr(const char *source_path)
+{
+    const char *rel = rel_path(source_path);
+    struct stat st;
+    if (!rel || broken)
+        return -1;
+    if (lstat(source_path, &st) == -1)
+        return errno == ENOENT ? 0 : -1;
+    wire_frame_t frame;
+    frame_from_stat(&frame, WIRE_ATTR, &st);
+    return put_frame(&frame, rel, NULL, 0);
+}
+
+int repl_send_remove(const char *source_path)
+{
+    const char *rel = rel_path(source_path);
+    if (!rel || !*rel || broken)
+        return -1;
+    wire_frame_t frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.op = WIRE_REMOVE;
+    return put_frame(&frame, rel, NULL, 0);
+}
+
+// idle work of the worker: send what is batched, answer requests, ask for a sync
+// now and then so acked changes are also on the receiver disk
+int repl_tick(void)
+{
+    if (sock == -1)
+        return 0;
+    if (read_replies() == -1 || serve_needs() == -1)
+        return -1;
+    if (dirty && now_ms() - last_sync_ms >= REPL_SYNC_MS)
+    {
+        wire_frame_t frame;
+        memset(&frame, 0, sizeof(frame));
+        frame.op = WIRE_SYNC;
+        if (put_frame(&frame, "", NULL, 0) == -1)
+            return -1;
+        dirty = 0;
+        last_sync_ms = now_ms();
+    }
+    if (batch_len && flush_batch() == -1)
+        return -1;
+    return 0;
+}
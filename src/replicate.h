@@ -0,0 +1,23 @@
+// clang-format off
+#ifndef REPLICATE_H
+#define REPLICATE_H
+
+#define REPL_BATCH_LEN (256 * 1024)
+#define REPL_INLINE_MAX (64 * 1024)
+#define REPL_REPLY_LEN (64 * 1024)
+#define REPL_WINDOW 4096
+#define REPL_TIMEOUT_MS 30000
+#define REPL_SYNC_MS 1000
+#define REPL_SPACE_LEN 128
+
+int repl_open(const char *endpoint, const char *source_root);
+void repl_close(void);
+int repl_active(void);
+int repl_broken(void);
+int repl_scan(int prune);
+int repl_send_path(const char *source_path);
+int repl_send_attr(const char *source_path);
+int repl_send_remove(const char *source_path);
+int repl_tick(void);
+
+#endif
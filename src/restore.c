@@ -3,12 +3,34 @@
 #include "restore.h"
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include "attr.h"
+#include "compress.h"
+#include "config.h"
+#include "dedup.h"
+#include "durable.h"
+#include "filter.h"
+#include "hardlink.h"
+#include "meta.h"
+#include "monitor.h"
+#include "pack.h"
+#include "strmap.h"
+#include "walk.h"
+
+// layout of the backup we restore from, plain files, dedup manifests or compressed
+static backup_config_t restore_config;
+static char restore_store_dir[PATH_MAX];
+// what part of the backup to restore, NULL restores everything
+static const restore_filter_t *restore_filter;
+static size_t backup_root_len;
 
 // comparin files and copyin only if diferent
 int compare_and_copy_if_different(const char *src, const char *dst)
@@ -20,10 +42,27 @@ int compare_and_copy_if_different(const char *src, const char *dst)
         return -1;
     }
 
+    // for dedup and compressed backups the real size and time are in the file header
+    int64_t src_ns = attr_mtime_ns(&st_src);
+    manifest_header_t hdr;
+    compressed_header_t chdr;
+    int is_manifest = restore_config.format == FORMAT_DEDUP && dedup_read_header(src, &hdr) == 0;
+    int is_compressed = restore_config.format == FORMAT_COMPRESSED && compress_read_header(src, &chdr) == 0;
+    if (is_manifest)
+    {
+        st_src.st_size = hdr.size;
+        src_ns = hdr.mtime_ns;
+    }
+    else if (is_compressed)
+    {
+        st_src.st_size = chdr.size;
+        src_ns = chdr.mtime_ns;
+    }
+
     int need_copy = 1;
     if (stat(dst, &st_dst) == 0)
     {
-        if (st_src.st_mtime == st_dst.st_mtime && st_src.st_size == st_dst.st_size)
+        if (src_ns == attr_mtime_ns(&st_dst) && st_src.st_size == st_dst.st_size)
         {
             need_copy = 0;
         }
@@ -31,7 +70,14 @@ int compare_and_copy_if_different(const char *src, const char *dst)
 
     if (need_copy)
     {
-        if (copy_file(src, dst) != 0)
+        int ret;
+        if (is_manifest)
+            ret = dedup_restore_file(src, dst, restore_store_dir);
+        else if (is_compressed)
+            ret = compress_restore_file(src, dst);
+        else
+            ret = copy_file(src, dst);
+        if (ret != 0)
         {
             return -1;
         }
@@ -78,144 +124,628 @@ static int ensure_directory_exists(const char *path)
     return 0;
 }
 
-// deletin files that dont exist in baccup anymore
-void delete_files_not_in_backup(const char *source, const char *target)
+// path relative to the backup root, without leadin slash
+static const char *relative_to_backup(const char *backup_path)
 {
-    DIR *dir = opendir(source);
-    if (!dir)
+    const char *rel = backup_path + backup_root_len;
+    while (*rel == '/')
+        rel++;
+    return rel;
+}
+
+static int filtering(void)
+{
+    return restore_filter && restore_filter->include_count > 0;
+}
+
+// patterns with a slash match the whole relative path, others just the name
+static int include_matches(const char *rel)
+{
+    if (!filtering())
+        return 1;
+    const char *base = strrchr(rel, '/');
+    base = base ? base + 1 : rel;
+    for (int i = 0; i < restore_filter->include_count; i++)
     {
-        perror("opendir failed");
-        return;
+        const char *pattern = restore_filter->includes[i];
+        if (strchr(pattern, '/') ? fnmatch(pattern, rel, FNM_PATHNAME) == 0 : fnmatch(pattern, base, 0) == 0)
+            return 1;
     }
+    return 0;
+}
 
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL)
+// checcs if somethin under dir can match, so 'etc/app/*.cfg' only walks etc/app
+static int dir_may_match(const char *rel_dir)
+{
+    if (!filtering())
+        return 1;
+    for (int i = 0; i < restore_filter->include_count; i++)
     {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        const char *pattern = restore_filter->includes[i];
+        if (!strchr(pattern, '/'))
+            return 1;
+
+        // comparin component by component, the pattern needs one more for the file itself
+        char pat[PATH_MAX], dir[PATH_MAX];
+        strncpy(pat, pattern, PATH_MAX - 1);
+        pat[PATH_MAX - 1] = '\0';
+        strncpy(dir, rel_dir, PATH_MAX - 1);
+        dir[PATH_MAX - 1] = '\0';
+        char *pat_save = NULL, *dir_save = NULL;
+        char *p = strtok_r(pat, "/", &pat_save);
+        char *d = strtok_r(dir, "/", &dir_save);
+        while (p && d && fnmatch(p, d, 0) == 0)
         {
-            continue;
+            p = strtok_r(NULL, "/", &pat_save);
+            d = strtok_r(NULL, "/", &dir_save);
         }
+        if (!d && p)
+            return 1;
+    }
+    return 0;
+}
 
-        char source_path[PATH_MAX];
-        char target_path[PATH_MAX];
-        snprintf(source_path, PATH_MAX, "%s/%s", source, entry->d_name);
-        snprintf(target_path, PATH_MAX, "%s/%s", target, entry->d_name);
+// creatin parent dirs of a file picked by the filter, the walk does not create them
+static int ensure_parent_exists(const char *path)
+{
+    char parent[PATH_MAX];
+    strncpy(parent, path, PATH_MAX - 1);
+    parent[PATH_MAX - 1] = '\0';
+    char *slash = strrchr(parent, '/');
+    if (!slash || slash == parent)
+        return 0;
+    *slash = '\0';
+    return ensure_directory_exists(parent);
+}
 
-        struct stat st;
-        if (lstat(target_path, &st) == -1)
-        {
-            if (lstat(source_path, &st) == -1)
-            {
-                continue;
-            }
+// one directory to plan or one file to copy, handed to the restore threads
+typedef struct restore_job
+{
+    int is_dir;
+    char *backup_path;
+    char *source_path;
+    struct restore_job *next;
+} restore_job_t;
 
-            if (S_ISDIR(st.st_mode))
-            {
-                delete_files_not_in_backup(source_path, target_path);
-                if (rmdir(source_path) == -1)
-                {
-                    perror("rmdir failed");
-                }
-            }
-            else
-            {
-                if (unlink(source_path) == -1)
-                {
-                    perror("unlink failed");
-                }
-            }
-        }
-        else
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static restore_job_t *queue_head;
+static restore_job_t *queue_tail;
+static int queue_pending;
+static int queue_files;
+static int queue_dirs;
+static int restore_failed;
+
+typedef struct
+{
+    char *name;
+    int type;
+} dir_item_t;
+
+typedef struct
+{
+    dir_item_t *items;
+    size_t count;
+    size_t cap;
+} dir_list_t;
+
+static void free_list(dir_list_t *list)
+{
+    for (size_t i = 0; i < list->count; i++)
+        free(list->items[i].name);
+    free(list->items);
+}
+
+static int compare_items(const void *a, const void *b)
+{
+    return strcmp(((const dir_item_t *)a)->name, ((const dir_item_t *)b)->name);
+}
+
+// readin directory sorted by name, d_type saves the lstat when the filesystem fills it,
+// missing directory is just empty
+static int list_dir(const char *path, dir_list_t *list, int backup_side)
+{
+    memset(list, 0, sizeof(*list));
+    walk_dir_t dir;
+    if (walk_open(&dir, AT_FDCWD, path) == -1)
+        return errno == ENOENT && !backup_side ? 0 : -1;
+
+    // only the metadata dir at the top of the backup is ours, deeper ones are user data
+    int top = backup_side && !*relative_to_backup(path);
+    const char *entry;
+    int type;
+    while (walk_next(&dir, &entry, &type) == 1)
+    {
+        if (top && is_meta_name(entry))
+            continue;
+
+        if (list->count == list->cap)
         {
-            if (lstat(source_path, &st) == -1)
-            {
-                continue;
-            }
-            if (S_ISDIR(st.st_mode))
-            {
-                delete_files_not_in_backup(source_path, target_path);
-            }
+            size_t cap = list->cap ? list->cap * 2 : 64;
+            dir_item_t *items = realloc(list->items, cap * sizeof(dir_item_t));
+            if (!items)
+                break;
+            list->items = items;
+            list->cap = cap;
         }
+        char *name = strdup(entry);
+        if (!name)
+            break;
+        list->items[list->count].name = name;
+        list->items[list->count++].type = type;
     }
-    closedir(dir);
+    walk_close(&dir);
+    if (list->count)
+        qsort(list->items, list->count, sizeof(dir_item_t), compare_items);
+    return 0;
+}
+
+static int plan_dir(const char *backup_dir, const char *source_dir, int depth);
+
+// first restored name of each backup inode with several names, others link to it
+typedef struct
+{
+    char *path;
+    int done;
+    int ok;
+} restored_link_t;
+
+static strmap_t restored_links;
+static pthread_mutex_t link_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t link_cond = PTHREAD_COND_INITIALIZER;
+
+static void free_restored_link(void *value)
+{
+    restored_link_t *link = value;
+    free(link->path);
+    free(link);
 }
 
-// main restore function, copys baccup back to source
-int restore_backup(const char *source, const char *target)
+// restorin a hard linked file, the first thread to get its inode copies it,
+// the rest wait for that copy and link to it
+static int restore_linked(const char *backup_path, const char *source_path, const struct stat *st)
 {
-    if (ensure_directory_exists(target) == -1)
+    char key[HARDLINK_KEY_LEN];
+    hardlink_key(key, st->st_dev, st->st_ino);
+
+    pthread_mutex_lock(&link_lock);
+    restored_link_t *link = strmap_get(&restored_links, key);
+    if (!link)
     {
-        fprintf(stderr, "Failed to create target directory for restore: %s\n", target);
+        link = calloc(1, sizeof(restored_link_t));
+        if (link && (link->path = strdup(source_path)) && strmap_put(&restored_links, key, link) == 0)
+        {
+            pthread_mutex_unlock(&link_lock);
+            int ret = compare_and_copy_if_different(backup_path, source_path);
+            pthread_mutex_lock(&link_lock);
+            link->ok = ret == 0;
+            link->done = 1;
+            pthread_cond_broadcast(&link_cond);
+            pthread_mutex_unlock(&link_lock);
+            return ret;
+        }
+        if (link)
+            free(link->path);
+        free(link);
+        pthread_mutex_unlock(&link_lock);
         return -1;
     }
+    while (!link->done)
+        pthread_cond_wait(&link_cond, &link_lock);
+    int ok = link->ok;
+    pthread_mutex_unlock(&link_lock);
+    if (!ok)
+        return -1;
 
-    DIR *dir = opendir(target);
-    if (!dir)
+    struct stat first, cur;
+    if (lstat(link->path, &first) == -1)
+        return -1;
+    if (lstat(source_path, &cur) == 0 && cur.st_dev == first.st_dev && cur.st_ino == first.st_ino)
+        return 0;
+    if (staged_link(link->path, source_path) == -1)
+        return -1;
+    fprintf(stdout, "Linked: %s -> %s\n", source_path, link->path);
+    return 0;
+}
+
+static int run_job(int is_dir, const char *backup_path, const char *source_path, int depth)
+{
+    if (is_dir)
+        return plan_dir(backup_path, source_path, depth);
+
+    struct stat st;
+    int ret;
+    if (lstat(backup_path, &st) == 0 && S_ISREG(st.st_mode) && st.st_nlink > 1 &&
+        restore_linked(backup_path, source_path, &st) == 0)
+        ret = 0;
+    else
+        ret = compare_and_copy_if_different(backup_path, source_path);
+    if (ret != 0)
     {
-        perror("opendir failed");
+        fprintf(stderr, "Failed to restore file: %s\n", backup_path);
         return -1;
     }
+    return 0;
+}
 
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL)
+// job done on the callin thread failed, restore reports it at the end
+static void mark_failed(void)
+{
+    pthread_mutex_lock(&queue_lock);
+    restore_failed = 1;
+    pthread_mutex_unlock(&queue_lock);
+}
+
+// queuein job for the restore threads, done right here if there is no memory for it
+// or enough jobs of its kind are waitin already, so the queue stays bounded on wide trees,
+// dirs go to the front and are planned depth first, which keeps the dirs waitin near one path,
+// depth counts dirs planned inside each other on this thread so the stack stays bounded too
+static void queue_job(int is_dir, const char *backup_path, const char *source_path, int depth)
+{
+    pthread_mutex_lock(&queue_lock);
+    int full = is_dir ? queue_dirs >= RESTORE_QUEUE_MAX && depth < RESTORE_INLINE_DEPTH
+                      : queue_files >= RESTORE_QUEUE_MAX;
+    pthread_mutex_unlock(&queue_lock);
+    if (full)
     {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-        {
-            continue;
-        }
+        if (run_job(is_dir, backup_path, source_path, depth + 1) == -1)
+            mark_failed();
+        return;
+    }
+
+    restore_job_t *job = malloc(sizeof(restore_job_t));
+    char *b = strdup(backup_path);
+    char *s = strdup(source_path);
+    if (!job || !b || !s)
+    {
+        free(job);
+        free(b);
+        free(s);
+        if (run_job(is_dir, backup_path, source_path, depth + 1) == -1)
+            mark_failed();
+        return;
+    }
+    job->is_dir = is_dir;
+    job->backup_path = b;
+    job->source_path = s;
+    job->next = NULL;
 
-        char source_path[PATH_MAX];
-        char target_path[PATH_MAX];
-        snprintf(source_path, PATH_MAX, "%s/%s", source, entry->d_name);
-        snprintf(target_path, PATH_MAX, "%s/%s", target, entry->d_name);
+    pthread_mutex_lock(&queue_lock);
+    if (is_dir)
+    {
+        job->next = queue_head;
+        queue_head = job;
+        if (!queue_tail)
+            queue_tail = job;
+        queue_dirs++;
+    }
+    else
+    {
+        if (queue_tail)
+            queue_tail->next = job;
+        else
+            queue_head = job;
+        queue_tail = job;
+        queue_files++;
+    }
+    queue_pending++;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+}
 
-        struct stat st;
-        if (lstat(target_path, &st) == -1)
+// makin source symlink point where the backed up one does, untouched if it already does
+static void restore_symlink(const char *backup_path, const char *source_path, int source_type)
+{
+    char link_buf[PATH_MAX];
+    ssize_t len = readlink(backup_path, link_buf, PATH_MAX - 1);
+    if (len == -1)
+    {
+        perror("readlink failed");
+        return;
+    }
+    link_buf[len] = '\0';
+
+    if (source_type == DT_LNK)
+    {
+        char current[PATH_MAX];
+        ssize_t cur_len = readlink(source_path, current, PATH_MAX - 1);
+        if (cur_len == len && memcmp(current, link_buf, len) == 0)
+            return;
+    }
+    if (source_type != DT_UNKNOWN && remove_path_recursive(source_path) == -1)
+        return;
+    if (symlink(link_buf, source_path) == -1)
+        perror("symlink failed");
+}
+
+// one entry of the backup against what the source has under the same name,
+// DT_UNKNOWN source type means the source has nothing there
+static void plan_entry(const char *backup_path, const char *source_path, int backup_type, int source_type, int depth)
+{
+    // with --include only matchin entries are touched, dirs come with the files in them
+    if (filtering())
+    {
+        const char *rel = relative_to_backup(backup_path);
+        if (backup_type == DT_DIR)
         {
-            continue;
+            if (dir_may_match(rel))
+                queue_job(1, backup_path, source_path, depth);
+            return;
         }
+        if (!include_matches(rel) || ensure_parent_exists(source_path) == -1)
+            return;
+    }
 
-        if (S_ISDIR(st.st_mode))
+    if (backup_type == DT_DIR)
+    {
+        if (source_type != DT_DIR)
         {
+            struct stat st;
+            if (lstat(backup_path, &st) == -1)
+                return;
+            if (source_type != DT_UNKNOWN && remove_path_recursive(source_path) == -1)
+                return;
             if (mkdir(source_path, st.st_mode & 0777) == -1 && errno != EEXIST)
             {
                 perror("mkdir failed");
+                return;
             }
-            restore_backup(source_path, target_path);
         }
-        else if (S_ISLNK(st.st_mode))
-        {
-            char link_buf[PATH_MAX];
-            ssize_t len = readlink(target_path, link_buf, PATH_MAX - 1);
-            if (len == -1)
-            {
-                perror("readlink failed");
-                continue;
-            }
-            link_buf[len] = '\0';
+        queue_job(1, backup_path, source_path, depth);
+    }
+    else if (backup_type == DT_LNK)
+    {
+        restore_symlink(backup_path, source_path, source_type);
+    }
+    else
+    {
+        if (source_type == DT_DIR && remove_path_recursive(source_path) == -1)
+            return;
+        queue_job(0, backup_path, source_path, depth);
+    }
+}
 
-            if (unlink(source_path) == -1 && errno != ENOENT)
-            {
-                perror("unlink failed");
-            }
+// walkin backup dir and source dir together by sorted name, so one pass finds
+// what to copy and what to delete, files go to the threads as they are found
+static int plan_dir(const char *backup_dir, const char *source_dir, int depth)
+{
+    dir_list_t backup, source;
+    if (list_dir(backup_dir, &backup, 1) == -1)
+    {
+        perror("opendir failed");
+        return -1;
+    }
+    if (list_dir(source_dir, &source, 0) == -1)
+    {
+        perror("opendir failed");
+        free_list(&backup);
+        return -1;
+    }
 
-            if (symlink(link_buf, source_path) == -1)
-            {
-                perror("symlink failed");
-            }
+    size_t i = 0, j = 0;
+    char backup_path[PATH_MAX];
+    char source_path[PATH_MAX];
+    while (i < backup.count || j < source.count)
+    {
+        int cmp = i == backup.count ? 1 : j == source.count ? -1 : strcmp(backup.items[i].name, source.items[j].name);
+        const char *name = cmp > 0 ? source.items[j].name : backup.items[i].name;
+        if (snprintf(backup_path, PATH_MAX, "%s/%s", backup_dir, name) >= PATH_MAX ||
+            snprintf(source_path, PATH_MAX, "%s/%s", source_dir, name) >= PATH_MAX)
+        {
+            fprintf(stderr, "Path too long while restoring: %s/%s\n", source_dir, name);
+        }
+        else if (cmp > 0)
+        {
+            // only in source, small files of packed backups live in the pack instead,
+            // filtered restore leaves everythin it did not pick alone
+            // excluded by the backup's own rules, so never backed up and not to be deleted either
+            if (!filtering() && !filter_excluded(source_path, source.items[j].type == DT_DIR) &&
+                (!pack_contains(backup_path) || source.items[j].type == DT_DIR))
+                remove_path_recursive(source_path);
         }
         else
         {
-            if (compare_and_copy_if_different(target_path, source_path) != 0)
-            {
-                fprintf(stderr, "Failed to restore file: %s\n", target_path);
-            }
+            plan_entry(backup_path, source_path, backup.items[i].type, cmp == 0 ? source.items[j].type : DT_UNKNOWN,
+                       depth);
         }
+        if (cmp <= 0)
+            i++;
+        if (cmp >= 0)
+            j++;
+    }
+    free_list(&backup);
+    free_list(&source);
+    return 0;
+}
+
+static void *restore_worker(void *arg)
+{
+    pthread_mutex_lock(&queue_lock);
+    for (;;)
+    {
+        while (!queue_head && queue_pending > 0)
+            pthread_cond_wait(&queue_cond, &queue_lock);
+        if (!queue_head)
+            break;
+        restore_job_t *job = queue_head;
+        queue_head = job->next;
+        if (!queue_head)
+            queue_tail = NULL;
+        if (job->is_dir)
+            queue_dirs--;
+        else
+            queue_files--;
+        pthread_mutex_unlock(&queue_lock);
+
+        int ret = run_job(job->is_dir, job->backup_path, job->source_path, 0);
+        free(job->backup_path);
+        free(job->source_path);
+        free(job);
+
+        pthread_mutex_lock(&queue_lock);
+        if (ret == -1)
+            restore_failed = 1;
+        // last job done, wake everyone so they can leave
+        if (--queue_pending == 0)
+            pthread_cond_broadcast(&queue_cond);
+    }
+    pthread_mutex_unlock(&queue_lock);
+    return NULL;
+}
+
+// plannin and copyin on RESTORE_THREADS threads, dirs found by one thread
+// are planned by whichever is free next
+static int restore_dir(const char *source, const char *target)
+{
+    if (ensure_directory_exists(source) == -1)
+    {
+        fprintf(stderr, "Failed to create target directory for restore: %s\n", source);
+        return -1;
+    }
+
+    restore_failed = 0;
+    queue_files = 0;
+    queue_dirs = 0;
+    queue_job(1, target, source, 0);
+
+    pthread_t threads[RESTORE_THREADS];
+    int started = 0;
+    while (started < RESTORE_THREADS && pthread_create(&threads[started], NULL, restore_worker, NULL) == 0)
+        started++;
+    if (started == 0)
+        restore_worker(NULL);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    return restore_failed ? -1 : 0;
+}
+
+// packed files of a filtered restore, their dirs may not exist yet
+static int pack_wanted(const char *rel, void *arg)
+{
+    while (*rel == '/')
+        rel++;
+    if (!include_matches(rel))
+        return 0;
+    char dest[PATH_MAX];
+    if (snprintf(dest, PATH_MAX, "%s/%s", (const char *)arg, rel) >= PATH_MAX)
+        return 0;
+    return ensure_parent_exists(dest) == 0;
+}
+
+// turnin --path into "/sub/dir", refusin anythin that leaves the backup
+static int restore_prefix(char *prefix, const char *path)
+{
+    prefix[0] = '\0';
+    if (!path)
+        return 0;
+    size_t len = 0;
+    char copy[PATH_MAX];
+    strncpy(copy, path, PATH_MAX - 1);
+    copy[PATH_MAX - 1] = '\0';
+    char *save = NULL;
+    for (char *part = strtok_r(copy, "/", &save); part; part = strtok_r(NULL, "/", &save))
+    {
+        if (strcmp(part, ".") == 0)
+            continue;
+        if (strcmp(part, "..") == 0 || len + strlen(part) + 2 > PATH_MAX)
+            return -1;
+        len += sprintf(prefix + len, "/%s", part);
+    }
+    return 0;
+}
+
+// restorin one file or symlink named by --path, looked up directly instead of walkin
+static int restore_single(const char *backup_path, const char *source_path, const struct stat *st)
+{
+    if (!include_matches(relative_to_backup(backup_path)))
+        return 0;
+    if (ensure_parent_exists(source_path) == -1)
+    {
+        fprintf(stderr, "Failed to create target directory for restore: %s\n", source_path);
+        return -1;
+    }
+
+    struct stat cur;
+    int source_type = DT_UNKNOWN;
+    if (lstat(source_path, &cur) == 0)
+        source_type = S_ISDIR(cur.st_mode) ? DT_DIR : S_ISLNK(cur.st_mode) ? DT_LNK : DT_REG;
+    if (S_ISLNK(st->st_mode))
+    {
+        restore_symlink(backup_path, source_path, source_type);
+        return 0;
+    }
+    if (source_type == DT_DIR && remove_path_recursive(source_path) == -1)
+        return -1;
+    if (compare_and_copy_if_different(backup_path, source_path) != 0)
+    {
+        fprintf(stderr, "Failed to restore file: %s\n", backup_path);
+        return -1;
+    }
+    return 0;
+}
+
+// main restore function, copys baccup back to source, filter picks a subtree
+// and/or files matchin globs, NULL restores the whole backup
+int restore_backup(const char *source, const char *target, const restore_filter_t *filter)
+{
+    // restore writes into the source tree, no backup metadata for it
+    meta_set_root(NULL);
+    config_set_current(NULL);
+
+    char prefix[PATH_MAX];
+    if (restore_prefix(prefix, filter ? filter->path : NULL) == -1)
+    {
+        fprintf(stderr, "Error: restore path must be inside the backup\n");
+        return -1;
+    }
+    char backup_start[PATH_MAX], source_start[PATH_MAX];
+    if (snprintf(backup_start, PATH_MAX, "%s%s", target, prefix) >= PATH_MAX ||
+        snprintf(source_start, PATH_MAX, "%s%s", source, prefix) >= PATH_MAX)
+    {
+        fprintf(stderr, "Error: restore path too long\n");
+        return -1;
     }
-    closedir(dir);
+    restore_filter = filter;
+    backup_root_len = strlen(target);
 
-    delete_files_not_in_backup(source, target);
+    if (config_load(&restore_config, target) == -1)
+        config_init(&restore_config);
+    walk_set_limits(restore_config.walk_fds, restore_config.walk_mem);
+    filter_set(restore_config.filters, source);
+    if (restore_config.format == FORMAT_DEDUP && dedup_store_dir(restore_store_dir, restore_config.store_path, target) == -1)
+    {
+        fprintf(stderr, "Cannot open chunk store of backup %s\n", target);
+        return -1;
+    }
+
+    if (restore_config.format == FORMAT_PACKED && pack_open(target) == -1)
+    {
+        fprintf(stderr, "Cannot open pack index of backup %s\n", target);
+        return -1;
+    }
+
+    // --path is looked up directly, only a directory needs walkin
+    int ret = 0;
+    struct stat st;
+    if (lstat(backup_start, &st) == 0)
+        ret = S_ISDIR(st.st_mode) ? restore_dir(source_start, backup_start) : restore_single(backup_start, source_start, &st);
+    else if (!pack_contains(backup_start))
+    {
+        fprintf(stderr, "Error: %s is not in backup %s\n", prefix[0] ? prefix + 1 : ".", target);
+        ret = -1;
+    }
+    if (ret == 0 && restore_config.format == FORMAT_PACKED)
+        ret = pack_restore(source, prefix, filter ? pack_wanted : NULL, (void *)source);
+    pack_close();
+    durable_flush();
+    filter_clear();
+    strmap_free(&restored_links, free_restored_link);
+    memset(&restored_links, 0, sizeof(restored_links));
+    restore_filter = NULL;
+    if (ret == -1)
+        return -1;
 
-    fprintf(stdout, "Restore from %s to %s completed\n", target, source);
+    fprintf(stdout, "Restore from %s to %s completed\n", backup_start, source_start);
     return 0;
 }
@@ -4,8 +4,19 @@
 
 #include "backup.h"
 
-int restore_backup(const char *source, const char *target);
+#define RESTORE_THREADS 8
+#define RESTORE_MAX_INCLUDES 16
+#define RESTORE_QUEUE_MAX 4096
+#define RESTORE_INLINE_DEPTH 32
+
+typedef struct
+{
+    const char *path;
+    const char *includes[RESTORE_MAX_INCLUDES];
+    int include_count;
+} restore_filter_t;
+
+int restore_backup(const char *source, const char *target, const restore_filter_t *filter);
 int compare_and_copy_if_different(const char *src, const char *dst);
-void delete_files_not_in_backup(const char *source, const char *target);
 
 #endif
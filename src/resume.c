@@ -0,0 +1,95 @@
+// clang-format off
+#define _GNU_SOURCE
+#include "resume.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "attr.h"
+#include "compress.h"
+#include "config.h"
+#include "dedup.h"
+#include "durable.h"
+#include "meta.h"
+
+// marker of an initial backup in progress, a resumed one checks the whole target again
+// so nothin about how far the interrupted run got is kept
+static int active;
+static char running_path[PATH_MAX];
+
+// startin initial backup of current meta root, returns 1 when an interrupted run is
+// continued, the source may have changed since so the caller has to check the whole
+// target against it instead of trustin what the earlier run copied
+int resume_begin(void)
+{
+    if (meta_path(running_path, "initial", "running") == -1)
+        return -1;
+    struct stat st;
+    int resuming = lstat(running_path, &st) == 0;
+    if (!resuming)
+    {
+        // marker has to be on disk before any copy, otherwise a crash could leave copies
+        // whose target looks like a finished backup
+        int fd = open(running_path, O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+        if (fd == -1)
+            return -1;
+        durable_written(fd);
+        close(fd);
+        durable_flush();
+    }
+    else
+    {
+        fprintf(stdout, "Resuming interrupted initial backup of %s\n", meta_get_root());
+    }
+    active = 1;
+    return resuming;
+}
+
+// finishin initial backup, complete run drops the marker so next add starts fresh
+void resume_end(int completed)
+{
+    if (!active)
+        return;
+    if (completed)
+        unlink(running_path);
+    active = 0;
+}
+
+// quick check for files an earlier run or a crashed worker already copied,
+// same size and time as the source means it was copied completely
+int resume_copy_current(const char *source_path, const char *dest_path)
+{
+    struct stat src, dst;
+    if (lstat(source_path, &src) == -1 || !S_ISREG(src.st_mode) || lstat(dest_path, &dst) == -1 ||
+        !S_ISREG(dst.st_mode))
+        return 0;
+
+    int64_t dst_ns = attr_mtime_ns(&dst);
+    switch (config_current()->format)
+    {
+        case FORMAT_DEDUP:
+        {
+            manifest_header_t hdr;
+            if (dedup_read_header(dest_path, &hdr) == -1)
+                return 0;
+            dst.st_size = hdr.size;
+            dst_ns = hdr.mtime_ns;
+            break;
+        }
+        case FORMAT_COMPRESSED:
+        {
+            compressed_header_t hdr;
+            if (compress_read_header(dest_path, &hdr) == -1)
+                return 0;
+            dst.st_size = hdr.size;
+            dst_ns = hdr.mtime_ns;
+            break;
+        }
+        default:
+            break;
+    }
+    return src.st_size == dst.st_size && attr_mtime_ns(&src) == dst_ns;
+}
@@ -0,0 +1,9 @@
+// clang-format off
+#ifndef RESUME_H
+#define RESUME_H
+
+int resume_begin(void);
+void resume_end(int completed);
+int resume_copy_current(const char *source_path, const char *dest_path);
+
+#endif
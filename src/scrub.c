@@ -0,0 +1,546 @@
+// clang-format off
+#define _GNU_SOURCE
+#include "scrub.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "attr.h"
+#include "backup.h"
+#include "hash.h"
+#include "journal.h"
+#include "meta.h"
+#include "signals.h"
+#include "strmap.h"
+
+#define DB_MAGIC 0x3142444b4c524d53ULL
+
+// merkle tree node, file hash is over its content, dir hash over sorted names and child hashes
+typedef struct
+{
+    uint64_t hash;
+    int64_t size;
+    int64_t mtime_ns;
+    int64_t verified;
+    int64_t seen;
+} scrub_entry_t;
+
+typedef struct
+{
+    scrub_entry_t e;
+    uint32_t path_len;
+    uint32_t is_dir;
+} db_record_t;
+
+typedef struct
+{
+    char *name;
+    uint64_t hash;
+} child_t;
+
+// one dir of the walk, stays open between ticks
+typedef struct
+{
+    char rel[PATH_MAX];
+    DIR *dir;
+    child_t *children;
+    size_t count;
+    size_t cap;
+} frame_t;
+
+// file bein hashed, a big file takes many ticks
+typedef struct
+{
+    int active;
+    int dst_fd;
+    int src_fd;
+    int read_source;
+    char rel[PATH_MAX];
+    char name[NAME_MAX + 1];
+    struct stat src_st;
+    hash_state_t dst_hash;
+    hash_state_t src_hash;
+    off_t offset;
+    off_t dst_size;
+} job_t;
+
+static char source_root[PATH_MAX];
+static char target_root[PATH_MAX];
+static char db_path[PATH_MAX];
+static char report_path[PATH_MAX];
+static strmap_t entries;
+static int started;
+static long long rate;
+static long long budget;
+static struct timespec last_tick;
+static time_t pass_started;
+static time_t pass_finished;
+static frame_t *stack;
+static size_t depth;
+static size_t stack_cap;
+static job_t job = {.dst_fd = -1, .src_fd = -1};
+static unsigned long verified_count;
+static unsigned long repaired_count;
+
+static int build_path(char *out, const char *root, const char *rel)
+{
+    int n = snprintf(out, PATH_MAX, "%s%s%s", root, rel[0] ? "/" : "", rel);
+    return (n < 0 || n >= PATH_MAX) ? -1 : 0;
+}
+
+static int is_dir_entry(const scrub_entry_t *e)
+{
+    return e->size < 0;
+}
+
+static int load_db(void)
+{
+    FILE *f = fopen(db_path, "r");
+    if (!f)
+        return errno == ENOENT ? 0 : -1;
+
+    uint64_t magic = 0;
+    if (fread(&magic, sizeof(magic), 1, f) != 1 || magic != DB_MAGIC)
+    {
+        fclose(f);
+        return 0;
+    }
+    db_record_t rec;
+    char rel[PATH_MAX];
+    while (fread(&rec, sizeof(rec), 1, f) == 1 && rec.path_len < PATH_MAX &&
+           fread(rel, 1, rec.path_len, f) == rec.path_len)
+    {
+        rel[rec.path_len] = '\0';
+        scrub_entry_t *e = malloc(sizeof(*e));
+        if (!e)
+            break;
+        *e = rec.e;
+        free(strmap_remove(&entries, rel));
+        strmap_put(&entries, rel, e);
+    }
+    fclose(f);
+    return 0;
+}
+
+static void save_record(const char *key, void *value, void *arg)
+{
+    FILE *f = arg;
+    scrub_entry_t *e = value;
+    db_record_t rec = {*e, strlen(key), is_dir_entry(e)};
+    fwrite(&rec, sizeof(rec), 1, f);
+    fwrite(key, 1, rec.path_len, f);
+}
+
+static void save_db(void)
+{
+    char tmp_path[PATH_MAX];
+    if (snprintf(tmp_path, PATH_MAX, "%s.tmp", db_path) >= PATH_MAX)
+        return;
+    FILE *f = fopen(tmp_path, "w");
+    if (!f)
+        return;
+    uint64_t magic = DB_MAGIC;
+    fwrite(&magic, sizeof(magic), 1, f);
+    strmap_foreach(&entries, save_record, f);
+    if (fclose(f) == 0)
+        rename(tmp_path, db_path);
+    else
+        unlink(tmp_path);
+}
+
+// printin finding and keepin it in the report log of the target
+static void report(const char *what, const char *rel)
+{
+    fprintf(stdout, "Scrub of %s: %s: %s\n", target_root, what, rel);
+    FILE *f = fopen(report_path, "a");
+    if (!f)
+        return;
+    char when[32];
+    time_t now = time(NULL);
+    struct tm tm;
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime_r(&now, &tm));
+    fprintf(f, "%s %s %s\n", when, what, rel);
+    fclose(f);
+}
+
+static void set_entry(const char *rel, const scrub_entry_t *value)
+{
+    scrub_entry_t *e = strmap_get(&entries, rel);
+    if (!e)
+    {
+        e = malloc(sizeof(*e));
+        if (!e || strmap_put(&entries, rel, e) == -1)
+        {
+            free(e);
+            return;
+        }
+    }
+    *e = *value;
+}
+
+static int add_child(frame_t *frame, const char *name, uint64_t hash)
+{
+    if (frame->count == frame->cap)
+    {
+        size_t cap = frame->cap ? frame->cap * 2 : 16;
+        child_t *tmp = realloc(frame->children, cap * sizeof(child_t));
+        if (!tmp)
+            return -1;
+        frame->children = tmp;
+        frame->cap = cap;
+    }
+    frame->children[frame->count].name = strdup(name);
+    if (!frame->children[frame->count].name)
+        return -1;
+    frame->children[frame->count++].hash = hash;
+    return 0;
+}
+
+static int push_dir(const char *rel)
+{
+    char path[PATH_MAX];
+    if (build_path(path, target_root, rel) == -1)
+        return -1;
+    if (depth == stack_cap)
+    {
+        size_t cap = stack_cap ? stack_cap * 2 : 8;
+        frame_t *tmp = realloc(stack, cap * sizeof(frame_t));
+        if (!tmp)
+            return -1;
+        stack = tmp;
+        stack_cap = cap;
+    }
+    frame_t *frame = &stack[depth];
+    memset(frame, 0, sizeof(*frame));
+    frame->dir = opendir(path);
+    if (!frame->dir)
+        return -1;
+    strcpy(frame->rel, rel);
+    depth++;
+    return 0;
+}
+
+static void free_frame(frame_t *frame)
+{
+    if (frame->dir)
+        closedir(frame->dir);
+    for (size_t i = 0; i < frame->count; i++)
+        free(frame->children[i].name);
+    free(frame->children);
+}
+
+static int compare_children(const void *a, const void *b)
+{
+    return strcmp(((const child_t *)a)->name, ((const child_t *)b)->name);
+}
+
+// closin finished dir, its hash goes into the parent
+static void pop_dir(void)
+{
+    frame_t *frame = &stack[depth - 1];
+    if (frame->count)
+        qsort(frame->children, frame->count, sizeof(child_t), compare_children);
+    hash_state_t st;
+    hash_init(&st, 0);
+    for (size_t i = 0; i < frame->count; i++)
+    {
+        hash_update(&st, frame->children[i].name, strlen(frame->children[i].name) + 1);
+        hash_update(&st, &frame->children[i].hash, sizeof(uint64_t));
+    }
+    scrub_entry_t e = {hash_digest(&st), -1, 0, time(NULL), pass_started};
+    set_entry(frame->rel, &e);
+
+    const char *slash = strrchr(frame->rel, '/');
+    char name[NAME_MAX + 1];
+    strncpy(name, slash ? slash + 1 : frame->rel, NAME_MAX);
+    name[NAME_MAX] = '\0';
+    free_frame(frame);
+    depth--;
+    if (depth)
+        add_child(&stack[depth - 1], name, e.hash);
+}
+
+static void close_job(void)
+{
+    if (job.dst_fd != -1)
+        close(job.dst_fd);
+    if (job.src_fd != -1)
+        close(job.src_fd);
+    job.dst_fd = -1;
+    job.src_fd = -1;
+    job.active = 0;
+}
+
+// copyin file again from source, through the journal like any other change of the mirror
+static int repair(const char *what)
+{
+    char src[PATH_MAX], dst[PATH_MAX];
+    if (build_path(src, source_root, job.rel) == -1 || build_path(dst, target_root, job.rel) == -1)
+        return -1;
+    // without the old file copy_file can't take the delta or append path,
+    // those trust their saved state and would keep the damaged bytes
+    journal_append(JOURNAL_SYNC, job.rel);
+    unlink(dst);
+    int ret = copy_file(src, dst);
+    journal_applied();
+    report(ret == 0 ? what : "repair failed", job.rel);
+    if (ret == 0)
+        repaired_count++;
+    return ret;
+}
+
+// comparin finished hashes, source is only read when there is no trusted hash for it yet
+static void finish_job(void)
+{
+    struct stat now_st;
+    int src_changed = fstat(job.src_fd, &now_st) == -1 || now_st.st_size != job.src_st.st_size ||
+                      !attr_same_mtime(&now_st, &job.src_st);
+    close_job();
+
+    // source changed under us, inotify brings the new version anyway
+    if (src_changed)
+        return;
+
+    uint64_t dst_hash = hash_digest(&job.dst_hash);
+    scrub_entry_t *known = strmap_get(&entries, job.rel);
+    uint64_t want = job.read_source || !known ? hash_digest(&job.src_hash) : known->hash;
+
+    verified_count++;
+    if (job.dst_size != job.src_st.st_size || dst_hash != want)
+    {
+        int ret = repair(job.dst_size != job.src_st.st_size ? "size mismatch repaired" : "corruption repaired");
+        // next pass hashes the fresh copy against the source again, till then the parent
+        // counts it with the source hash it was copied from, or with the damage it still has
+        free(strmap_remove(&entries, job.rel));
+        if (depth)
+            add_child(&stack[depth - 1], job.name, ret == 0 ? want : dst_hash);
+        return;
+    }
+
+    scrub_entry_t e = {want, job.src_st.st_size, attr_mtime_ns(&job.src_st), time(NULL), pass_started};
+    set_entry(job.rel, &e);
+    if (depth)
+        add_child(&stack[depth - 1], job.name, want);
+}
+
+// hashin next piece of current file, returns bytes read
+static long long step_job(long long max)
+{
+    static char buf[SCRUB_READ_LEN];
+    size_t want = max < SCRUB_READ_LEN ? (size_t)max : SCRUB_READ_LEN;
+
+    long long used = 0;
+    ssize_t got = pread(job.dst_fd, buf, want, job.offset);
+    if (got > 0)
+    {
+        hash_update(&job.dst_hash, buf, got);
+        used += got;
+    }
+    ssize_t src_got = 0;
+    if (job.read_source)
+    {
+        src_got = pread(job.src_fd, buf, want, job.offset);
+        if (src_got > 0)
+        {
+            hash_update(&job.src_hash, buf, src_got);
+            used += src_got;
+        }
+    }
+    job.offset += got > src_got ? got : src_got;
+    if (got <= 0 && src_got <= 0)
+        finish_job();
+    return used ? used : SCRUB_ENTRY_COST;
+}
+
+// startin to hash one file, source is read too when we have no hash we trust for it
+static void start_job(const char *rel, const char *name, const struct stat *src_st, const struct stat *dst_st)
+{
+    char src[PATH_MAX], dst[PATH_MAX];
+    if (build_path(src, source_root, rel) == -1 || build_path(dst, target_root, rel) == -1)
+        return;
+
+    memset(&job, 0, sizeof(job));
+    job.dst_fd = open(dst, O_RDONLY | O_CLOEXEC);
+    job.src_fd = open(src, O_RDONLY | O_CLOEXEC);
+    if (job.dst_fd == -1 || job.src_fd == -1)
+    {
+        close_job();
+        return;
+    }
+    posix_fadvise(job.dst_fd, 0, 0, POSIX_FADV_NOREUSE);
+    strcpy(job.rel, rel);
+    snprintf(job.name, sizeof(job.name), "%s", name);
+    job.src_st = *src_st;
+    job.dst_size = dst_st->st_size;
+    hash_init(&job.dst_hash, 0);
+    hash_init(&job.src_hash, 0);
+
+    // unchanged source with a recorded hash only needs the target read
+    scrub_entry_t *known = strmap_get(&entries, rel);
+    job.read_source = !(known && !is_dir_entry(known) && known->size == src_st->st_size &&
+                        known->mtime_ns == attr_mtime_ns(src_st));
+    job.active = 1;
+}
+
+static void collect_stale(const char *key, void *value, void *arg)
+{
+    scrub_entry_t *e = value;
+    strmap_t *stale = arg;
+    if (e->seen < pass_started)
+        strmap_put(stale, key, NULL);
+}
+
+static void drop_stale(const char *key, void *value, void *arg)
+{
+    free(strmap_remove(&entries, key));
+}
+
+// droppin nodes of files that were not seen in this pass, they are gone from the backup
+static void finish_pass(void)
+{
+    strmap_t stale;
+    if (strmap_init(&stale) == 0)
+    {
+        strmap_foreach(&entries, collect_stale, &stale);
+        strmap_foreach(&stale, drop_stale, NULL);
+        strmap_free(&stale, NULL);
+    }
+    save_db();
+    pass_finished = time(NULL);
+    fprintf(stdout, "Scrub pass of %s done: %lu files verified, %lu repaired\n", target_root, verified_count,
+            repaired_count);
+}
+
+// takin next entry of the walk, returns its cost
+static long long next_entry(void)
+{
+    frame_t *frame = &stack[depth - 1];
+    struct dirent *entry = readdir(frame->dir);
+    if (!entry)
+    {
+        pop_dir();
+        if (!depth)
+            finish_pass();
+        return SCRUB_ENTRY_COST;
+    }
+    // only the metadata dir at the top of the target is ours, deeper ones are user data
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+        (!frame->rel[0] && is_meta_name(entry->d_name)))
+        return 0;
+
+    char rel[PATH_MAX], dst[PATH_MAX], src[PATH_MAX];
+    if (snprintf(rel, PATH_MAX, "%s%s%s", frame->rel, frame->rel[0] ? "/" : "", entry->d_name) >= PATH_MAX ||
+        build_path(dst, target_root, rel) == -1 || build_path(src, source_root, rel) == -1)
+        return SCRUB_ENTRY_COST;
+
+    struct stat dst_st, src_st;
+    if (lstat(dst, &dst_st) == -1)
+        return SCRUB_ENTRY_COST;
+    if (S_ISDIR(dst_st.st_mode))
+    {
+        push_dir(rel);
+        return SCRUB_ENTRY_COST;
+    }
+    if (S_ISLNK(dst_st.st_mode))
+    {
+        char link_buf[PATH_MAX];
+        ssize_t len = readlink(dst, link_buf, PATH_MAX);
+        if (len > 0)
+            add_child(frame, entry->d_name, hash64(link_buf, len, 0));
+        return SCRUB_ENTRY_COST;
+    }
+    // files still bein written or already deleted in source are left to the events
+    if (!S_ISREG(dst_st.st_mode) || lstat(src, &src_st) == -1 || !S_ISREG(src_st.st_mode) ||
+        src_st.st_mtime >= time(NULL) - SCRUB_SETTLE_SECONDS)
+        return SCRUB_ENTRY_COST;
+
+    // verified durin this pass interval already, e.g. before the worker restarted
+    scrub_entry_t *known = strmap_get(&entries, rel);
+    if (known && !is_dir_entry(known) && known->size == src_st.st_size && known->mtime_ns == attr_mtime_ns(&src_st) &&
+        known->verified > time(NULL) - SCRUB_PASS_INTERVAL && known->verified >= pass_finished)
+    {
+        known->seen = pass_started;
+        add_child(frame, entry->d_name, known->hash);
+        return SCRUB_ENTRY_COST;
+    }
+    start_job(rel, entry->d_name, &src_st, &dst_st);
+    return SCRUB_ENTRY_COST;
+}
+
+int scrub_start(const char *source, const char *target, int rate_mib)
+{
+    if (rate_mib <= 0)
+        return 0;
+    if (meta_path(db_path, "merkle", "db") == -1 || meta_path(report_path, "merkle", "report") == -1 ||
+        strmap_init(&entries) == -1)
+        return -1;
+    snprintf(source_root, PATH_MAX, "%s", source);
+    snprintf(target_root, PATH_MAX, "%s", target);
+    if (load_db() == -1)
+        return -1;
+
+    rate = (long long)rate_mib * 1024 * 1024;
+    budget = 0;
+    pass_finished = 0;
+    clock_gettime(CLOCK_MONOTONIC, &last_tick);
+    started = 1;
+    return 0;
+}
+
+// doin as much scrubbin as the rate allows since last tick, called when the worker is idle
+void scrub_tick(void)
+{
+    if (!started)
+        return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long ms = (now.tv_sec - last_tick.tv_sec) * 1000LL + (now.tv_nsec - last_tick.tv_nsec) / 1000000;
+    last_tick = now;
+    budget += rate * ms / 1000;
+    if (budget > rate)
+        budget = rate;
+
+    if (!depth && !job.active)
+    {
+        if (pass_finished && time(NULL) - pass_finished < SCRUB_PASS_INTERVAL)
+            return;
+        verified_count = 0;
+        repaired_count = 0;
+        pass_started = time(NULL);
+        if (push_dir("") == -1)
+            return;
+    }
+
+    while (budget > 0 && (depth || job.active) && !should_exit)
+    {
+        if (job.active)
+            budget -= step_job(budget);
+        else
+            budget -= next_entry();
+    }
+}
+
+void scrub_stop(void)
+{
+    if (!started)
+        return;
+    close_job();
+    while (depth)
+    {
+        free_frame(&stack[depth - 1]);
+        depth--;
+    }
+    free(stack);
+    stack = NULL;
+    stack_cap = 0;
+    save_db();
+    strmap_free(&entries, free);
+    started = 0;
+}
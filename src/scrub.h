@@ -0,0 +1,14 @@
+// clang-format off
+#ifndef SCRUB_H
+#define SCRUB_H
+
+#define SCRUB_PASS_INTERVAL (24 * 60 * 60)
+#define SCRUB_READ_LEN (1024 * 1024)
+#define SCRUB_ENTRY_COST 4096
+#define SCRUB_SETTLE_SECONDS 2
+
+int scrub_start(const char *source, const char *target, int rate_mib);
+void scrub_tick(void);
+void scrub_stop(void);
+
+#endif
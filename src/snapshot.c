@@ -0,0 +1,464 @@
+// clang-format off
+#define _GNU_SOURCE
+#include "snapshot.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "attr.h"
+#include "backup.h"
+#include "durable.h"
+#include "iosched.h"
+#include "journal.h"
+#include "meta.h"
+#include "monitor.h"
+#include "strmap.h"
+#include "trash.h"
+#include "walk.h"
+
+#define SNAPSHOT_TIME_FORMAT "%Y-%m-%dT%H%M%SZ"
+#define FILE_BUF_LEN 65536
+
+// list of snapshot names, sorted oldest first
+typedef struct
+{
+    char **names;
+    size_t count;
+} snapshot_list_t;
+
+static int snapshots_dir(char *out, const char *target_root)
+{
+    int n = snprintf(out, PATH_MAX, "%s/%s/%s", target_root, META_DIR_NAME, SNAPSHOT_DIR_NAME);
+    return (n < 0 || n >= PATH_MAX) ? -1 : 0;
+}
+
+int snapshot_path(char *out, const char *target_root, const char *name)
+{
+    if (strchr(name, '/') || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        return -1;
+    int n = snprintf(out, PATH_MAX, "%s/%s/%s/%s", target_root, META_DIR_NAME, SNAPSHOT_DIR_NAME, name);
+    return (n < 0 || n >= PATH_MAX) ? -1 : 0;
+}
+
+static time_t name_to_time(const char *name)
+{
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char *end = strptime(name, SNAPSHOT_TIME_FORMAT, &tm);
+    if (!end || *end)
+        return (time_t)-1;
+    return timegm(&tm);
+}
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// readin finished snapshots, half made .tmp ones are skipped
+static int read_snapshots(const char *target_root, snapshot_list_t *list)
+{
+    list->names = NULL;
+    list->count = 0;
+
+    char dir_path[PATH_MAX];
+    if (snapshots_dir(dir_path, target_root) == -1)
+        return -1;
+    DIR *dir = opendir(dir_path);
+    if (!dir)
+        return errno == ENOENT ? 0 : -1;
+
+    size_t cap = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (name_to_time(entry->d_name) == (time_t)-1)
+            continue;
+        if (list->count == cap)
+        {
+            cap = cap ? cap * 2 : 16;
+            char **tmp = realloc(list->names, cap * sizeof(char *));
+            if (!tmp)
+                break;
+            list->names = tmp;
+        }
+        list->names[list->count++] = strdup(entry->d_name);
+    }
+    closedir(dir);
+    if (list->count)
+        qsort(list->names, list->count, sizeof(char *), compare_names);
+    return 0;
+}
+
+static void free_snapshots(snapshot_list_t *list)
+{
+    for (size_t i = 0; i < list->count; i++)
+        free(list->names[i]);
+    free(list->names);
+}
+
+time_t snapshot_latest_time(const char *target_root)
+{
+    snapshot_list_t list;
+    time_t t = 0;
+    if (read_snapshots(target_root, &list) == 0 && list.count)
+        t = name_to_time(list.names[list.count - 1]);
+    free_snapshots(&list);
+    return t;
+}
+
+// copyin bytes of one mirror file into snapshot, keepin mode and times
+static int copy_raw(const char *src, const char *dst, const struct stat *st)
+{
+    int in = open(src, O_RDONLY);
+    if (in == -1)
+        return -1;
+    int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, st->st_mode & 0777);
+    if (out == -1)
+    {
+        close(in);
+        return -1;
+    }
+    char buf[FILE_BUF_LEN];
+    int ret = 0;
+    for (;;)
+    {
+        ssize_t got = bulk_read(in, buf, sizeof(buf));
+        if (got <= 0)
+        {
+            ret = got < 0 ? -1 : 0;
+            break;
+        }
+        iosched_charge(got);
+        if (bulk_write(out, buf, got) == -1)
+        {
+            ret = -1;
+            break;
+        }
+    }
+    close(in);
+    durable_written(out);
+    close(out);
+    attr_copy_times(dst, st);
+    return ret;
+}
+
+static int copy_symlink_raw(const char *src, const char *dst)
+{
+    char link_buf[PATH_MAX];
+    ssize_t len = readlink(src, link_buf, PATH_MAX - 1);
+    if (len == -1)
+        return 0;
+    link_buf[len] = '\0';
+    return symlink(link_buf, dst) == -1 ? -1 : 0;
+}
+
+// copyin a subtree the journal says did not change, straight from previous snapshot
+static int link_prev_tree(const char *prev, const char *dst, unsigned long *linked, unsigned long *copied)
+{
+    struct stat st;
+    if (lstat(prev, &st) == -1 || !S_ISDIR(st.st_mode))
+        return -1;
+    walk_tree_t tree;
+    if (walk_tree_open(&tree, AT_FDCWD, prev, prev, dst) == -1)
+        return -1;
+    if (mkdir(dst, st.st_mode & 0777) == -1 && errno != EEXIST)
+    {
+        walk_tree_close(&tree);
+        return -1;
+    }
+
+    int ret = 0;
+    int step;
+    while (ret == 0 && (step = walk_tree_next(&tree)) > 0)
+    {
+        if (step == WALK_LEAVE)
+            continue;
+        if (walk_stat(tree.dir_fd, tree.name, &st) == -1)
+            continue;
+        if (S_ISDIR(st.st_mode))
+        {
+            if ((mkdir(tree.mirror, st.st_mode & 0777) == -1 && errno != EEXIST) || walk_tree_enter(&tree) == -1)
+                ret = -1;
+        }
+        else if (S_ISLNK(st.st_mode))
+        {
+            ret = copy_symlink_raw(tree.path, tree.mirror);
+        }
+        else if (S_ISREG(st.st_mode))
+        {
+            if (link(tree.path, tree.mirror) == 0)
+            {
+                (*linked)++;
+                continue;
+            }
+            ret = copy_raw(tree.path, tree.mirror, &st);
+            (*copied)++;
+        }
+    }
+    walk_tree_close(&tree);
+    return ret;
+}
+
+// buildin snapshot dir from the mirror, unchanged files are hard links to previous snapshot,
+// changed is the set of paths the journal saw since then or NULL when it can't tell
+static int link_tree(const char *mirror, const char *prev, const char *dst, const strmap_t *changed,
+                     unsigned long *linked, unsigned long *copied)
+{
+    struct stat st;
+    if (lstat(mirror, &st) == -1)
+        return -1;
+    if (mkdir(dst, st.st_mode & 0777) == -1 && errno != EEXIST)
+        return -1;
+
+    walk_tree_t tree;
+    if (walk_tree_open(&tree, AT_FDCWD, mirror, mirror, dst) == -1)
+        return -1;
+
+    int ret = 0;
+    int step;
+    char child_prev[PATH_MAX];
+    while (ret == 0 && (step = walk_tree_next(&tree)) > 0)
+    {
+        if (step == WALK_LEAVE || (tree.depth == 1 && is_meta_name(tree.name)))
+            continue;
+        if (prev && snprintf(child_prev, PATH_MAX, "%s/%s", prev, tree.rel) >= PATH_MAX)
+            continue;
+        if (walk_stat(tree.dir_fd, tree.name, &st) == -1)
+            continue;
+        int unchanged = prev && changed && !strmap_get(changed, tree.rel);
+        if (S_ISDIR(st.st_mode))
+        {
+            if (unchanged && link_prev_tree(child_prev, tree.mirror, linked, copied) == 0)
+                continue;
+            if ((mkdir(tree.mirror, st.st_mode & 0777) == -1 && errno != EEXIST) || walk_tree_enter(&tree) == -1)
+                ret = -1;
+        }
+        else if (S_ISLNK(st.st_mode))
+        {
+            ret = copy_symlink_raw(tree.path, tree.mirror);
+        }
+        else if (S_ISREG(st.st_mode))
+        {
+            struct stat prev_st;
+            if (unchanged && link(child_prev, tree.mirror) == 0)
+            {
+                (*linked)++;
+                continue;
+            }
+            if (prev && lstat(child_prev, &prev_st) == 0 && S_ISREG(prev_st.st_mode) &&
+                prev_st.st_size == st.st_size && attr_same_mtime(&prev_st, &st) &&
+                (prev_st.st_mode & 0777) == (st.st_mode & 0777) && link(child_prev, tree.mirror) == 0)
+            {
+                (*linked)++;
+                continue;
+            }
+            ret = copy_raw(tree.path, tree.mirror, &st);
+            (*copied)++;
+        }
+    }
+    walk_tree_close(&tree);
+    return ret;
+}
+
+// markin changed path and every dir above it, those dirs need a real walk
+static void mark_changed(journal_op_t op, const char *rel_path, void *arg)
+{
+    strmap_t *changed = arg;
+    char path[PATH_MAX];
+    strncpy(path, rel_path, PATH_MAX - 1);
+    path[PATH_MAX - 1] = '\0';
+    for (;;)
+    {
+        if (strmap_get(changed, path) || strmap_put(changed, path, (void *)1) == -1)
+            break;
+        char *slash = strrchr(path, '/');
+        if (!slash)
+            break;
+        *slash = '\0';
+    }
+}
+
+// packs are only ever appended to, so snapshot can hard link them and copy the index
+static int snapshot_packs(const char *target_root, const char *snap)
+{
+    char src_dir[PATH_MAX], dst_dir[PATH_MAX];
+    if (snprintf(src_dir, PATH_MAX, "%s/%s/packs", target_root, META_DIR_NAME) >= PATH_MAX ||
+        snprintf(dst_dir, PATH_MAX, "%s/%s/packs", snap, META_DIR_NAME) >= PATH_MAX)
+        return -1;
+    if (mkdir(dst_dir, 0700) == -1 && errno != EEXIST)
+        return -1;
+
+    DIR *dir = opendir(src_dir);
+    if (!dir)
+        return errno == ENOENT ? 0 : -1;
+    int ret = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL && ret == 0)
+    {
+        if (entry->d_name[0] == '.')
+            continue;
+        char src[PATH_MAX], dst[PATH_MAX];
+        if (snprintf(src, PATH_MAX, "%s/%s", src_dir, entry->d_name) >= PATH_MAX ||
+            snprintf(dst, PATH_MAX, "%s/%s", dst_dir, entry->d_name) >= PATH_MAX)
+            continue;
+        struct stat st;
+        if (lstat(src, &st) == -1)
+            continue;
+        if (strcmp(entry->d_name, "index") == 0 || link(src, dst) == -1)
+            ret = copy_raw(src, dst, &st);
+    }
+    closedir(dir);
+    return ret;
+}
+
+// takin point in time snapshot of the mirror
+int snapshot_create(const char *target_root, const backup_config_t *config)
+{
+    char dir_path[PATH_MAX];
+    if (snapshots_dir(dir_path, target_root) == -1)
+        return -1;
+    char meta_dir[PATH_MAX];
+    if (snprintf(meta_dir, PATH_MAX, "%s/%s", target_root, META_DIR_NAME) >= PATH_MAX)
+        return -1;
+    mkdir(meta_dir, 0700);
+    if (mkdir(dir_path, 0700) == -1 && errno != EEXIST)
+        return -1;
+
+    char name[64];
+    time_t now = time(NULL);
+    struct tm tm;
+    strftime(name, sizeof(name), SNAPSHOT_TIME_FORMAT, gmtime_r(&now, &tm));
+
+    char final_path[PATH_MAX], tmp_path[PATH_MAX], prev_path[PATH_MAX];
+    if (snapshot_path(final_path, target_root, name) == -1 ||
+        snprintf(tmp_path, PATH_MAX, "%s.tmp", final_path) >= PATH_MAX)
+        return -1;
+    if (access(final_path, F_OK) == 0)
+        return 0;
+    remove_path_recursive(tmp_path);
+
+    snapshot_list_t list;
+    read_snapshots(target_root, &list);
+    int have_prev = list.count > 0 && snapshot_path(prev_path, target_root, list.names[list.count - 1]) == 0;
+    free_snapshots(&list);
+
+    // journal tells what changed since previous snapshot, the rest is linked without lookin
+    strmap_t changed;
+    int have_changed = 0;
+    if (have_prev && strmap_init(&changed) == 0)
+    {
+        have_changed = journal_changed_since(name_to_time(strrchr(prev_path, '/') + 1), mark_changed, &changed) >= 0;
+        if (!have_changed)
+            strmap_free(&changed, NULL);
+    }
+
+    unsigned long linked = 0, copied = 0;
+    int ret = link_tree(target_root, have_prev ? prev_path : NULL, tmp_path, have_changed ? &changed : NULL,
+                        &linked, &copied);
+    if (have_changed)
+        strmap_free(&changed, NULL);
+
+    // snapshot is a target of its own, so restore can read it like any backup
+    backup_config_t snap_config = *config;
+    snap_config.snapshot_interval = 0;
+    if (ret == 0 && config->format == FORMAT_DEDUP && !config->store_path[0])
+    {
+        char chunks[PATH_MAX];
+        char *real = snprintf(chunks, PATH_MAX, "%s/chunks", meta_dir) < PATH_MAX ? realpath(chunks, NULL) : NULL;
+        if (real)
+        {
+            strncpy(snap_config.store_path, real, PATH_MAX - 1);
+            snap_config.store_path[PATH_MAX - 1] = '\0';
+            free(real);
+        }
+    }
+    if (ret == 0)
+        ret = config_save(&snap_config, tmp_path);
+    if (ret == 0 && config->format == FORMAT_PACKED)
+        ret = snapshot_packs(target_root, tmp_path);
+    if (ret == 0)
+        ret = rename(tmp_path, final_path);
+
+    if (ret == -1)
+    {
+        perror("Failed to create snapshot");
+        remove_path_recursive(tmp_path);
+        return -1;
+    }
+    fprintf(stdout, "Snapshot %s created (%lu files linked, %lu copied)\n", name, linked, copied);
+    return 0;
+}
+
+// keepin newest snapshot of each of the last N hours, days and weeks, deletin the rest
+int snapshot_prune(const char *target_root, const backup_config_t *config)
+{
+    int keep_hourly = config->keep_hourly >= 0 ? config->keep_hourly : DEFAULT_KEEP_HOURLY;
+    int keep_daily = config->keep_daily >= 0 ? config->keep_daily : DEFAULT_KEEP_DAILY;
+    int keep_weekly = config->keep_weekly >= 0 ? config->keep_weekly : DEFAULT_KEEP_WEEKLY;
+
+    snapshot_list_t list;
+    if (read_snapshots(target_root, &list) == -1)
+        return -1;
+
+    long last_hour = -1, last_day = -1, last_week = -1;
+    int hours = 0, days = 0, weeks = 0;
+    for (size_t i = list.count; i-- > 0;)
+    {
+        time_t t = name_to_time(list.names[i]);
+        long hour = t / 3600;
+        long day = t / 86400;
+        // 1970-01-01 was thursday, shift so weeks start on monday
+        long week = (day + 3) / 7;
+
+        int keep = i == list.count - 1;
+        if (hour != last_hour && hours < keep_hourly)
+        {
+            keep = 1;
+            hours++;
+            last_hour = hour;
+        }
+        if (day != last_day && days < keep_daily)
+        {
+            keep = 1;
+            days++;
+            last_day = day;
+        }
+        if (week != last_week && weeks < keep_weekly)
+        {
+            keep = 1;
+            weeks++;
+            last_week = week;
+        }
+        if (keep)
+            continue;
+
+        char path[PATH_MAX];
+        // in a worker the snapshot goes to the trash thread, so prunin never stalls events
+        if (snapshot_path(path, target_root, list.names[i]) == 0 &&
+            (trash_move(path) == 0 || remove_path_recursive(path) == 0))
+            fprintf(stdout, "Snapshot %s expired\n", list.names[i]);
+    }
+    free_snapshots(&list);
+    return 0;
+}
+
+// printin snapshots of a backup
+int snapshot_list(const char *target_root)
+{
+    snapshot_list_t list;
+    if (read_snapshots(target_root, &list) == -1)
+        return -1;
+    if (!list.count)
+        fprintf(stdout, "No snapshots.\n");
+    for (size_t i = 0; i < list.count; i++)
+        fprintf(stdout, "%s\n", list.names[i]);
+    free_snapshots(&list);
+    return 0;
+}
@@ -0,0 +1,16 @@
+// clang-format off
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <time.h>
+#include "config.h"
+
+#define SNAPSHOT_DIR_NAME "snapshots"
+
+int snapshot_create(const char *target_root, const backup_config_t *config);
+int snapshot_prune(const char *target_root, const backup_config_t *config);
+time_t snapshot_latest_time(const char *target_root);
+int snapshot_list(const char *target_root);
+int snapshot_path(char *out, const char *target_root, const char *name);
+
+#endif
@@ -0,0 +1,151 @@
+// clang-format off
+#define _GNU_SOURCE
+#include "strmap.h"
+#include <stdlib.h>
+#include <string.h>
+#include "hash.h"
+
+// hash map from path strings to anything, chained buckets, grows at load 1
+
+#define STRMAP_INITIAL_CAP 64
+
+static size_t bucket_of(const strmap_t *m, const char *key)
+{
+    return hash64(key, strlen(key), 0) & (m->cap - 1);
+}
+
+int strmap_init(strmap_t *m)
+{
+    m->cap = STRMAP_INITIAL_CAP;
+    m->count = 0;
+    m->buckets = calloc(m->cap, sizeof(strmap_entry_t *));
+    return m->buckets ? 0 : -1;
+}
+
+void strmap_free(strmap_t *m, void (*free_value)(void *))
+{
+    if (!m->buckets)
+        return;
+    for (size_t i = 0; i < m->cap; i++)
+    {
+        strmap_entry_t *e = m->buckets[i];
+        while (e)
+        {
+            strmap_entry_t *next = e->next;
+            if (free_value)
+                free_value(e->value);
+            free(e->key);
+            free(e);
+            e = next;
+        }
+    }
+    free(m->buckets);
+    m->buckets = NULL;
+    m->cap = 0;
+    m->count = 0;
+}
+
+void *strmap_get(const strmap_t *m, const char *key)
+{
+    if (!m->buckets)
+        return NULL;
+    for (strmap_entry_t *e = m->buckets[bucket_of(m, key)]; e; e = e->next)
+    {
+        if (strcmp(e->key, key) == 0)
+            return e->value;
+    }
+    return NULL;
+}
+
+// doublin bucket array and rehashin all entries
+static int grow(strmap_t *m)
+{
+    size_t new_cap = m->cap * 2;
+    strmap_entry_t **nb = calloc(new_cap, sizeof(strmap_entry_t *));
+    if (!nb)
+        return -1;
+    for (size_t i = 0; i < m->cap; i++)
+    {
+        strmap_entry_t *e = m->buckets[i];
+        while (e)
+        {
+            strmap_entry_t *next = e->next;
+            size_t b = hash64(e->key, strlen(e->key), 0) & (new_cap - 1);
+            e->next = nb[b];
+            nb[b] = e;
+            e = next;
+        }
+    }
+    free(m->buckets);
+    m->buckets = nb;
+    m->cap = new_cap;
+    return 0;
+}
+
+// addin or replacin value for key, old value is not freed
+int strmap_put(strmap_t *m, const char *key, void *value)
+{
+    if (!m->buckets && strmap_init(m) == -1)
+        return -1;
+    size_t b = bucket_of(m, key);
+    for (strmap_entry_t *e = m->buckets[b]; e; e = e->next)
+    {
+        if (strcmp(e->key, key) == 0)
+        {
+            e->value = value;
+            return 0;
+        }
+    }
+
+    if (m->count >= m->cap && grow(m) == 0)
+        b = bucket_of(m, key);
+
+    strmap_entry_t *e = malloc(sizeof(*e));
+    if (!e)
+        return -1;
+    e->key = strdup(key);
+    if (!e->key)
+    {
+        free(e);
+        return -1;
+    }
+    e->value = value;
+    e->next = m->buckets[b];
+    m->buckets[b] = e;
+    m->count++;
+    return 0;
+}
+
+// removin key, returns its value so caller can free it
+void *strmap_remove(strmap_t *m, const char *key)
+{
+    if (!m->buckets)
+        return NULL;
+    strmap_entry_t **pp = &m->buckets[bucket_of(m, key)];
+    while (*pp)
+    {
+        strmap_entry_t *e = *pp;
+        if (strcmp(e->key, key) == 0)
+        {
+            void *value = e->value;
+            *pp = e->next;
+            free(e->key);
+            free(e);
+            m->count--;
+            return value;
+        }
+        pp = &e->next;
+    }
+    return NULL;
+}
+
+void strmap_foreach(const strmap_t *m, void (*fn)(const char *key, void *value, void *arg), void *arg)
+{
+    if (!m->buckets)
+        return;
+    for (size_t i = 0; i < m->cap; i++)
+    {
+        for (strmap_entry_t *e = m->buckets[i]; e; e = e->next)
+            fn(e->key, e->value, arg);
+    }
+}
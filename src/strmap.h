@@ -0,0 +1,28 @@
+// clang-format off
+#ifndef STRMAP_H
+#define STRMAP_H
+
+#include <stddef.h>
+
+typedef struct strmap_entry
+{
+    char *key;
+    void *value;
+    struct strmap_entry *next;
+} strmap_entry_t;
+
+typedef struct
+{
+    strmap_entry_t **buckets;
+    size_t cap;
+    size_t count;
+} strmap_t;
+
+int strmap_init(strmap_t *m);
+void strmap_free(strmap_t *m, void (*free_value)(void *));
+void *strmap_get(const strmap_t *m, const char *key);
+int strmap_put(strmap_t *m, const char *key, void *value);
+void *strmap_remove(strmap_t *m, const char *key);
+void strmap_foreach(const strmap_t *m, void (*fn)(const char *key, void *value, void *arg), void *arg);
+
+#endif
@@ -0,0 +1,175 @@
+// clang-format off
+#define _GNU_SOURCE
+#include "trash.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "meta.h"
+#include "walk.h"
+
+// deleted dirs are renamed into <target>/.sop-backup/trash and unlinked here on a thread,
+// so a huge delete costs the event loop one rename
+static pthread_t thread;
+static int running;
+static int stopping;
+static int pending;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static char trash_dir[PATH_MAX];
+static unsigned counter;
+
+// unlinks counted in batches, a batch done too fast waits so disks stay free for real writes
+static int64_t batch_start_ms;
+static int batch_count;
+
+static int64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static int should_stop(void)
+{
+    pthread_mutex_lock(&lock);
+    int ret = stopping;
+    pthread_mutex_unlock(&lock);
+    return ret;
+}
+
+static void throttle(void)
+{
+    if (++batch_count < TRASH_BATCH)
+        return;
+    int64_t spent = now_ms() - batch_start_ms;
+    int64_t wanted = TRASH_BATCH * 1000LL / TRASH_RATE;
+    if (spent < wanted)
+        usleep((wanted - spent) * 1000);
+    batch_count = 0;
+    batch_start_ms = now_ms();
+}
+
+static int delete_one(int dir_fd, const char *name, int type)
+{
+    if (should_stop())
+        return -1;
+    if (unlinkat(dir_fd, name, type == DT_DIR ? AT_REMOVEDIR : 0) == -1 && errno != ENOENT)
+        fprintf(stderr, "Failed to remove trashed %s: %s\n", name, strerror(errno));
+    throttle();
+    return 0;
+}
+
+// removin one trashed entry, names go relative to dir fds like remove_path_recursive,
+// returns -1 when stopped halfway, the rest is picked up after the next start
+static int delete_at(int parent_fd, const char *name, int type)
+{
+    char path[PATH_MAX];
+    walk_tree_t tree;
+    if (type != DT_DIR || snprintf(path, PATH_MAX, "%s/%s", trash_dir, name) >= PATH_MAX ||
+        walk_tree_open(&tree, parent_fd, name, path, NULL) == -1)
+        return delete_one(parent_fd, name, type);
+
+    int ret = 0;
+    int step;
+    while (ret == 0 && (step = walk_tree_next(&tree)) > 0)
+    {
+        if (step == WALK_ENTRY && tree.type == DT_DIR && walk_tree_enter(&tree) == 0)
+            continue;
+        ret = delete_one(tree.dir_fd, tree.name, tree.type);
+    }
+    walk_tree_close(&tree);
+    return ret;
+}
+
+static void *trash_thread(void *arg)
+{
+    (void)arg;
+    batch_start_ms = now_ms();
+    for (;;)
+    {
+        // whatever is there, also leftovers of a worker that died before emptyin it
+        walk_dir_t dir;
+        if (walk_open(&dir, AT_FDCWD, trash_dir) == 0)
+        {
+            const char *entry;
+            int type;
+            while (walk_next(&dir, &entry, &type) == 1 && delete_at(dir.fd, entry, type) == 0)
+                ;
+            walk_close(&dir);
+        }
+
+        pthread_mutex_lock(&lock);
+        while (!pending && !stopping)
+            pthread_cond_wait(&wake, &lock);
+        int done = stopping;
+        pending = 0;
+        pthread_mutex_unlock(&lock);
+        if (done)
+            return NULL;
+    }
+}
+
+// startin the deleter of this worker, without a metadata dir deletes just stay synchronous
+int trash_start(void)
+{
+    if (running || meta_path(trash_dir, TRASH_KIND, "") == -1)
+        return -1;
+    size_t len = strlen(trash_dir);
+    while (len > 1 && trash_dir[len - 1] == '/')
+        trash_dir[--len] = '\0';
+
+    stopping = 0;
+    pending = 0;
+    if (pthread_create(&thread, NULL, trash_thread, NULL) != 0)
+        return -1;
+    running = 1;
+    return 0;
+}
+
+// movin a dir out of the target in one rename, -1 means the caller deletes it itself
+int trash_move(const char *path)
+{
+    struct stat st;
+    if (!running || lstat(path, &st) == -1 || !S_ISDIR(st.st_mode))
+        return -1;
+
+    char dest[PATH_MAX];
+    for (int i = 0; i < TRASH_TRIES; i++)
+    {
+        if (snprintf(dest, PATH_MAX, "%s/%ld.%d.%u", trash_dir, (long)time(NULL), (int)getpid(), counter++) >=
+            PATH_MAX)
+            return -1;
+        if (rename(path, dest) == 0)
+        {
+            pthread_mutex_lock(&lock);
+            pending = 1;
+            pthread_cond_signal(&wake);
+            pthread_mutex_unlock(&lock);
+            return 0;
+        }
+        if (errno != EEXIST && errno != ENOTEMPTY)
+            return -1;
+    }
+    return -1;
+}
+
+// stoppin without waitin for the trash to empty, it is still there on the next start
+void trash_stop(void)
+{
+    if (!running)
+        return;
+    pthread_mutex_lock(&lock);
+    stopping = 1;
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&lock);
+    pthread_join(thread, NULL);
+    running = 0;
+}
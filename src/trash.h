@@ -0,0 +1,14 @@
+// clang-format off
+#ifndef TRASH_H
+#define TRASH_H
+
+#define TRASH_KIND "trash"
+#define TRASH_RATE 5000
+#define TRASH_BATCH 100
+#define TRASH_TRIES 4
+
+int trash_start(void);
+int trash_move(const char *path);
+void trash_stop(void);
+
+#endif
@@ -0,0 +1,364 @@
+// clang-format off
+#define _GNU_SOURCE
+#include "walk.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// record layout getdents64 fills the buffer with
+typedef struct
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+} dirent64_t;
+
+// openin dir relative to an already open parent, so the kernel does not walk
+// the whole path again, AT_FDCWD with a full path works too
+int walk_open(walk_dir_t *dir, int parent_fd, const char *name)
+{
+    dir->buf = NULL;
+    dir->len = 0;
+    dir->pos = 0;
+    dir->off = 0;
+    dir->fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (dir->fd == -1)
+        return -1;
+    dir->buf = malloc(WALK_BUF_LEN);
+    if (!dir->buf)
+    {
+        close(dir->fd);
+        dir->fd = -1;
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+// next entry without . and .., type is DT_DIR/DT_REG/DT_LNK/... straight from
+// the dirent, only filesystems that leave it unknown cost a statx
+int walk_next(walk_dir_t *dir, const char **name, int *type)
+{
+    for (;;)
+    {
+        if (dir->pos >= dir->len)
+        {
+            long n = syscall(SYS_getdents64, dir->fd, dir->buf, WALK_BUF_LEN);
+            if (n <= 0)
+                return n == 0 ? 0 : -1;
+            dir->len = n;
+            dir->pos = 0;
+        }
+        dirent64_t *d = (dirent64_t *)(dir->buf + dir->pos);
+        dir->pos += d->d_reclen;
+        // where the listin goes on after this entry, a closed dir is reopened there
+        dir->off = d->d_off;
+        if (d->d_name[0] == '.' && (d->d_name[1] == '\0' || (d->d_name[1] == '.' && d->d_name[2] == '\0')))
+            continue;
+
+        *name = d->d_name;
+        *type = d->d_type;
+        if (*type == DT_UNKNOWN)
+        {
+            *type = walk_type(dir->fd, d->d_name);
+            // gone since the dir was read
+            if (*type == DT_UNKNOWN)
+                continue;
+        }
+        return 1;
+    }
+}
+
+void walk_close(walk_dir_t *dir)
+{
+    if (dir->fd != -1)
+        close(dir->fd);
+    free(dir->buf);
+    dir->fd = -1;
+    dir->buf = NULL;
+}
+
+// askin only for the type, the rest of the inode is not needed
+int walk_type(int dir_fd, const char *name)
+{
+    struct statx stx;
+    if (statx(dir_fd, name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, STATX_TYPE, &stx) == -1)
+        return DT_UNKNOWN;
+    return IFTODT(stx.stx_mode);
+}
+
+int walk_stat(int dir_fd, const char *name, struct stat *st)
+{
+    return fstatat(dir_fd, name, st, AT_SYMLINK_NOFOLLOW);
+}
+
+// backup roots do not move while a worker runs, resolvin them once is enough
+typedef struct
+{
+    char *path;
+    char *real;
+} realpath_entry_t;
+
+static realpath_entry_t realpaths[WALK_REALPATH_CACHE];
+static int realpath_next;
+
+const char *walk_realpath(const char *path)
+{
+    for (int i = 0; i < WALK_REALPATH_CACHE; i++)
+    {
+        if (realpaths[i].path && strcmp(realpaths[i].path, path) == 0)
+            return realpaths[i].real;
+    }
+    char *real = realpath(path, NULL);
+    if (!real)
+        return NULL;
+    char *copy = strdup(path);
+    if (!copy)
+    {
+        free(real);
+        return NULL;
+    }
+    realpath_entry_t *e = &realpaths[realpath_next];
+    realpath_next = (realpath_next + 1) % WALK_REALPATH_CACHE;
+    free(e->path);
+    free(e->real);
+    e->path = copy;
+    e->real = real;
+    return real;
+}
+
+// how many dirs of one walk may be open at once, each holds an fd and a read buffer
+static int walk_fd_budget = WALK_FD_BUDGET;
+static size_t walk_mem_cap = WALK_MEM_CAP;
+
+// 0 keeps the default, limits apply to each walk on its own
+void walk_set_limits(int fd_budget, int mem_mib)
+{
+    walk_fd_budget = fd_budget > 0 ? fd_budget : WALK_FD_BUDGET;
+    walk_mem_cap = mem_mib > 0 ? (size_t)mem_mib * 1024 * 1024 : WALK_MEM_CAP;
+}
+
+// walkin a whole tree without recursion, levels deeper than the budget keep the dirs
+// above them closed and only remember where their listin stopped, so a walk holds
+// a bounded number of fds and buffers whatever the depth, path is the root as seen
+// from the cwd and is used to reopen closed levels, mirror is an optional second
+// root that gets the same relative path as each entry
+int walk_tree_open(walk_tree_t *tree, int parent_fd, const char *name, const char *path, const char *mirror)
+{
+    memset(tree, 0, sizeof(*tree));
+    size_t len = strlen(path);
+    size_t mirror_len = mirror ? strlen(mirror) : 0;
+    if (len >= PATH_MAX || mirror_len >= PATH_MAX)
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    size_t by_mem = walk_mem_cap / WALK_BUF_LEN;
+    tree->open_max = by_mem < (size_t)walk_fd_budget ? (int)by_mem : walk_fd_budget;
+    if (tree->open_max < 1)
+        tree->open_max = 1;
+    tree->levels = malloc(8 * sizeof(walk_level_t));
+    if (!tree->levels)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    tree->cap = 8;
+
+    walk_level_t *root = &tree->levels[0];
+    if (walk_open(&root->dir, parent_fd, name) == -1 || fstat(root->dir.fd, &root->st) == -1)
+    {
+        int saved = errno;
+        walk_close(&root->dir);
+        free(tree->levels);
+        tree->levels = NULL;
+        errno = saved;
+        return -1;
+    }
+    root->path_len = len;
+    root->name_off = 0;
+    root->count = 0;
+    tree->depth = 1;
+    tree->root_fd = parent_fd;
+    tree->root_name = name;
+    tree->root_len = len;
+    memcpy(tree->path, path, len + 1);
+    tree->has_mirror = mirror != NULL;
+    tree->mirror_root_len = mirror_len;
+    if (mirror)
+        memcpy(tree->mirror, mirror, mirror_len + 1);
+    tree->rel = tree->path + len;
+    tree->name = name;
+    tree->type = DT_DIR;
+    tree->dir_fd = parent_fd;
+    tree->st = &root->st;
+    return 0;
+}
+
+// closin the shallowest open level to stay in budget, its cookie says where to go on
+static void suspend_level(walk_tree_t *tree)
+{
+    walk_level_t *level = &tree->levels[tree->first_open++];
+    close(level->dir.fd);
+    free(level->dir.buf);
+    level->dir.fd = -1;
+    level->dir.buf = NULL;
+}
+
+// reopenin the level the walk came back to, a dir replaced meanwhile is not walked further,
+// filesystems that can't seek to a cookie get the entries already done skipped by count
+static int resume_level(walk_tree_t *tree, walk_level_t *level)
+{
+    char saved = tree->path[level->path_len];
+    tree->path[level->path_len] = '\0';
+    off_t off = level->dir.off;
+    int ret = walk_open(&level->dir, AT_FDCWD, tree->path);
+    tree->path[level->path_len] = saved;
+    tree->first_open--;
+
+    struct stat st;
+    if (ret == -1 || fstat(level->dir.fd, &st) == -1 || st.st_dev != level->st.st_dev ||
+        st.st_ino != level->st.st_ino)
+    {
+        walk_close(&level->dir);
+        return -1;
+    }
+    if (lseek(level->dir.fd, off, SEEK_SET) == off)
+    {
+        level->dir.off = off;
+        return 0;
+    }
+    lseek(level->dir.fd, 0, SEEK_SET);
+    const char *entry;
+    int type;
+    for (long i = 0; i < level->count && walk_next(&level->dir, &entry, &type) == 1; i++)
+        ;
+    return 0;
+}
+
+// next step of the walk, WALK_ENTRY for each entry of the current dir, WALK_LEAVE once a dir
+// is done (root last), 0 at the end, dir_fd and name open the entry or the dir left and stay
+// valid until the next call
+int walk_tree_next(walk_tree_t *tree)
+{
+    while (tree->depth > 0)
+    {
+        walk_level_t *top = &tree->levels[tree->depth - 1];
+        const char *entry;
+        int type;
+        if (top->dir.fd != -1 && walk_next(&top->dir, &entry, &type) == 1)
+        {
+            top->count++;
+            size_t name_len = strlen(entry);
+            size_t mirror_len = top->path_len - tree->root_len + tree->mirror_root_len;
+            if (top->path_len + name_len + 2 > PATH_MAX || (tree->has_mirror && mirror_len + name_len + 2 > PATH_MAX))
+            {
+                fprintf(stderr, "Path too long, skipped: %.*s/%s\n", (int)top->path_len, tree->path, entry);
+                continue;
+            }
+            tree->path[top->path_len] = '/';
+            memcpy(tree->path + top->path_len + 1, entry, name_len + 1);
+            if (tree->has_mirror)
+            {
+                tree->mirror[mirror_len] = '/';
+                memcpy(tree->mirror + mirror_len + 1, entry, name_len + 1);
+            }
+            tree->rel = tree->path + tree->root_len + 1;
+            tree->name = tree->path + top->path_len + 1;
+            tree->type = type;
+            tree->dir_fd = top->dir.fd;
+            tree->st = NULL;
+            return WALK_ENTRY;
+        }
+
+        // dir is done, the one above takes over
+        walk_close(&top->dir);
+        tree->depth--;
+        tree->path[top->path_len] = '\0';
+        if (tree->has_mirror)
+            tree->mirror[top->path_len - tree->root_len + tree->mirror_root_len] = '\0';
+        tree->rel = tree->depth ? tree->path + tree->root_len + 1 : tree->path + tree->root_len;
+        tree->type = DT_DIR;
+        tree->st = &top->st;
+        if (tree->depth == 0)
+        {
+            tree->first_open = 0;
+            tree->dir_fd = tree->root_fd;
+            tree->name = tree->root_name;
+            return WALK_LEAVE;
+        }
+        walk_level_t *parent = top - 1;
+        if (tree->depth - 1 < tree->first_open && resume_level(tree, parent) == -1)
+        {
+            if (errno != ENOENT)
+                fprintf(stderr, "Cannot reopen %.*s: %s\n", (int)parent->path_len, tree->path, strerror(errno));
+        }
+        tree->dir_fd = parent->dir.fd;
+        tree->name = tree->path + top->name_off;
+        return WALK_LEAVE;
+    }
+    return 0;
+}
+
+// goin into the dir the last WALK_ENTRY returned, its entries come next
+int walk_tree_enter(walk_tree_t *tree)
+{
+    if (tree->depth == 0 || tree->type != DT_DIR || tree->st)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (tree->depth == tree->cap)
+    {
+        walk_level_t *levels = realloc(tree->levels, tree->cap * 2 * sizeof(walk_level_t));
+        if (!levels)
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+        tree->levels = levels;
+        tree->cap *= 2;
+    }
+    walk_level_t *parent = &tree->levels[tree->depth - 1];
+    walk_level_t *level = &tree->levels[tree->depth];
+    if (walk_open(&level->dir, parent->dir.fd, tree->name) == -1 || fstat(level->dir.fd, &level->st) == -1)
+    {
+        int saved = errno;
+        walk_close(&level->dir);
+        errno = saved;
+        return -1;
+    }
+    level->path_len = strlen(tree->path);
+    level->name_off = tree->name - tree->path;
+    level->count = 0;
+    tree->depth++;
+    if (tree->depth - tree->first_open > tree->open_max)
+        suspend_level(tree);
+    tree->dir_fd = level->dir.fd;
+    tree->st = &level->st;
+    return 0;
+}
+
+// fd of the dir whose entries are listed now
+int walk_tree_fd(const walk_tree_t *tree)
+{
+    return tree->depth ? tree->levels[tree->depth - 1].dir.fd : -1;
+}
+
+void walk_tree_close(walk_tree_t *tree)
+{
+    for (int i = 0; i < tree->depth; i++)
+        walk_close(&tree->levels[i].dir);
+    free(tree->levels);
+    tree->levels = NULL;
+    tree->depth = 0;
+}
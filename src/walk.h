@@ -0,0 +1,68 @@
+// clang-format off
+#ifndef WALK_H
+#define WALK_H
+
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define WALK_BUF_LEN (32 * 1024)
+#define WALK_REALPATH_CACHE 4
+#define WALK_FD_BUDGET 64
+#define WALK_MEM_CAP (4 * 1024 * 1024)
+#define WALK_ENTRY 1
+#define WALK_LEAVE 2
+
+typedef struct
+{
+    int fd;
+    char *buf;
+    long len;
+    long pos;
+    off_t off;
+} walk_dir_t;
+
+typedef struct
+{
+    walk_dir_t dir;
+    size_t path_len;
+    size_t name_off;
+    long count;
+    struct stat st;
+} walk_level_t;
+
+typedef struct
+{
+    walk_level_t *levels;
+    int depth;
+    int cap;
+    int first_open;
+    int open_max;
+    int root_fd;
+    const char *root_name;
+    size_t root_len;
+    size_t mirror_root_len;
+    int has_mirror;
+    char path[PATH_MAX];
+    char mirror[PATH_MAX];
+    const char *rel;
+    const char *name;
+    int type;
+    int dir_fd;
+    const struct stat *st;
+} walk_tree_t;
+
+int walk_open(walk_dir_t *dir, int parent_fd, const char *name);
+int walk_next(walk_dir_t *dir, const char **name, int *type);
+void walk_close(walk_dir_t *dir);
+int walk_type(int dir_fd, const char *name);
+int walk_stat(int dir_fd, const char *name, struct stat *st);
+const char *walk_realpath(const char *path);
+void walk_set_limits(int fd_budget, int mem_mib);
+int walk_tree_open(walk_tree_t *tree, int parent_fd, const char *name, const char *path, const char *mirror);
+int walk_tree_next(walk_tree_t *tree);
+int walk_tree_enter(walk_tree_t *tree);
+int walk_tree_fd(const walk_tree_t *tree);
+void walk_tree_close(walk_tree_t *tree);
+
+#endif
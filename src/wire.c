@@ -0,0 +1,241 @@
+// clang-format off
+#define _GNU_SOURCE
+#include "wire.h"
+#include <endian.h>
+#include <errno.h>
+#include <limits.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// targets and receivers are named unix:<socket path> or tcp:[<host>:]<port>
+int wire_is_endpoint(const char *spec)
+{
+    return strncmp(spec, WIRE_UNIX_PREFIX, strlen(WIRE_UNIX_PREFIX)) == 0 ||
+           strncmp(spec, WIRE_TCP_PREFIX, strlen(WIRE_TCP_PREFIX)) == 0;
+}
+
+static int unix_addr(const char *spec, struct sockaddr_un *addr)
+{
+    const char *path = spec + strlen(WIRE_UNIX_PREFIX);
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (!*path || strlen(path) >= sizeof(addr->sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+// splittin tcp:host:port, host is optional and may be [v6 address]
+static struct addrinfo *tcp_addr(const char *spec, int passive)
+{
+    char host[NI_MAXHOST] = "";
+    const char *rest = spec + strlen(WIRE_TCP_PREFIX);
+    const char *port = strrchr(rest, ':');
+    if (port)
+    {
+        size_t len = port - rest;
+        if (len >= sizeof(host))
+        {
+            errno = ENAMETOOLONG;
+            return NULL;
+        }
+        memcpy(host, rest, len);
+        host[len] = '\0';
+        port++;
+    }
+    else
+    {
+        port = rest;
+    }
+    size_t len = strlen(host);
+    if (len >= 2 && host[0] == '[' && host[len - 1] == ']')
+    {
+        memmove(host, host + 1, len - 2);
+        host[len - 2] = '\0';
+    }
+
+    struct addrinfo hints, *res = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+    if (getaddrinfo(host[0] ? host : NULL, port, &hints, &res) != 0)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    return res;
+}
+
+int wire_connect(const char *spec)
+{
+    if (strncmp(spec, WIRE_UNIX_PREFIX, strlen(WIRE_UNIX_PREFIX)) == 0)
+    {
+        struct sockaddr_un addr;
+        if (unix_addr(spec, &addr) == -1)
+            return -1;
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd == -1)
+            return -1;
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+        {
+            int saved = errno;
+            close(fd);
+            errno = saved;
+            return -1;
+        }
+        return fd;
+    }
+
+    struct addrinfo *res = tcp_addr(spec, 0);
+    if (!res)
+        return -1;
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai && fd == -1; ai = ai->ai_next)
+    {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd != -1 && connect(fd, ai->ai_addr, ai->ai_addrlen) == -1)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    if (fd == -1)
+        return -1;
+    // frames are batched by the sender already, no need to wait for more
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+// listenin on the endpoint, a unix socket left by a killed receiver is replaced
+int wire_listen(const char *spec)
+{
+    if (strncmp(spec, WIRE_UNIX_PREFIX, strlen(WIRE_UNIX_PREFIX)) == 0)
+    {
+        struct sockaddr_un addr;
+        if (unix_addr(spec, &addr) == -1)
+            return -1;
+        struct stat st;
+        if (lstat(addr.sun_path, &st) == 0 && S_ISSOCK(st.st_mode))
+        {
+            int probe = wire_connect(spec);
+            if (probe == -1 && errno == ECONNREFUSED)
+                unlink(addr.sun_path);
+            if (probe != -1)
+                close(probe);
+        }
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd == -1)
+            return -1;
+        if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, WIRE_BACKLOG) == -1)
+        {
+            int saved = errno;
+            close(fd);
+            errno = saved;
+            return -1;
+        }
+        return fd;
+    }
+
+    struct addrinfo *res = tcp_addr(spec, 1);
+    if (!res)
+        return -1;
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai && fd == -1; ai = ai->ai_next)
+    {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd == -1)
+            continue;
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == -1 || listen(fd, WIRE_BACKLOG) == -1)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+void wire_unlink(const char *spec)
+{
+    if (strncmp(spec, WIRE_UNIX_PREFIX, strlen(WIRE_UNIX_PREFIX)) == 0)
+        unlink(spec + strlen(WIRE_UNIX_PREFIX));
+}
+
+// headers go out big endian so both ends may be diferent machines
+void wire_encode(uint8_t *buf, const wire_frame_t *frame)
+{
+    uint16_t path_len = htobe16(frame->path_len);
+    uint32_t mode = htobe32(frame->mode), uid = htobe32(frame->uid), gid = htobe32(frame->gid);
+    uint64_t seq = htobe64(frame->seq), size = htobe64(frame->size);
+    uint64_t atime = htobe64((uint64_t)frame->atime_ns), mtime = htobe64((uint64_t)frame->mtime_ns);
+
+    buf[0] = frame->op;
+    buf[1] = 0;
+    memcpy(buf + 2, &path_len, 2);
+    memcpy(buf + 4, &mode, 4);
+    memcpy(buf + 8, &uid, 4);
+    memcpy(buf + 12, &gid, 4);
+    memcpy(buf + 16, &seq, 8);
+    memcpy(buf + 24, &atime, 8);
+    memcpy(buf + 32, &mtime, 8);
+    memcpy(buf + 40, &size, 8);
+}
+
+void wire_decode(const uint8_t *buf, wire_frame_t *frame)
+{
+    uint16_t path_len;
+    uint32_t mode, uid, gid;
+    uint64_t seq, atime, mtime, size;
+    memcpy(&path_len, buf + 2, 2);
+    memcpy(&mode, buf + 4, 4);
+    memcpy(&uid, buf + 8, 4);
+    memcpy(&gid, buf + 12, 4);
+    memcpy(&seq, buf + 16, 8);
+    memcpy(&atime, buf + 24, 8);
+    memcpy(&mtime, buf + 32, 8);
+    memcpy(&size, buf + 40, 8);
+
+    frame->op = buf[0];
+    frame->path_len = be16toh(path_len);
+    frame->mode = be32toh(mode);
+    frame->uid = be32toh(uid);
+    frame->gid = be32toh(gid);
+    frame->seq = be64toh(seq);
+    frame->atime_ns = (int64_t)be64toh(atime);
+    frame->mtime_ns = (int64_t)be64toh(mtime);
+    frame->size = be64toh(size);
+}
+
+// paths on the wire are relative to the backup root and never climb out of it
+int wire_valid_path(const char *path, int allow_root)
+{
+    if (!*path)
+        return allow_root;
+    if (path[0] == '/')
+        return 0;
+    const char *p = path;
+    while (*p)
+    {
+        const char *end = strchrnul(p, '/');
+        size_t len = end - p;
+        if (len == 0 || (len == 1 && p[0] == '.') || (len == 2 && p[0] == '.' && p[1] == '.'))
+            return 0;
+        p = *end ? end + 1 : end;
+    }
+    return 1;
+}
@@ -0,0 +1,51 @@
+// clang-format off
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <stdint.h>
+
+#define WIRE_VERSION 2
+#define WIRE_HEADER_LEN 48
+#define WIRE_UNIX_PREFIX "unix:"
+#define WIRE_TCP_PREFIX "tcp:"
+#define WIRE_BACKLOG 16
+
+typedef enum
+{
+    WIRE_HELLO = 1,
+    WIRE_SCAN,
+    WIRE_HAVE,
+    WIRE_MKDIR,
+    WIRE_FILE,
+    WIRE_SYMLINK,
+    WIRE_REMOVE,
+    WIRE_ATTR,
+    WIRE_PRUNE,
+    WIRE_SYNC,
+    WIRE_ACK = 64,
+    WIRE_NEED,
+    WIRE_FAIL
+} wire_op_t;
+
+typedef struct
+{
+    uint8_t op;
+    uint16_t path_len;
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    uint64_t seq;
+    int64_t atime_ns;
+    int64_t mtime_ns;
+    uint64_t size;
+} wire_frame_t;
+
+int wire_is_endpoint(const char *spec);
+int wire_connect(const char *spec);
+int wire_listen(const char *spec);
+void wire_unlink(const char *spec);
+void wire_encode(uint8_t *buf, const wire_frame_t *frame);
+void wire_decode(const uint8_t *buf, wire_frame_t *frame);
+int wire_valid_path(const char *path, int allow_root);
+
+#endif